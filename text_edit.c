@@ -4,22 +4,154 @@
 #define _GNU_SOURCE
 
 #include <ctype.h>
+#include <dirent.h>
+#include <limits.h>
+#include <libgen.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <pty.h>
+#include <regex.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CIPHER_X86 1
+#endif
+
 /*** defines ***/
 
 #define CHECK_QUIT 1
 #define TAB_STOP 8
+//The key for encryption is 3 that is added to the ASCII value of each byte.
+#define CIPHER_KEY 3
+//Files at least this big are mapped and decrypted one row at a time.
+#define LAZY_OPEN_MIN (16 * 1024 * 1024)
+//How much of a mapped file to index before dropping its pages again.
+#define LAZY_INDEX_WINDOW (64 * 1024 * 1024)
+//Size of the blocks smaller files are read and decrypted in.
+#define OPEN_BLOCK_SIZE (1024 * 1024)
+//Bytes of a regular file each worker reads and splits into rows at a time.
+#define LOAD_PART_SIZE (4 * 1024 * 1024)
+//Rows each worker replaces matches in at a time.
+#define REPLACE_PART_ROWS (64 * 1024)
+//Most threads a file is opened with.
+#define MAX_WORKERS 64
+//Rows shorter than ROW_INLINE bytes keep their chars inside the erow. Other
+//row buffers up to SLAB_MAX bytes come in power-of-two size classes from
+//SLAB_MIN up, carved out of SLAB_SIZE slabs, and bigger ones from malloc.
+#define ROW_INLINE 16
+#define SLAB_MIN 16
+#define SLAB_MAX 4096
+#define SLAB_CLASSES 9
+#define SLAB_SIZE (256 * 1024)
+//Size of the buffer rows are encrypted into while saving.
+#define SAVE_BUFFER_SIZE (1024 * 1024)
+//Files saved with an authenticated cipher start with a header of this size,
+//beginning with FILE_MAGIC, and hold their text in chunks of CHUNK_SIZE
+//bytes, each followed by a tag.
+#define FILE_HEADER_SIZE 16
+#define FILE_MAGIC "ETE1"
+#define CHUNK_SIZE (64 * 1024)
+#define CHUNK_TAG_SIZE 16
+//The search filter keeps a bitmap for each block of rows, which covers up
+//to FILTER_BLOCK_ROWS rows and FILTER_BLOCK_BYTES bytes of text when it is
+//built. A bitmap has about a bit for every two bytes of text, a power of
+//two from 1 << FILTER_MIN_BITS_LOG up to 1 << FILTER_BITS_LOG bits. Each worker
+//builds the filter for FILTER_STEP_BYTES bytes at a time between keys.
+#define FILTER_MIN_BITS_LOG 9
+#define FILTER_BITS_LOG 14
+#define FILTER_BLOCK_ROWS 1024
+#define FILTER_BLOCK_BYTES (8 * 1024)
+#define FILTER_STEP_BYTES (256 * 1024)
+//--bench runs the editor in a terminal of BENCH_ROWS by BENCH_COLS, on
+//corpora up to BENCH_DEFAULT_MAX bytes unless told otherwise. Each corpus
+//gets BENCH_KEYS keys of scrolling and of typing, a paste of
+//BENCH_PASTE_BYTES bytes and BENCH_SAVES saves.
+#define BENCH_ROWS 40
+#define BENCH_COLS 120
+#define BENCH_DEFAULT_MAX (64 * 1024 * 1024)
+#define BENCH_KEYS 1000
+#define BENCH_PASTE_BYTES (64 * 1024)
+#define BENCH_SAVES 20
+//One word in BENCH_TAB_EVERY of a corpus is a tab.
+#define BENCH_TAB_EVERY 16
+//The cipher kernels are timed on a buffer of BENCH_CIPHER_BYTES, far bigger
+//than the caches, keeping the best of BENCH_CIPHER_RUNS passes.
+#define BENCH_CIPHER_BYTES (64 * 1024 * 1024)
+#define BENCH_CIPHER_RUNS 5
+//Saves of a corpus of up to BENCH_CRASH_BYTES are killed BENCH_CRASHES
+//times at points spread over how long a save takes.
+#define BENCH_CRASH_BYTES (16 * 1024 * 1024)
+#define BENCH_CRASHES 10
+//Files with mixed line endings make a round trip at BENCH_TRIP_BYTES, and
+//that much over the size where files are mapped.
+#define BENCH_TRIP_BYTES (4 * 1024 * 1024)
+//Lines inserted one by one at the top, middle and end of an empty buffer.
+#define BENCH_INSERT_LINES 1000000
+//Random edits made to a buffer of BENCH_UNDO_ROWS rows, then undone and
+//redone.
+#define BENCH_UNDO_EDITS 1000000
+#define BENCH_UNDO_ROWS 10000
+//Saves are timed on corpora from BENCH_SAVE_MIN bytes up to the biggest
+//size asked for, with the memory of the editor sampled every
+//BENCH_SAMPLE_US while they run.
+#define BENCH_SAVE_MIN (1024 * 1024)
+#define BENCH_SAMPLE_US 1000
+//The biggest corpus is opened with each of BENCH_THREAD_COUNTS threads,
+//keeping the best of BENCH_LOAD_RUNS opens.
+#define BENCH_THREAD_COUNTS 5
+#define BENCH_LOAD_RUNS 3
+//Queries are stepped through BENCH_SEARCH_HITS matches at a time in the
+//biggest corpus, before and after the search filter is built, keeping the
+//best of BENCH_SEARCH_RUNS runs.
+#define BENCH_SEARCH_HITS 100
+#define BENCH_SEARCH_RUNS 5
+//Rows with tabs and without are compared on corpora of up to
+//BENCH_TABS_BYTES, which are read rather than mapped, with a tab for one
+//word in BENCH_TABS_HEAVY or none at all.
+#define BENCH_TABS_BYTES (8 * 1024 * 1024)
+#define BENCH_TABS_HEAVY 2
+//A corpus of BENCH_SHORT_LINES lines of a few characters each, or as many
+//as fit in the biggest size asked for, times opening many tiny rows.
+#define BENCH_SHORT_LINES 10000000
+//Keys sent to files holding one line of BENCH_LINE_BYTES.
+#define BENCH_LINE_BYTES (1024 * 1024)
+#define BENCH_LINE_KEYS 10000
+//Pastes into an empty file grow from BENCH_PASTE_BYTES by 16 times up to
+//BENCH_PASTE_MAX, or the biggest size asked for.
+#define BENCH_PASTE_MAX (16 * 1024 * 1024)
+//Lines pasted with soft wrap on before paging through them.
+#define BENCH_WRAP_LINES 5000
+//The profile overlay covers the last PROFILE_FRAMES frames, and a trace
+//keeps up to TRACE_MAX_EVENTS events.
+#define PROFILE_FRAMES 256
+#define TRACE_MAX_EVENTS (4 * 1024 * 1024)
+//Stage runs shorter than this many nanoseconds are only counted in the
+//totals of their frame, not traced on their own.
+#define TRACE_MIN_NS 1000
+//The soft-wrap index keeps the screen lines of each row in blocks of
+//WRAP_BLOCK_ROWS rows, which are split once they grow to twice that.
+#define WRAP_BLOCK_ROWS 512
+//Scrolls by fewer lines than this are done by the terminal.
+#define SCROLL_REGION_MAX(rows) ((rows) / 2)
 #define CTRL_KEY(k) ((k) & 0x1f)
 
 enum specialKey {
@@ -32,31 +164,95 @@ enum specialKey {
     //1002
     ARROW_LEFT,
     //1003
-    ARROW_RIGHT
+    ARROW_RIGHT,
+    PAGE_UP,
+    PAGE_DOWN,
+    //Bracketed paste markers sent by the terminal around pasted text.
+    PASTE_START,
+    PASTE_END,
+    //Returned instead of a key when none arrived while a save is running, so
+    //the screen can show how far along it is.
+    SAVE_TICK,
+    //Returned instead of a key when none arrived but the terminal changed
+    //size, so the screen is drawn again at the new size.
+    WINDOW_RESIZED
 };
 
 /*** data ***/
 
+//Position of a tab in a row, both in chars and in render.
+typedef struct tabStop {
+    int at;
+    int render_x;
+} tabStop;
+
 //store a row of text in the editor.
 typedef struct erow {
     //size of the row.
     int size;
+    //Bytes allocated for chars, which is kept bigger than size while a row
+    //is being edited.
+    int cap;
     char *chars;
+    //chars of a short row, used when inlined is set. chars has to be
+    //pointed back here whenever the erow is moved.
+    char short_chars[ROW_INLINE];
+    int inlined;
     //size of the contents of render.
     int size_r;
+    //Bytes allocated for render. A row without tabs draws exactly as its
+    //chars, so render then points at chars and rcap is 0.
+    int rcap;
     char *render;
+    //Tabs of the row in order, used to map between chars and render
+    //columns. ntabs is -1 until the index is built after an edit.
+    tabStop *tabs;
+    int ntabs;
+    //Encrypted bytes of the row inside a mapped file. chars stays NULL until
+    //the row is needed for the first time.
+    const char *mapped;
+    //Where the row was written by the last save (or read from on open) and
+    //how long it was there. disk_off is -1 for rows that aren't on disk as
+    //they are, such as new rows or rows that had a CRLF ending.
+    off_t disk_off;
+    int disk_size;
+    //Set when chars changed since the row was last saved.
+    int modified;
+    //Snapshot that was current when chars was allocated. While a save runs
+    //from a newer snapshot, chars may still be read by it and is copied
+    //before it is changed.
+    unsigned version;
 } erow;
 
+//A row as it was when a save started. A save reads only these, so it can
+//run on its own thread while the rows are edited.
+typedef struct saveRow {
+    //chars of the row, or its encrypted bytes in a mapped file when plain
+    //is 0. The chars of a short row are copied into short_chars, since the
+    //erow holding them may move.
+    const char *bytes;
+    char short_chars[ROW_INLINE];
+    int size;
+    int plain;
+    //disk_off, disk_size and modified of the row, which the save updates
+    //and which are copied back to the rows if they weren't edited meanwhile.
+    off_t disk_off;
+    int disk_size;
+    int modified;
+} saveRow;
+
 
 struct abuf {
     //Pointer to our buffer memory
     char *b;
     //Length of the buffer
     int len;
+    //Bytes allocated for the buffer, which grows by doubling.
+    int cap;
 };
 
 //Define an empty buffer.
-#define ABUF_INIT {NULL, 0}
+#define ABUF_INIT {NULL, 0, 0}
 
 
 struct Config {
@@ -72,23 +268,190 @@ struct Config {
     int screencols;
     //Total number of rows written in a file.
     int numrows;
-    //Array of erow structs.
+    //Gap buffer of erow structs. Rows before gap_start sit at the front of
+    //the array and the rest sit after the gap, so an insert or delete only
+    //moves the rows between the previous edit point and the new one.
     erow *row;
+    int gap_start;
+    int gap_len;
+    //Screen lines that have to be redrawn on the next refresh.
+    char *dirty;
+    //rowoff/coloff the text area was last drawn with.
+    int drawn_rowoff;
+    int drawn_coloff;
+    //Bytes written to the terminal by the last refresh.
+    int frame_bytes;
+    //Output buffer that is kept and reused by every refresh.
+    struct abuf frame;
+    //Heap allocations made so far, and by the last refresh.
+    unsigned long allocations;
+    int frame_allocs;
+    //Read-only mapping of a large file that rows are decrypted from lazily.
+    char *map;
+    size_t map_len;
+    //Threads that read and index a file when it is opened.
+    int workers;
     char *filename;
+    //Identity of the file as it was last opened or saved, which tells a save
+    //whether the disk offsets of the rows still describe the file.
+    dev_t disk_dev;
+    ino_t disk_ino;
+    off_t disk_size;
+    struct timespec disk_mtime;
     int updated;
+    //Save running in the background, or NULL.
+    struct saveJob *save;
+    //Set when Ctrl-S was pressed during that save, to save again after it.
+    int save_again;
+    //Number of the last snapshot taken by a save.
+    unsigned snapshot;
+    //chars buffers that were replaced while the running save still reads
+    //them, freed once it is done.
+    struct retiredChars *retired;
+    int nretired;
+    int retired_cap;
+    //Search filter, blocks of neighbouring rows in order. filter_todo is
+    //the first block that may not be built yet and filter_todo_start the
+    //row it starts at, and filter_hint the block found last and the row it
+    //starts at. Nothing is built before filter_wanted is set by the first
+    //search.
+    struct filterBlock *filter;
+    int nfilter;
+    int filter_cap;
+    int filter_todo;
+    int filter_todo_start;
+    int filter_hint;
+    int filter_hint_start;
+    int filter_wanted;
+    //Set while rows longer than the screen is wide are wrapped onto more
+    //lines instead of scrolled sideways. rowoff then counts screen lines.
+    int wrap;
+    //Soft-wrap index, blocks of neighbouring rows in order, with Fenwick
+    //trees over the rows and the screen lines of the blocks. wrap_cols is
+    //the width it was built for, and wrap_moved the first row that got more
+    //or fewer lines since the last refresh, or -1.
+    struct wrapBlock *wrap_blocks;
+    int nwrap;
+    int wrap_cap;
+    int *wrap_row_tree;
+    int *wrap_line_tree;
+    int wrap_cols;
+    int wrap_moved;
+    //Where the cursor was when the search prompt was opened.
+    int search_x, search_y;
+    //Log of edits that can be undone, which ops are only appended to. The
+    //ops before undo_end can be undone, undo_last being the last of them,
+    //and the ones from there to undo_len redone.
+    char *undo_log;
+    size_t undo_len;
+    size_t undo_cap;
+    size_t undo_end;
+    long undo_last;
+    //Number of the keypress being handled, which groups its ops.
+    unsigned undo_group;
+    //Set while ops are undone or redone, so they aren't recorded again.
+    int undo_replaying;
     //Status message in the status bar.
-    char message[100];
+    char message[128];
     //Timestamp for the status message to erase it few seconds after displayed.
     time_t message_time;
     //original terminal attribute
     struct termios orig_attribute;
+    //Set while the profile overlay is shown in the message bar.
+    int overlay;
+    //Bytes read from the terminal that haven't been turned into keys yet.
+    char input[4096];
+    int input_len;
+    int input_pos;
+};
+
+//Run of neighbouring rows with a bitmap of the trigrams in their text, so a
+//search can skip all of them when the bit of a trigram of the query isn't
+//set. Edits only ever set bits, which keeps the bitmap a superset of the
+//trigrams in the rows until it is rebuilt. The bitmaps are only kept in
+//memory.
+struct filterBlock {
+    int rows;
+    //Bytes of text in the rows when it was built plus those added since.
+    int bytes;
+    //Bitmap of 1 << bits_log bits, or NULL until the block is built.
+    uint64_t *bits;
+    int bits_log;
+    //Bit for each byte value in the rows, which lets queries too short to
+    //have a trigram skip blocks as well.
+    uint64_t bytes_seen[4];
+};
+
+//Run of neighbouring rows in the soft-wrap index, with the number of screen
+//lines each of them takes.
+struct wrapBlock {
+    int rows;
+    int cap;
+    int *lines;
+    //Screen lines of all the rows.
+    int total;
+    //Longest render of the rows. Edits only ever raise it, so it may be
+    //more than the longest is now.
+    int longest;
+};
+
+//Kinds of edits in the undo log.
+enum undoType {
+    OP_INSERT_ROW,
+    OP_DELETE_ROW,
+    OP_INSERT_TEXT,
+    OP_DELETE_TEXT,
+    OP_REPLACE_ROW
+};
+
+//Edit in the undo log, followed by its text: the row or text inserted or
+//deleted, or for OP_REPLACE_ROW the old row and then the new one.
+struct undoOp {
+    int type;
+    //Keypress the op was made by. The ops of a keypress are undone
+    //together.
+    unsigned group;
+    //Row, and index in it, that the edit was made at.
+    int y;
+    int x;
+    int len;
+    int len2;
+    //Set on an op of typed characters, which the next keys may add to.
+    int typed;
+    //Offset of the op before it in the log, or -1.
+    long prev;
+};
+
+//A chars buffer waiting for the running save to finish.
+struct retiredChars {
+    char *chars;
+    int cap;
 };
 
 //Variable containing state of the text file.
 struct Config T;
 
 void updateStatusBar(const char *msg, ...);
-char *getNewFileName(char *s);
+void updateRender(erow *row);
+char *getPromptInput(char *s, void (*callback)(char *, int), int allow_empty);
+void saveFile();
+void finishSave();
+void resetFilter();
+void filterInsertRow(int at, erow *row);
+void filterEditRow(erow *row, int from, int to);
+void filterDeleteRow(int at);
+void wrapInsertRow(int at, erow *row);
+void wrapEditRow(erow *row);
+void wrapDeleteRow(int at);
+int wrapLineOf(int at, int *lines);
+void wrapResize();
+void resetWrap();
+int resizeScreen();
+int filterPending();
+void buildFilterStep();
+char *recordOp(int type, int y, int x, int len, int len2);
+void recordTyped(int y, int x, int c, int deleted);
+void copyRowText(char *dst, erow *row);
 
 
 /*** terminal ***/
@@ -106,23 +469,63 @@ void error_exit(const char *error_type) {
     exit(1);
 }
 
+int nextInputByte() {
+    /*
+    Return the next byte of input, or -1 if nothing arrives before the read
+    timeout. Everything the terminal has ready is read at once and handed
+    out from the input buffer.
+    */
+    if (T.input_pos == T.input_len) {
+        int read_len = read(STDIN_FILENO, T.input, sizeof(T.input));
+        if (read_len == -1 && errno != EAGAIN) error_exit("read");
+        T.input_pos = 0;
+        T.input_len = read_len > 0 ? read_len : 0;
+        if (T.input_len == 0) return -1;
+    }
+    return (unsigned char)T.input[T.input_pos++];
+}
+
+int inputPending() {
+    /*
+    Check whether another key can be read without waiting.
+    */
+    if (T.input_pos < T.input_len) return 1;
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    return poll(&pfd, 1, 0) > 0;
+}
+
 int readOneKey() {
     /*
     Wait for one keypress and return it.
     */
-    int read_key;
-    char key_val;
-    while ((read_key = read(STDIN_FILENO, &key_val, 1)) != 1) {
-        if (read_key == -1 && errno != EAGAIN) error_exit("read");
+    int key_val;
+    //Build the search filter while no key is waiting.
+    while (filterPending() && !inputPending()) buildFilterStep();
+    while ((key_val = nextInputByte()) == -1) {
+        if (T.save != NULL) return SAVE_TICK;
+        if (resizeScreen()) return WINDOW_RESIZED;
     }
     //If it reads an escape character, read two more bytes into next buffer.
     if (key_val == '\x1b') {
-        char next[3];
+        int next[2];
 
-        if (read(STDIN_FILENO, &next[0], 2) != 2) return '\x1b';
+        if ((next[0] = nextInputByte()) == -1) return '\x1b';
+        if ((next[1] = nextInputByte()) == -1) return '\x1b';
 
         if (next[0] == '[') {
-            if (next[1] < '0' || next[1] > '9') {
+            if (next[1] >= '0' && next[1] <= '9') {
+                //Read the rest of a numbered sequence like '\x1b[200~'.
+                int num = next[1] - '0';
+                int digit;
+                while ((digit = nextInputByte()) >= '0' && digit <= '9')
+                    num = num * 10 + (digit - '0');
+                if (digit == '~') {
+                    if (num == 5) return PAGE_UP;
+                    if (num == 6) return PAGE_DOWN;
+                    if (num == 200) return PASTE_START;
+                    if (num == 201) return PASTE_END;
+                }
+            } else {
                 switch (next[1]) {
                     //'\xlb[A' is arrow up key.
                     case 'A': return ARROW_UP;
@@ -185,362 +588,7008 @@ int getWindowSize(int *rows, int *cols) {
     }
 }
 
-/*** row operations ***/
+int resizeScreen() {
+    /*
+    Pick up a new size of the terminal, if it changed, and return whether
+    it did. Only the size the terminal reports is used, since asking for the
+    cursor position would eat keys that are on their way in.
+    */
+    struct winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0)
+        return 0;
+    int rows = ws.ws_row - 2;
+    if (rows < 1) rows = 1;
+    if (rows == T.screenrows && ws.ws_col == T.screencols) return 0;
+
+    T.screenrows = rows;
+    T.screencols = ws.ws_col;
+    T.dirty = realloc(T.dirty, T.screenrows);
+    memset(T.dirty, 1, T.screenrows);
+    if (T.wrap) wrapResize();
+    return 1;
+}
 
-int convertToRender(erow *row, int cursor_x) {
-    int render_x = 0;
-    int j;
-    for (j = 0; j < cursor_x; j++) {
-        if (row->chars[j] == '\t')
-            //Add how many columns left to the next tab stop.
-            render_x += (TAB_STOP - 1) - (render_x % TAB_STOP);
-        render_x++;
+/*** profile ***/
+
+//Stages of the editor that are timed while profiling.
+enum profileStage {
+    STAGE_INPUT,
+    STAGE_RENDER,
+    STAGE_ROWS,
+    STAGE_WRITE,
+    STAGE_CIPHER,
+    STAGES
+};
+
+const char *stageNames[STAGES] = {
+    "readOneKey", "updateRender", "createRows", "write", "cipher"
+};
+
+//Stage run or frame drawn, for the trace. Frames carry the bytes written,
+//the allocations made and the time of each stage since the frame before.
+struct traceEvent {
+    //Index into stageNames, or -1 for a frame.
+    int stage;
+    int tid;
+    long long start;
+    long long dur;
+    int bytes;
+    int allocs;
+    float stage_us[STAGES];
+};
+
+//Timing of the stages of the editor, taken while the overlay is shown or a
+//trace is recorded. Stages also run on the load, save and worker threads,
+//so their times are added up atomically and trace events are appended
+//under a lock.
+struct profile {
+    //Set by the main thread and read by all of them.
+    atomic_int on;
+    //Time spent in each stage since the last frame was drawn.
+    atomic_llong stage_ns[STAGES];
+    //When the first key of the frame being made was read, or 0.
+    long long frame_start;
+    //Last PROFILE_FRAMES frames drawn after a key, oldest overwritten first:
+    //time from the key to the frame being written, the time of each stage
+    //in between, and the bytes and allocations of the frame.
+    long long frame_ns[PROFILE_FRAMES];
+    long long frame_stage_ns[PROFILE_FRAMES][STAGES];
+    int frame_bytes[PROFILE_FRAMES];
+    int frame_allocs[PROFILE_FRAMES];
+    int frames;
+    //File the trace is written to on exit, or NULL, and its events.
+    const char *trace_file;
+    pthread_mutex_t lock;
+    struct traceEvent *events;
+    size_t nevents;
+    size_t events_cap;
+    long dropped;
+};
+
+struct profile profile = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+//Time a stage while profiling. With profiling off this costs a load and a
+//branch, and the end of a stage that started then does nothing.
+#define PROFILING() atomic_load_explicit(&profile.on, memory_order_relaxed)
+#define PROFILE_BEGIN() (PROFILING() ? profileNow() : 0)
+#define PROFILE_END(stage, start) \
+    do { if (start) profileEnd(stage, start); } while (0)
+
+long long profileNow() {
+    /*
+    Return nanoseconds on the monotonic clock.
+    */
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void traceEvent(struct traceEvent *event) {
+    /*
+    Append an event to the trace, or count it as dropped once the trace is
+    full.
+    */
+    pthread_mutex_lock(&profile.lock);
+    if (profile.nevents == profile.events_cap &&
+            profile.events_cap < TRACE_MAX_EVENTS) {
+        profile.events_cap = profile.events_cap ? profile.events_cap * 2 :
+            4096;
+        profile.events = realloc(profile.events,
+            sizeof(struct traceEvent) * profile.events_cap);
+    }
+    if (profile.nevents < profile.events_cap) {
+        profile.events[profile.nevents++] = *event;
+    } else {
+        profile.dropped++;
     }
-    return render_x;
+    pthread_mutex_unlock(&profile.lock);
 }
 
-void updateRender(erow *row) {
+void profileEnd(int stage, long long start) {
     /*
-    Use chars string of an erow to fill the contents of the render string.
+    Add the time since start to a stage, and trace the run if it was long
+    enough to show.
     */
-    int tabs = 0;
+    long long dur = profileNow() - start;
+    atomic_fetch_add_explicit(&profile.stage_ns[stage], dur,
+        memory_order_relaxed);
+    //Runs of a stage too short to see in a trace, like decrypting one row,
+    //only count towards the totals of the frame.
+    if (profile.trace_file != NULL && dur >= TRACE_MIN_NS) {
+        struct traceEvent event = {stage, gettid(), start, dur, 0, 0, {0}};
+        traceEvent(&event);
+    }
+}
+
+void profileKey() {
+    /*
+    Note that a key was read, which the next frame answers.
+    */
+    if (PROFILING() && profile.frame_start == 0)
+        profile.frame_start = profileNow();
+}
+
+void profileFrame(int bytes, int allocs) {
+    /*
+    Close the stats of a frame that was just written to the terminal.
+    */
+    if (!PROFILING()) return;
+    long long now = profileNow();
+    long long stage_ns[STAGES];
+    int i;
+    for (i = 0; i < STAGES; i++)
+        stage_ns[i] = atomic_exchange_explicit(&profile.stage_ns[i], 0,
+            memory_order_relaxed);
+    if (profile.trace_file != NULL) {
+        long long start = profile.frame_start ? profile.frame_start : now;
+        struct traceEvent event = {-1, gettid(), start, now - start, bytes,
+            allocs, {0}};
+        for (i = 0; i < STAGES; i++) event.stage_us[i] = stage_ns[i] / 1e3;
+        traceEvent(&event);
+    }
+    //Frames drawn without a key, like the ticks of a running save, are
+    //left out of the overlay.
+    if (profile.frame_start == 0) return;
+
+    int slot = profile.frames++ % PROFILE_FRAMES;
+    profile.frame_ns[slot] = now - profile.frame_start;
+    memcpy(profile.frame_stage_ns[slot], stage_ns, sizeof(stage_ns));
+    profile.frame_bytes[slot] = bytes;
+    profile.frame_allocs[slot] = allocs;
+    profile.frame_start = 0;
+}
+
+int compareLongs(const void *a, const void *b) {
+    /*
+    Order two long longs for qsort().
+    */
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+int profileOverlay(char *buf, int size) {
+    /*
+    Write a line about the last frames for the overlay: percentiles of
+    their time from key to frame, the average time of the stages other than
+    waiting for keys, and their average output and allocations.
+    */
+    int n = profile.frames < PROFILE_FRAMES ? profile.frames : PROFILE_FRAMES;
+    if (n == 0) return snprintf(buf, size, "profiling: waiting for a key");
+
+    long long sorted[PROFILE_FRAMES];
+    double stage_ms[STAGES] = {0};
+    double bytes = 0;
+    double allocs = 0;
+    int i, j;
+    for (i = 0; i < n; i++) {
+        sorted[i] = profile.frame_ns[i];
+        for (j = 0; j < STAGES; j++)
+            stage_ms[j] += profile.frame_stage_ns[i][j] / 1e6 / n;
+        bytes += (double)profile.frame_bytes[i] / n;
+        allocs += (double)profile.frame_allocs[i] / n;
+    }
+    qsort(sorted, n, sizeof(long long), compareLongs);
+    return snprintf(buf, size, "frame p50 %.2fms p99 %.2fms | render %.2f "
+        "rows %.2f write %.2f cipher %.2f ms | %.0fB %.1fa per frame (%d)",
+        sorted[n / 2] / 1e6, sorted[n * 99 / 100] / 1e6,
+        stage_ms[STAGE_RENDER], stage_ms[STAGE_ROWS], stage_ms[STAGE_WRITE],
+        stage_ms[STAGE_CIPHER], bytes, allocs, n);
+}
+
+void writeTrace() {
+    /*
+    Write the trace as Chrome trace events, which chrome://tracing and
+    Perfetto open: a complete event for every stage run that was long
+    enough, and for every frame one from its key to when it was written
+    plus counters of its bytes, allocations and stage times.
+    */
+    FILE *fp = fopen(profile.trace_file, "w");
+    if (fp == NULL) return;
+    size_t i;
     int j;
+    pthread_mutex_lock(&profile.lock);
+    long long base = profile.nevents ? profile.events[0].start : 0;
+    fprintf(fp, "{\"traceEvents\": [\n");
+    for (i = 0; i < profile.nevents; i++) {
+        struct traceEvent *e = &profile.events[i];
+        double ts = (e->start - base) / 1e3;
+        fprintf(fp, "%s{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, "
+            "\"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}", i ? ",\n" : "",
+            e->stage == -1 ? "frame" : stageNames[e->stage], e->tid, ts,
+            e->dur / 1e3);
+        if (e->stage != -1) continue;
+        ts = (e->start + e->dur - base) / 1e3;
+        fprintf(fp, ",\n{\"name\": \"output\", \"ph\": \"C\", \"pid\": 1, "
+            "\"ts\": %.3f, \"args\": {\"bytes\": %d, \"allocs\": %d}}", ts,
+            e->bytes, e->allocs);
+        fprintf(fp, ",\n{\"name\": \"stage_us\", \"ph\": \"C\", "
+            "\"pid\": 1, \"ts\": %.3f, \"args\": {", ts);
+        for (j = 0; j < STAGES; j++)
+            fprintf(fp, "%s\"%s\": %.1f", j ? ", " : "", stageNames[j],
+                e->stage_us[j]);
+        fprintf(fp, "}}");
+    }
+    fprintf(fp, "\n], \"otherData\": {\"dropped_events\": %ld}}\n",
+        profile.dropped);
+    pthread_mutex_unlock(&profile.lock);
+    fclose(fp);
+}
 
-    //Loop through the chars of the row and count the tabs to know how much
-    //memory to allocate for render.
-    for (j = 0; j < row->size; j++)
-        if (row->chars[j] == '\t') tabs++;
+void initProfile() {
+    /*
+    Record a trace from the start if TEXT_EDIT_TRACE names a file to write
+    it to on exit.
+    */
+    profile.trace_file = getenv("TEXT_EDIT_TRACE");
+    if (profile.trace_file == NULL) return;
+    atomic_store_explicit(&profile.on, 1, memory_order_relaxed);
+    atexit(writeTrace);
+}
 
-    free(row->render);
-    row->render = malloc(row->size + tabs*(TAB_STOP - 1) + 1);
+void toggleOverlay() {
+    /*
+    Show or hide the profile of the last frames in the message bar. The
+    stages are only timed while it is shown or a trace is recorded.
+    */
+    T.overlay = !T.overlay;
+    atomic_store_explicit(&profile.on, T.overlay || profile.trace_file != NULL,
+        memory_order_relaxed);
+    if (T.overlay) profile.frames = 0;
+}
 
-    int idx = 0;
+/*** cipher ***/
 
-    //Copy each character from chars to render.
-    for (j = 0; j < row->size; j++) {
-        //If the current character is a tab, append space until a column that
-        //is divisible by the tab stop.
-        if (row->chars[j] == '\t') {
-            row->render[idx++] = ' ';
-            while (idx % TAB_STOP != 0) row->render[idx++] = ' ';
-        } else {
-            row->render[idx++] = row->chars[j];
+//Kernel picked by initCipher() for the CPU the editor runs on.
+void (*shiftKernel)(char *buf, size_t len, int key);
+const char *shiftKernelName;
+
+void shiftScalar(char *buf, size_t len, int key) {
+    /*
+    Add the key to every byte of the buffer except newlines.
+    */
+    size_t i;
+    for (i = 0; i < len; i++) {
+        if (buf[i] != '\n') {
+            buf[i] = buf[i] + key;
         }
     }
+}
 
-    //Set the size of the render to the size of the char.
-    row->render[idx] = '\0';
-    row->size_r = idx;
+#ifdef CIPHER_X86
+__attribute__((target("sse2")))
+void shiftSSE2(char *buf, size_t len, int key) {
+    /*
+    Shift 64 bytes per iteration with 16-byte SSE2 vectors.
+    */
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i shift = _mm_set1_epi8((char)key);
+    size_t i = 0;
+    int k;
+
+    for (; i + 64 <= len; i += 64) {
+        for (k = 0; k < 64; k += 16) {
+            __m128i *p = (__m128i *)(buf + i + k);
+            __m128i v = _mm_loadu_si128(p);
+            //Zero the key in lanes that hold a newline so they are kept.
+            __m128i mask = _mm_cmpeq_epi8(v, newline);
+            _mm_storeu_si128(p, _mm_add_epi8(v, _mm_andnot_si128(mask, shift)));
+        }
+    }
+    for (; i + 16 <= len; i += 16) {
+        __m128i *p = (__m128i *)(buf + i);
+        __m128i v = _mm_loadu_si128(p);
+        __m128i mask = _mm_cmpeq_epi8(v, newline);
+        _mm_storeu_si128(p, _mm_add_epi8(v, _mm_andnot_si128(mask, shift)));
+    }
+    shiftScalar(buf + i, len - i, key);
 }
 
-void insertRow(int current_row, char *s, size_t len) {
+__attribute__((target("avx2")))
+void shiftAVX2(char *buf, size_t len, int key) {
     /*
-    Insert the context in the row.
+    Shift 64 bytes per iteration with 32-byte AVX2 vectors.
     */
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i shift = _mm256_set1_epi8((char)key);
+    size_t i = 0;
+
+    for (; i + 64 <= len; i += 64) {
+        __m256i *p = (__m256i *)(buf + i);
+        __m256i a = _mm256_loadu_si256(p);
+        __m256i b = _mm256_loadu_si256(p + 1);
+        __m256i mask_a = _mm256_cmpeq_epi8(a, newline);
+        __m256i mask_b = _mm256_cmpeq_epi8(b, newline);
+        _mm256_storeu_si256(p, _mm256_add_epi8(a, _mm256_andnot_si256(mask_a, shift)));
+        _mm256_storeu_si256(p + 1, _mm256_add_epi8(b, _mm256_andnot_si256(mask_b, shift)));
+    }
+    for (; i + 32 <= len; i += 32) {
+        __m256i *p = (__m256i *)(buf + i);
+        __m256i v = _mm256_loadu_si256(p);
+        __m256i mask = _mm256_cmpeq_epi8(v, newline);
+        _mm256_storeu_si256(p, _mm256_add_epi8(v, _mm256_andnot_si256(mask, shift)));
+    }
+    shiftScalar(buf + i, len - i, key);
+}
+#endif
 
-    //Validate the index of the column.
-    if (current_row < 0 || current_row > T.numrows) return;
+void encryptBuffer(char *buf, size_t len) {
+    /*
+    Shift the bytes of buf in place the way a file is saved.
+    */
+    if (!PROFILING()) {
+        shiftKernel(buf, len, CIPHER_KEY);
+        return;
+    }
+    long long start = profileNow();
+    shiftKernel(buf, len, CIPHER_KEY);
+    profileEnd(STAGE_CIPHER, start);
+}
+
+void decryptBuffer(char *buf, size_t len) {
+    /*
+    Shift the bytes of buf in place back, the way a file is read.
+    */
+    //Rows are decrypted one at a time, so keep the call to the kernel a
+    //tail call when not profiling.
+    if (!PROFILING()) {
+        shiftKernel(buf, len, -CIPHER_KEY);
+        return;
+    }
+    long long start = profileNow();
+    shiftKernel(buf, len, -CIPHER_KEY);
+    profileEnd(STAGE_CIPHER, start);
+}
+
+//Read and write little-endian words of the ChaCha20 and Poly1305 formats.
+#define LOAD32_LE(p) ((uint32_t)(p)[0] | ((uint32_t)(p)[1] << 8) | \
+    ((uint32_t)(p)[2] << 16) | ((uint32_t)(p)[3] << 24))
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define QUARTER_ROUND(a, b, c, d) \
+    a += b; d ^= a; d = ROTL32(d, 16); \
+    c += d; b ^= c; b = ROTL32(b, 12); \
+    a += b; d ^= a; d = ROTL32(d, 8); \
+    c += d; b ^= c; b = ROTL32(b, 7)
+
+void store32(unsigned char *p, uint32_t v) {
+    /*
+    Write v at p as a little-endian 32-bit word.
+    */
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+void store64(unsigned char *p, uint64_t v) {
+    /*
+    Write v at p as a little-endian 64-bit word.
+    */
+    store32(p, (uint32_t)v);
+    store32(p + 4, (uint32_t)(v >> 32));
+}
 
-    //Allocate space for a new row.
-    T.row = realloc(T.row, sizeof(erow) * (T.numrows + 1));
+void chachaSetup(uint32_t state[16], const unsigned char key[32],
+        uint32_t counter, const unsigned char nonce[12]) {
+    /*
+    Lay out the ChaCha20 state for a key, block counter and nonce.
+    */
+    int i;
 
-    //Make room at the specified index for the new row.
-    memmove(&T.row[current_row + 1], &T.row[current_row], sizeof(erow) * (T.numrows - current_row));
+    //"expand 32-byte k"
+    state[0] = 0x61707865;
+    state[1] = 0x3320646e;
+    state[2] = 0x79622d32;
+    state[3] = 0x6b206574;
+    for (i = 0; i < 8; i++) state[4 + i] = LOAD32_LE(key + 4 * i);
+    state[12] = counter;
+    for (i = 0; i < 3; i++) state[13 + i] = LOAD32_LE(nonce + 4 * i);
+}
 
-    //Set the current row size.
-    T.row[current_row].size = len;
+void chachaRounds(const uint32_t state[16], uint32_t x[16]) {
+    /*
+    Produce one keystream block as 16 words (RFC 8439).
+    */
+    int i;
+
+    memcpy(x, state, 16 * sizeof(uint32_t));
+    //Ten double rounds of column rounds followed by diagonal rounds.
+    for (i = 0; i < 10; i++) {
+        QUARTER_ROUND(x[0], x[4], x[8], x[12]);
+        QUARTER_ROUND(x[1], x[5], x[9], x[13]);
+        QUARTER_ROUND(x[2], x[6], x[10], x[14]);
+        QUARTER_ROUND(x[3], x[7], x[11], x[15]);
+        QUARTER_ROUND(x[0], x[5], x[10], x[15]);
+        QUARTER_ROUND(x[1], x[6], x[11], x[12]);
+        QUARTER_ROUND(x[2], x[7], x[8], x[13]);
+        QUARTER_ROUND(x[3], x[4], x[9], x[14]);
+    }
+    for (i = 0; i < 16; i++) x[i] += state[i];
+}
+
+void chachaXor(const unsigned char key[32], uint32_t counter,
+        const unsigned char nonce[12], unsigned char *buf, size_t len) {
+    /*
+    Encrypt or decrypt a buffer in place with the ChaCha20 keystream.
+    */
+    uint32_t state[16];
+    uint32_t x[16];
+    unsigned char block[64];
+    size_t i;
+    int k;
+
+    chachaSetup(state, key, counter, nonce);
+    //Whole blocks are xored a word at a time.
+    for (; len >= 64; len -= 64, buf += 64) {
+        chachaRounds(state, x);
+        state[12]++;
+        for (k = 0; k < 16; k++)
+            store32(buf + 4 * k, LOAD32_LE(buf + 4 * k) ^ x[k]);
+    }
+    if (len > 0) {
+        chachaRounds(state, x);
+        for (k = 0; k < 16; k++) store32(block + 4 * k, x[k]);
+        for (i = 0; i < len; i++) buf[i] ^= block[i];
+    }
+}
+
+void chachaBlock(const unsigned char key[32], uint32_t counter,
+        const unsigned char nonce[12], unsigned char out[64]) {
+    /*
+    Produce one 64-byte keystream block, used for the Poly1305 key.
+    */
+    uint32_t state[16];
+    uint32_t x[16];
+    int i;
+
+    chachaSetup(state, key, counter, nonce);
+    chachaRounds(state, x);
+    for (i = 0; i < 16; i++) store32(out + 4 * i, x[i]);
+}
+
+//Poly1305 state with the 130-bit numbers held in 26-bit limbs.
+struct poly1305 {
+    uint32_t r[5];
+    uint32_t h[5];
+    uint32_t pad[4];
+};
+
+void polyInit(struct poly1305 *st, const unsigned char key[32]) {
+    /*
+    Load the one-time Poly1305 key, clamping r as the algorithm requires.
+    */
+    st->r[0] = (LOAD32_LE(key + 0)) & 0x3ffffff;
+    st->r[1] = (LOAD32_LE(key + 3) >> 2) & 0x3ffff03;
+    st->r[2] = (LOAD32_LE(key + 6) >> 4) & 0x3ffc0ff;
+    st->r[3] = (LOAD32_LE(key + 9) >> 6) & 0x3f03fff;
+    st->r[4] = (LOAD32_LE(key + 12) >> 8) & 0x00fffff;
+    memset(st->h, 0, sizeof(st->h));
+    st->pad[0] = LOAD32_LE(key + 16);
+    st->pad[1] = LOAD32_LE(key + 20);
+    st->pad[2] = LOAD32_LE(key + 24);
+    st->pad[3] = LOAD32_LE(key + 28);
+}
+
+void polyBlocks(struct poly1305 *st, const unsigned char *m, size_t len) {
+    /*
+    Absorb whole 16-byte blocks. Partial blocks are zero-padded by the
+    caller, as the AEAD construction pads its input to 16 bytes anyway.
+    */
+    const uint32_t r0 = st->r[0], r1 = st->r[1], r2 = st->r[2];
+    const uint32_t r3 = st->r[3], r4 = st->r[4];
+    const uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+    uint32_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2];
+    uint32_t h3 = st->h[3], h4 = st->h[4];
+
+    while (len >= 16) {
+        uint64_t d0, d1, d2, d3, d4;
+        uint32_t c;
+
+        h0 += (LOAD32_LE(m + 0)) & 0x3ffffff;
+        h1 += (LOAD32_LE(m + 3) >> 2) & 0x3ffffff;
+        h2 += (LOAD32_LE(m + 6) >> 4) & 0x3ffffff;
+        h3 += (LOAD32_LE(m + 9) >> 6) & 0x3ffffff;
+        h4 += (LOAD32_LE(m + 12) >> 8) | (1 << 24);
+
+        d0 = (uint64_t)h0 * r0 + (uint64_t)h1 * s4 + (uint64_t)h2 * s3 +
+            (uint64_t)h3 * s2 + (uint64_t)h4 * s1;
+        d1 = (uint64_t)h0 * r1 + (uint64_t)h1 * r0 + (uint64_t)h2 * s4 +
+            (uint64_t)h3 * s3 + (uint64_t)h4 * s2;
+        d2 = (uint64_t)h0 * r2 + (uint64_t)h1 * r1 + (uint64_t)h2 * r0 +
+            (uint64_t)h3 * s4 + (uint64_t)h4 * s3;
+        d3 = (uint64_t)h0 * r3 + (uint64_t)h1 * r2 + (uint64_t)h2 * r1 +
+            (uint64_t)h3 * r0 + (uint64_t)h4 * s4;
+        d4 = (uint64_t)h0 * r4 + (uint64_t)h1 * r3 + (uint64_t)h2 * r2 +
+            (uint64_t)h3 * r1 + (uint64_t)h4 * r0;
+
+        c = (uint32_t)(d0 >> 26); h0 = (uint32_t)d0 & 0x3ffffff;
+        d1 += c; c = (uint32_t)(d1 >> 26); h1 = (uint32_t)d1 & 0x3ffffff;
+        d2 += c; c = (uint32_t)(d2 >> 26); h2 = (uint32_t)d2 & 0x3ffffff;
+        d3 += c; c = (uint32_t)(d3 >> 26); h3 = (uint32_t)d3 & 0x3ffffff;
+        d4 += c; c = (uint32_t)(d4 >> 26); h4 = (uint32_t)d4 & 0x3ffffff;
+        h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+        h1 += c;
+
+        m += 16;
+        len -= 16;
+    }
+    st->h[0] = h0;
+    st->h[1] = h1;
+    st->h[2] = h2;
+    st->h[3] = h3;
+    st->h[4] = h4;
+}
+
+void polyPadded(struct poly1305 *st, const unsigned char *m, size_t len) {
+    /*
+    Absorb a message zero-padded to a multiple of 16 bytes.
+    */
+    unsigned char block[16];
+    size_t whole = len & ~(size_t)15;
+
+    polyBlocks(st, m, whole);
+    if (len > whole) {
+        memset(block, 0, sizeof(block));
+        memcpy(block, m + whole, len - whole);
+        polyBlocks(st, block, 16);
+    }
+}
+
+void polyFinish(struct poly1305 *st, unsigned char mac[16]) {
+    /*
+    Fully reduce the accumulator modulo 2^130 - 5 and add the pad.
+    */
+    uint32_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2];
+    uint32_t h3 = st->h[3], h4 = st->h[4];
+    uint32_t g0, g1, g2, g3, g4, c, mask;
+    uint64_t f;
+
+    c = h1 >> 26; h1 &= 0x3ffffff;
+    h2 += c; c = h2 >> 26; h2 &= 0x3ffffff;
+    h3 += c; c = h3 >> 26; h3 &= 0x3ffffff;
+    h4 += c; c = h4 >> 26; h4 &= 0x3ffffff;
+    h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+    h1 += c;
+
+    //Compute h - p and keep it if it didn't underflow.
+    g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+    g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+    g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+    g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+    g4 = h4 + c - (1 << 26);
+
+    mask = (g4 >> 31) - 1;
+    g0 &= mask; g1 &= mask; g2 &= mask; g3 &= mask; g4 &= mask;
+    mask = ~mask;
+    h0 = (h0 & mask) | g0;
+    h1 = (h1 & mask) | g1;
+    h2 = (h2 & mask) | g2;
+    h3 = (h3 & mask) | g3;
+    h4 = (h4 & mask) | g4;
+
+    h0 = (h0 | (h1 << 26));
+    h1 = ((h1 >> 6) | (h2 << 20));
+    h2 = ((h2 >> 12) | (h3 << 14));
+    h3 = ((h3 >> 18) | (h4 << 8));
+
+    f = (uint64_t)h0 + st->pad[0]; store32(mac + 0, (uint32_t)f);
+    f = (uint64_t)h1 + st->pad[1] + (f >> 32); store32(mac + 4, (uint32_t)f);
+    f = (uint64_t)h2 + st->pad[2] + (f >> 32); store32(mac + 8, (uint32_t)f);
+    f = (uint64_t)h3 + st->pad[3] + (f >> 32); store32(mac + 12, (uint32_t)f);
+}
+
+void aeadTag(const unsigned char key[32], const unsigned char nonce[12],
+        const unsigned char *aad, size_t aadlen,
+        const unsigned char *ct, size_t len, unsigned char tag[16]) {
+    /*
+    Compute the ChaCha20-Poly1305 tag over the additional data and the
+    ciphertext (RFC 8439 section 2.8).
+    */
+    unsigned char block[64];
+    unsigned char lengths[16];
+    struct poly1305 st;
+
+    //The one-time Poly1305 key is the first half of keystream block 0.
+    chachaBlock(key, 0, nonce, block);
+    polyInit(&st, block);
+    polyPadded(&st, aad, aadlen);
+    polyPadded(&st, ct, len);
+    store64(lengths, aadlen);
+    store64(lengths + 8, len);
+    polyBlocks(&st, lengths, 16);
+    polyFinish(&st, tag);
+}
+
+typedef struct cipherCtx cipherCtx;
+
+//A cipher that sits in the save and open paths. Engines with a chunk size
+//write a header followed by chunks that are each authenticated on their
+//own, so any chunk can be checked and decrypted without the ones before it.
+typedef struct cipherEngine {
+    const char *name;
+    //Id stored in the file header. The shift cipher has no header.
+    int id;
+    //Bytes of text in every chunk but the last, or 0 for an engine that
+    //keeps the lines of the file as they are.
+    size_t chunk_size;
+    //Set up ctx for a file with the given header, or make a new header for
+    //a file about to be written when header is NULL.
+    int (*init)(cipherCtx *ctx, const unsigned char *header);
+    //Encrypt or decrypt len bytes of a chunk in place. final is set for the
+    //last chunk of the file. tag receives the tag of the chunk when
+    //encrypting and holds it when decrypting, which fails with EBADMSG if
+    //the chunk was changed.
+    int (*transform)(cipherCtx *ctx, char *buf, size_t len, uint64_t chunk,
+        int final, int decrypt, unsigned char *tag);
+    //Wipe the key material in ctx.
+    void (*finalize)(cipherCtx *ctx);
+} cipherEngine;
+
+struct cipherCtx {
+    const cipherEngine *engine;
+    unsigned char key[32];
+    unsigned char header[FILE_HEADER_SIZE];
+};
+
+//Key from TEXT_EDIT_KEY. Files are saved with ChaCha20-Poly1305 when it is
+//set and with the shift cipher otherwise.
+unsigned char cipherKey[32];
+int cipherKeySet;
+
+int shiftInit(cipherCtx *ctx, const unsigned char *header) {
+    /*
+    Start the shift cipher, which has no key or header.
+    */
+    (void)ctx;
+    (void)header;
+    return 0;
+}
+
+int shiftTransform(cipherCtx *ctx, char *buf, size_t len, uint64_t chunk,
+        int final, int decrypt, unsigned char *tag) {
+    /*
+    Shift every byte but newlines, which works on any piece of a file.
+    */
+    (void)ctx;
+    (void)chunk;
+    (void)final;
+    (void)tag;
+    if (decrypt) decryptBuffer(buf, len);
+    else encryptBuffer(buf, len);
+    return 0;
+}
+
+void shiftFinalize(cipherCtx *ctx) {
+    /*
+    End the shift cipher, which holds nothing to clear.
+    */
+    (void)ctx;
+}
+
+int chachaInit(cipherCtx *ctx, const unsigned char *header) {
+    /*
+    Take the key from the environment and the nonce prefix from the header.
+    A new file gets a random nonce prefix, so chunks of two saves never
+    share a nonce.
+    */
+    if (!cipherKeySet) {
+        errno = ENOKEY;
+        return -1;
+    }
+    memcpy(ctx->key, cipherKey, sizeof(ctx->key));
+    if (header != NULL) {
+        memcpy(ctx->header, header, FILE_HEADER_SIZE);
+        return 0;
+    }
+    memset(ctx->header, 0, FILE_HEADER_SIZE);
+    memcpy(ctx->header, FILE_MAGIC, 4);
+    ctx->header[4] = ctx->engine->id;
+    if (getrandom(&ctx->header[8], 8, 0) != 8) return -1;
+    return 0;
+}
+
+int chachaTransform(cipherCtx *ctx, char *buf, size_t len, uint64_t chunk,
+        int final, int decrypt, unsigned char *tag) {
+    /*
+    Encrypt a chunk with ChaCha20 and authenticate it with Poly1305. The
+    nonce is the prefix from the header followed by the chunk number, and
+    the header, chunk number and final flag are authenticated with the
+    chunk, so chunks can't be swapped, moved or cut off the end of a file.
+    */
+    unsigned char nonce[12];
+    unsigned char aad[FILE_HEADER_SIZE + 9];
+    unsigned char expected[CHUNK_TAG_SIZE];
+    long long start = PROFILE_BEGIN();
+
+    memcpy(nonce, &ctx->header[8], 8);
+    store32(&nonce[8], (uint32_t)chunk);
+    memcpy(aad, ctx->header, FILE_HEADER_SIZE);
+    store64(&aad[FILE_HEADER_SIZE], chunk);
+    aad[FILE_HEADER_SIZE + 8] = final ? 1 : 0;
+
+    if (!decrypt) {
+        chachaXor(ctx->key, 1, nonce, (unsigned char *)buf, len);
+        aeadTag(ctx->key, nonce, aad, sizeof(aad), (unsigned char *)buf, len,
+            tag);
+        PROFILE_END(STAGE_CIPHER, start);
+        return 0;
+    }
+    //Check the tag before anything is decrypted, in constant time.
+    aeadTag(ctx->key, nonce, aad, sizeof(aad), (unsigned char *)buf, len,
+        expected);
+    unsigned char diff = 0;
+    int i;
+    for (i = 0; i < CHUNK_TAG_SIZE; i++) diff |= expected[i] ^ tag[i];
+    if (diff != 0) {
+        errno = EBADMSG;
+        return -1;
+    }
+    chachaXor(ctx->key, 1, nonce, (unsigned char *)buf, len);
+    PROFILE_END(STAGE_CIPHER, start);
+    return 0;
+}
+
+void chachaFinalize(cipherCtx *ctx) {
+    /*
+    Wipe the key out of the context.
+    */
+    explicit_bzero(ctx->key, sizeof(ctx->key));
+}
+
+const cipherEngine shiftEngine = {
+    "shift", 0, 0, shiftInit, shiftTransform, shiftFinalize
+};
+
+const cipherEngine chachaEngine = {
+    "chacha20-poly1305", 1, CHUNK_SIZE, chachaInit, chachaTransform,
+    chachaFinalize
+};
+
+int initEngine(cipherCtx *ctx, const cipherEngine *engine,
+        const unsigned char *header) {
+    /*
+    Start an engine in ctx with the header of the file, or a new one if
+    header is NULL.
+    */
+    ctx->engine = engine;
+    return engine->init(ctx, header);
+}
+
+const cipherEngine *saveEngine() {
+    /*
+    Return the engine files are saved with.
+    */
+    return cipherKeySet ? &chachaEngine : &shiftEngine;
+}
+
+const cipherEngine *headerEngine(const unsigned char *header, size_t len) {
+    /*
+    Return the engine a file was written with if it starts with a header,
+    or NULL for a file in the plain shift format.
+    */
+    if (len < FILE_HEADER_SIZE || memcmp(header, FILE_MAGIC, 4) != 0 ||
+            header[5] != 0 || header[6] != 0 || header[7] != 0)
+        return NULL;
+    if (header[4] == chachaEngine.id) return &chachaEngine;
+    return NULL;
+}
+
+off_t chunkOffset(const cipherEngine *engine, uint64_t chunk) {
+    /*
+    Return where a chunk starts in a file, for reading chunks in any order.
+    */
+    return FILE_HEADER_SIZE + chunk * (engine->chunk_size + CHUNK_TAG_SIZE);
+}
+
+int parseKey(const char *hex, unsigned char key[32]) {
+    /*
+    Read a key written as 64 hex digits.
+    */
+    int i;
+    if (strlen(hex) != 64) return -1;
+    for (i = 0; i < 64; i++) {
+        int c = tolower((unsigned char)hex[i]);
+        int v;
+        if (c >= '0' && c <= '9') v = c - '0';
+        else if (c >= 'a' && c <= 'f') v = c - 'a' + 10;
+        else return -1;
+        if (i % 2 == 0) key[i / 2] = v << 4;
+        else key[i / 2] |= v;
+    }
+    return 0;
+}
+
+void initCipher() {
+    /*
+    Pick the widest shift kernel the CPU supports and read the key for the
+    authenticated cipher from TEXT_EDIT_KEY.
+    */
+    shiftKernel = shiftScalar;
+    shiftKernelName = "scalar";
+#ifdef CIPHER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        shiftKernel = shiftAVX2;
+        shiftKernelName = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        shiftKernel = shiftSSE2;
+        shiftKernelName = "sse2";
+    }
+#endif
+
+    const char *hex = getenv("TEXT_EDIT_KEY");
+    if (hex != NULL) {
+        if (parseKey(hex, cipherKey) == -1) {
+            errno = EINVAL;
+            error_exit("TEXT_EDIT_KEY");
+        }
+        cipherKeySet = 1;
+    }
+}
+
+/*** row buffers ***/
+
+//Part of a slab that a thread carves row buffers out of. Every thread that
+//builds rows has its own, so rows are built in parallel without locks
+//until a slab runs out.
+struct arena {
+    char *next;
+    char *end;
+    //Set on the main thread, the only one that frees row buffers and so
+    //the only one that reuses them.
+    int reuse;
+};
+
+_Thread_local struct arena rowArena;
+//Freed buffers of each size class, linked through their first bytes.
+void *slabFree[SLAB_CLASSES];
+//Every slab allocated, so the rows of a file can be released all at once.
+char **slabs;
+int nslabs;
+int slabs_cap;
+pthread_mutex_t slabLock = PTHREAD_MUTEX_INITIALIZER;
+
+int slabClass(int size) {
+    /*
+    Return the size class that holds buffers of size bytes.
+    */
+    int c = 0;
+    while ((SLAB_MIN << c) < size) c++;
+    return c;
+}
+
+char *rowAlloc(int size, int *cap) {
+    /*
+    Return a row buffer of at least size bytes and set cap to its real size.
+    Small buffers are reused from the free list of their class or carved
+    out of the thread's slab.
+    */
+    if (size > SLAB_MAX) {
+        *cap = size;
+        return malloc(size);
+    }
+    int c = slabClass(size);
+    *cap = SLAB_MIN << c;
+    if (rowArena.reuse && slabFree[c] != NULL) {
+        char *buf = slabFree[c];
+        slabFree[c] = *(void **)buf;
+        return buf;
+    }
+    if (rowArena.end - rowArena.next < *cap) {
+        //What is left of the old slab is too small and stays unused.
+        //Slabs are mapped directly so that freeing them hands the memory
+        //back to the system rather than to the heap.
+        char *slab = mmap(NULL, SLAB_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (slab == MAP_FAILED) error_exit("mmap");
+        pthread_mutex_lock(&slabLock);
+        if (nslabs == slabs_cap) {
+            slabs_cap = slabs_cap ? slabs_cap * 2 : 64;
+            slabs = realloc(slabs, sizeof(char *) * slabs_cap);
+        }
+        slabs[nslabs++] = slab;
+        pthread_mutex_unlock(&slabLock);
+        rowArena.next = slab;
+        rowArena.end = slab + SLAB_SIZE;
+    }
+    char *buf = rowArena.next;
+    rowArena.next += *cap;
+    return buf;
+}
+
+void rowFree(char *buf, int cap) {
+    /*
+    Give back a row buffer of cap bytes, which only the main thread does.
+    */
+    if (buf == NULL) return;
+    if (cap > SLAB_MAX) {
+        free(buf);
+        return;
+    }
+    int c = slabClass(cap);
+    *(void **)buf = slabFree[c];
+    slabFree[c] = buf;
+}
+
+void freeSlabs() {
+    /*
+    Free every slab, and with them all the row buffers carved out of them,
+    once no row is left using one. The arena of the main thread is reset so
+    the next buffer starts a new slab.
+    */
+    int i;
+    for (i = 0; i < nslabs; i++) munmap(slabs[i], SLAB_SIZE);
+    nslabs = 0;
+    memset(slabFree, 0, sizeof(slabFree));
+    rowArena.next = NULL;
+    rowArena.end = NULL;
+}
+
+char *rowRealloc(char *buf, int old_cap, int size, int *cap) {
+    /*
+    Move a row buffer to one of at least size bytes, keeping its contents.
+    */
+    if (old_cap > SLAB_MAX) {
+        *cap = size;
+        return realloc(buf, size);
+    }
+    char *new = rowAlloc(size, cap);
+    if (buf != NULL) {
+        memcpy(new, buf, old_cap);
+        rowFree(buf, old_cap);
+    }
+    return new;
+}
+
+void allocChars(erow *row, int size) {
+    /*
+    Give a row a chars buffer for size bytes and the '\0' after them, inside
+    the row itself when it is short enough.
+    */
+    row->inlined = size < ROW_INLINE;
+    if (row->inlined) {
+        row->chars = row->short_chars;
+        row->cap = ROW_INLINE;
+    } else {
+        row->chars = rowAlloc(size + 1, &row->cap);
+    }
+}
+
+void fixInline(erow *rows, int n) {
+    /*
+    Point the chars of short rows back inside them after they were moved.
+    */
+    int i;
+    for (i = 0; i < n; i++)
+        if (rows[i].inlined) {
+            rows[i].chars = rows[i].short_chars;
+            if (rows[i].rcap == 0) rows[i].render = rows[i].chars;
+        }
+}
+
+/*** row operations ***/
+
+void loadRow(erow *row) {
+    /*
+    Decrypt a row of a mapped file into its own chars and render buffers.
+    */
+    allocChars(row, row->size);
+    memcpy(row->chars, row->mapped, row->size);
+    row->chars[row->size] = '\0';
+    decryptBuffer(row->chars, row->size);
+    row->mapped = NULL;
+    row->tabs = NULL;
+    row->ntabs = -1;
+    row->version = T.snapshot;
+    updateRender(row);
+    //Its size only guessed how many lines it wraps to.
+    wrapEditRow(row);
+}
+
+erow *peekRow(int at) {
+    /*
+    Return the row at the given index, skipping over the gap, without
+    decrypting it if it still lives in a mapped file.
+    */
+    return &T.row[at < T.gap_start ? at : at + T.gap_len];
+}
+
+erow *getRow(int at) {
+    /*
+    Return the row at the given index, skipping over the gap.
+    */
+    erow *row = peekRow(at);
+
+    //Rows of a mapped file are only decrypted once something looks at them.
+    if (row->chars == NULL) loadRow(row);
+    return row;
+}
+
+int rowIndex(erow *row) {
+    /*
+    Return the index of a row from its position in the gap buffer.
+    */
+    int at = row - T.row;
+    return at < T.gap_start ? at : at - T.gap_len;
+}
+
+void markRowDirty(int filerow) {
+    /*
+    Mark the screen lines that show a file row as needing a redraw.
+    */
+    int lines = 1;
+    int y = (T.wrap ? wrapLineOf(filerow, &lines) : filerow) - T.drawn_rowoff;
+    for (; lines > 0; y++, lines--)
+        if (y >= 0 && y < T.screenrows) T.dirty[y] = 1;
+}
+
+void markRowsDirtyFrom(int filerow) {
+    /*
+    Mark every screen line from a file row down as needing a redraw, for
+    edits that shift the rows below them.
+    */
+    int y = (T.wrap ? wrapLineOf(filerow, NULL) : filerow) - T.drawn_rowoff;
+    if (y < 0) y = 0;
+    for (; y < T.screenrows; y++) T.dirty[y] = 1;
+}
+
+void moveGap(int at) {
+    /*
+    Move the gap so that it starts right before the given row index.
+    */
+    if (at < T.gap_start) {
+        //Shift the rows between the index and the gap to after the gap.
+        memmove(&T.row[at + T.gap_len], &T.row[at],
+            sizeof(erow) * (T.gap_start - at));
+        fixInline(&T.row[at + T.gap_len], T.gap_start - at);
+    } else if (at > T.gap_start) {
+        //Shift the rows between the gap and the index to before the gap.
+        memmove(&T.row[T.gap_start], &T.row[T.gap_start + T.gap_len],
+            sizeof(erow) * (at - T.gap_start));
+        fixInline(&T.row[T.gap_start], at - T.gap_start);
+    }
+    T.gap_start = at;
+}
+
+void growGap() {
+    /*
+    Double the capacity of the row array once the gap is used up.
+    */
+    int capacity = T.numrows + T.gap_len;
+    int new_capacity = capacity ? capacity * 2 : 16;
+    int tail = T.numrows - T.gap_start;
+
+    T.row = realloc(T.row, sizeof(erow) * new_capacity);
+    //Move the rows after the gap to the end of the bigger array.
+    memmove(&T.row[new_capacity - tail], &T.row[T.gap_start + T.gap_len],
+        sizeof(erow) * tail);
+    T.gap_len = new_capacity - T.numrows;
+    fixInline(T.row, T.gap_start);
+    fixInline(&T.row[T.gap_start + T.gap_len], tail);
+}
+
+void buildTabIndex(erow *row) {
+    /*
+    Record where each tab of the row is in chars and in render.
+    */
+    int count = 0;
+    char *p = row->chars;
+    char *end = row->chars + row->size;
+
+    //Count the tabs to know how much memory the index needs.
+    while ((p = memchr(p, '\t', end - p)) != NULL) {
+        count++;
+        p++;
+    }
+
+    free(row->tabs);
+    row->tabs = count ? malloc(sizeof(tabStop) * count) : NULL;
+    row->ntabs = count;
+
+    int render_x = 0;
+    int prev = -1;
+    int j;
+    p = row->chars;
+    for (j = 0; j < count; j++) {
+        p = memchr(p, '\t', end - p);
+        int at = p - row->chars;
+        //Characters between two tabs take one column each.
+        render_x += at - prev - 1;
+        row->tabs[j].at = at;
+        row->tabs[j].render_x = render_x;
+        //Add how many columns left to the next tab stop.
+        render_x += TAB_STOP - render_x % TAB_STOP;
+        prev = at;
+        p++;
+    }
+}
+
+void invalidateTabIndex(erow *row) {
+    /*
+    Drop the tab index of a row whose chars changed.
+    */
+    row->ntabs = -1;
+}
+
+int tabsBefore(erow *row, int at) {
+    /*
+    Return how many tabs the row has before index at, by binary search.
+    */
+    int lo = 0;
+    int hi = row->ntabs;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (row->tabs[mid].at < at) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+int convertToRender(erow *row, int cursor_x) {
+    /*
+    Map an index into chars to the column it is drawn at.
+    */
+    if (row->ntabs < 0) buildTabIndex(row);
+
+    int k = tabsBefore(row, cursor_x);
+    if (k == 0) return cursor_x;
+    //Count from the end of the last tab before the cursor.
+    tabStop *tab = &row->tabs[k - 1];
+    int tab_end = tab->render_x + TAB_STOP - tab->render_x % TAB_STOP;
+    return tab_end + (cursor_x - tab->at - 1);
+}
+
+int convertToChars(erow *row, int render_x) {
+    /*
+    Map a column of render back to the index into chars drawn there. A
+    column inside a tab maps to the tab.
+    */
+    if (row->ntabs < 0) buildTabIndex(row);
+
+    //Find the last tab that starts at or before the column.
+    int lo = 0;
+    int hi = row->ntabs;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (row->tabs[mid].render_x <= render_x) lo = mid + 1;
+        else hi = mid;
+    }
+
+    int cursor_x = render_x;
+    if (lo > 0) {
+        tabStop *tab = &row->tabs[lo - 1];
+        int tab_end = tab->render_x + TAB_STOP - tab->render_x % TAB_STOP;
+        if (render_x < tab_end) return tab->at;
+        cursor_x = tab->at + 1 + (render_x - tab_end);
+    }
+    return cursor_x > row->size ? row->size : cursor_x;
+}
+
+int growCapacity(int cap, int need) {
+    /*
+    Return a capacity of at least need bytes, doubling the old one so that
+    repeated growth is amortized.
+    */
+    if (cap < 16) cap = 16;
+    while (cap < need) cap *= 2;
+    return cap;
+}
+
+void reserveChars(erow *row, int size) {
+    /*
+    Make sure chars can hold size bytes plus the terminating '\0'.
+    */
+    if (size + 1 <= row->cap) return;
+    int cap = growCapacity(row->cap, size + 1);
+    if (row->inlined) {
+        //Move the chars of a short row out of it once it grows.
+        row->chars = rowAlloc(cap, &row->cap);
+        memcpy(row->chars, row->short_chars, ROW_INLINE);
+        row->inlined = 0;
+    } else {
+        row->chars = rowRealloc(row->chars, row->cap, cap, &row->cap);
+    }
+    if (row->rcap == 0) row->render = row->chars;
+}
+
+void reserveRender(erow *row, int size) {
+    /*
+    Make sure render can hold size bytes plus the terminating '\0'.
+    */
+    if (size + 1 <= row->rcap) return;
+    int cap = growCapacity(row->rcap, size + 1);
+    row->render = rowRealloc(row->render, row->rcap, cap, &row->rcap);
+}
+
+void renderFrom(erow *row, int at, int render_x) {
+    /*
+    Rebuild render from the character at index at onward, which is drawn at
+    column render_x. Everything before it is left alone.
+    */
+    int tabs = 0;
+    int j;
+
+    //Loop through the rest of the chars and count the tabs to know how much
+    //memory render needs.
+    for (j = at; j < row->size; j++)
+        if (row->chars[j] == '\t') tabs++;
+
+    reserveRender(row, render_x + (row->size - at) + tabs*(TAB_STOP - 1));
+
+    int idx = render_x;
+
+    //Copy each character from chars to render.
+    for (j = at; j < row->size; j++) {
+        //If the current character is a tab, append space until a column that
+        //is divisible by the tab stop.
+        if (row->chars[j] == '\t') {
+            row->render[idx++] = ' ';
+            while (idx % TAB_STOP != 0) row->render[idx++] = ' ';
+        } else {
+            row->render[idx++] = row->chars[j];
+        }
+    }
+
+    //Set the size of the render to the size of the char.
+    row->render[idx] = '\0';
+    row->size_r = idx;
+}
+
+void aliasRender(erow *row) {
+    /*
+    Draw a row without tabs straight from its chars, freeing the render
+    buffer it had.
+    */
+    if (row->rcap > 0) rowFree(row->render, row->rcap);
+    row->render = row->chars;
+    row->rcap = 0;
+    row->size_r = row->size;
+}
+
+void updateRender(erow *row) {
+    /*
+    Use chars string of an erow to fill the contents of the render string.
+    */
+    long long start = PROFILE_BEGIN();
+    if (memchr(row->chars, '\t', row->size) == NULL) {
+        aliasRender(row);
+    } else {
+        //Give a row that was drawn from its chars a buffer of its own.
+        if (row->rcap == 0) row->render = NULL;
+        renderFrom(row, 0, 0);
+    }
+    PROFILE_END(STAGE_RENDER, start);
+}
+
+void patchRenderInsert(erow *row, int at, int render_x, int c) {
+    /*
+    Patch render after c was inserted into chars at index at, which is drawn
+    at column render_x. Only the columns up to the next tab move, since that
+    tab gets one column narrower.
+    */
+    if (row->rcap == 0) {
+        //Nothing to patch while render is chars, unless it needs its own
+        //buffer now.
+        if (c == '\t') updateRender(row);
+        else aliasRender(row);
+        return;
+    }
+    char *tab = memchr(&row->chars[at + 1], '\t', row->size - at - 1);
+
+    if (c != '\t' && tab == NULL) {
+        //Without a tab after it, the rest of the line just moves right.
+        reserveRender(row, row->size_r + 1);
+        memmove(&row->render[render_x + 1], &row->render[render_x],
+            row->size_r - render_x + 1);
+        row->render[render_x] = c;
+        row->size_r++;
+        return;
+    }
+    if (c != '\t') {
+        //Column of the tab before the insert and how wide it was.
+        int tab_x = render_x + (tab - &row->chars[at + 1]);
+        if (TAB_STOP - tab_x % TAB_STOP > 1) {
+            memmove(&row->render[render_x + 1], &row->render[render_x],
+                tab_x - render_x);
+            row->render[render_x] = c;
+            return;
+        }
+    }
+    //A tab was inserted or a one-column tab got pushed to the next stop, so
+    //the columns after it change too.
+    renderFrom(row, at, render_x);
+}
+
+void patchRenderDelete(erow *row, int at, int render_x, int c) {
+    /*
+    Patch render after c was deleted from chars at index at, which was drawn
+    at column render_x. Only the columns up to the next tab move, since that
+    tab gets one column wider.
+    */
+    if (row->rcap == 0 ||
+        (c == '\t' && memchr(row->chars, '\t', row->size) == NULL)) {
+        //Render is chars already, or the last tab of the row is gone.
+        aliasRender(row);
+        return;
+    }
+    char *tab = memchr(&row->chars[at], '\t', row->size - at);
+
+    if (c != '\t' && tab == NULL) {
+        //Without a tab after it, the rest of the line just moves left.
+        memmove(&row->render[render_x], &row->render[render_x + 1],
+            row->size_r - render_x);
+        row->size_r--;
+        return;
+    }
+    if (c != '\t') {
+        //Column of the tab before the delete.
+        int tab_x = render_x + 1 + (tab - &row->chars[at]);
+        if (tab_x % TAB_STOP != 0) {
+            memmove(&row->render[render_x], &row->render[render_x + 1],
+                tab_x - render_x - 1);
+            row->render[tab_x - 1] = ' ';
+            return;
+        }
+    }
+    //A tab was deleted or a full-width tab shrank to one column, so the
+    //columns after it change too.
+    renderFrom(row, at, render_x);
+}
+
+erow *newRow(int current_row) {
+    /*
+    Take a slot for a new row at the index and return it uninitialized.
+    */
+
+    //Allocate space for a new row only when the gap is full.
+    if (T.gap_len == 0) growGap();
+
+    //Make room at the specified index for the new row by moving the gap
+    //there and taking its first slot.
+    moveGap(current_row);
+    erow *row = &T.row[T.gap_start];
+    T.gap_start++;
+    T.gap_len--;
+    return row;
+}
+
+void insertRow(int current_row, char *s, size_t len) {
+    /*
+    Insert the context in the row.
+    */
+
+    //Validate the index of the column.
+    if (current_row < 0 || current_row > T.numrows) return;
+    char *undo = recordOp(OP_INSERT_ROW, current_row, 0, len, 0);
+    if (undo != NULL) memcpy(undo, s, len);
+
+    erow *row = newRow(current_row);
+
+    //Set the current row size.
+    row->size = len;
+
+    //Put the contents in the row into 'chars'.
+    allocChars(row, len);
+    memcpy(row->chars, s, len);
+    row->chars[len] = '\0';
+
+    //Initialize the render.
+    row->size_r = 0;
+    row->rcap = 0;
+    row->render = NULL;
+    row->mapped = NULL;
+    row->tabs = NULL;
+    row->ntabs = -1;
+    row->version = T.snapshot;
+    row->disk_off = -1;
+    row->disk_size = 0;
+    row->modified = 1;
+    updateRender(row);
+    filterInsertRow(current_row, row);
+    wrapInsertRow(current_row, row);
+
+    //Increment the number of rows in the current file.
+    T.numrows++;
+    markRowsDirtyFrom(current_row);
+    //Increment the number of changes made since saving the file.
+    T.updated++;
+}
+
+int rowShared(erow *row) {
+    /*
+    Check whether the running save may still read the chars of a row.
+    */
+    return T.save != NULL && row->chars != NULL && !row->inlined &&
+        row->version != T.snapshot;
+}
+
+void retireChars(char *chars, int cap) {
+    /*
+    Keep a chars buffer the running save may still read until it is done.
+    */
+    if (T.nretired == T.retired_cap) {
+        T.retired_cap = T.retired_cap ? T.retired_cap * 2 : 64;
+        T.retired = realloc(T.retired,
+            sizeof(struct retiredChars) * T.retired_cap);
+    }
+    T.retired[T.nretired].chars = chars;
+    T.retired[T.nretired].cap = cap;
+    T.nretired++;
+}
+
+void unshareRow(erow *row) {
+    /*
+    Give a row a copy of chars of its own before it is changed, if the
+    running save may still read the old one.
+    */
+    if (!rowShared(row)) return;
+    int cap;
+    char *chars = rowAlloc(row->cap, &cap);
+    memcpy(chars, row->chars, row->size + 1);
+    retireChars(row->chars, row->cap);
+    row->chars = chars;
+    row->cap = cap;
+    if (row->rcap == 0) row->render = chars;
+    row->version = T.snapshot;
+}
+
+void freeRow(erow *row) {
+    /*
+    Free the memory of the row that is deleted.
+    */
+    if (row->rcap > 0) rowFree(row->render, row->rcap);
+    if (rowShared(row)) {
+        retireChars(row->chars, row->cap);
+    } else if (!row->inlined) {
+        rowFree(row->chars, row->cap);
+    }
+    free(row->tabs);
+}
+
+void deleteRow(int current_row) {
+    /*
+    Delete a row.
+    */
+
+    //Validate the index of the column.
+    if (current_row < 0 || current_row >= T.numrows) return;
+    erow *row = peekRow(current_row);
+    char *undo = recordOp(OP_DELETE_ROW, current_row, 0, row->size, 0);
+    if (undo != NULL) copyRowText(undo, row);
+    //Rows that were never decrypted have nothing to free.
+    freeRow(row);
+    filterDeleteRow(current_row);
+    wrapDeleteRow(current_row);
+    //Move the gap to the deleted row and widen it to swallow the row.
+    moveGap(current_row);
+    T.gap_len++;
+    T.numrows--;
+    markRowsDirtyFrom(current_row);
+    T.updated++;
+}
+
+void insertCharFromKey(erow *row, int current_row, int c) {
+    /*
+    Insert a single character into the position.
+    */
+
+    //Validate the index(col) that character will be inserted into.
+    if (current_row < 0 || current_row > row->size) current_row = row->size;
+    recordTyped(rowIndex(row), current_row, c, 0);
+    int render_x = convertToRender(row, current_row);
+    unshareRow(row);
+    //Allocate spaces for chars of the erow
+    reserveChars(row, row->size + 1);
+
+    //Make room for the new character.
+    memmove(&row->chars[current_row + 1], &row->chars[current_row], row->size - current_row + 1);
+
+    //Increment the size and assign the character to its position in the array.
+    row->size++;
+    row->chars[current_row] = c;
+    invalidateTabIndex(row);
+    row->modified = 1;
+
+    //Update render and size_r around the new character.
+    patchRenderInsert(row, current_row, render_x, c);
+    filterEditRow(row, current_row, current_row + 1);
+    wrapEditRow(row);
+    markRowDirty(rowIndex(row));
+    T.updated++;
+}
+
+void appendTwoRows(erow *row, char *s, size_t len) {
+    /*
+    Appends a string to the end of the row.
+    */
+    int at = row->size;
+    char *undo = recordOp(OP_INSERT_TEXT, rowIndex(row), at, len, 0);
+    if (undo != NULL) memcpy(undo, s, len);
+    unshareRow(row);
+    reserveChars(row, row->size + len);
+    memcpy(&row->chars[row->size], s, len);
+    row->size += len;
+    row->chars[row->size] = '\0';
+    invalidateTabIndex(row);
+    row->modified = 1;
+    //Only the appended part of render has to be built, unless render is
+    //chars itself.
+    if (row->rcap == 0) updateRender(row);
+    else renderFrom(row, at, row->size_r);
+    filterEditRow(row, at, row->size);
+    wrapEditRow(row);
+    markRowDirty(rowIndex(row));
+    T.updated++;
+}
+
+void truncateRow(erow *row, int at) {
+    /*
+    Cut a row off at the given index.
+    */
+    char *undo = recordOp(OP_DELETE_TEXT, rowIndex(row), at, row->size - at, 0);
+    if (undo != NULL) memcpy(undo, &row->chars[at], row->size - at);
+    int render_x = convertToRender(row, at);
+    unshareRow(row);
+    row->size = at;
+    row->chars[row->size] = '\0';
+    invalidateTabIndex(row);
+    row->modified = 1;
+    //Cut render at the same place instead of rebuilding it, unless the last
+    //tab was cut off with the rest.
+    if (memchr(row->chars, '\t', row->size) == NULL) {
+        aliasRender(row);
+    } else {
+        row->size_r = render_x;
+        row->render[render_x] = '\0';
+    }
+    wrapEditRow(row);
+    markRowDirty(rowIndex(row));
+    T.updated++;
+}
+
+void deleteChar(erow *row, int current_row) {
+    /*
+    Delete a character in the row.
+    */
+    if (current_row < 0 || current_row >= row->size) return;
+    int render_x = convertToRender(row, current_row);
+    int c = row->chars[current_row];
+    recordTyped(rowIndex(row), current_row, c, 1);
+    unshareRow(row);
+    //Overwrite the deleted character with the charctger that come after it.
+    memmove(&row->chars[current_row], &row->chars[current_row + 1], row->size - current_row);
+    //Decrement the size of the row.
+    row->size--;
+    invalidateTabIndex(row);
+    row->modified = 1;
+
+    patchRenderDelete(row, current_row, render_x, c);
+    filterEditRow(row, current_row, current_row);
+    wrapEditRow(row);
+    markRowDirty(rowIndex(row));
+    T.updated++;
+}
+
+void insertChars(erow *row, int at, const char *s, size_t len) {
+    /*
+    Insert a string into a row at the given index.
+    */
+    char *undo = recordOp(OP_INSERT_TEXT, rowIndex(row), at, len, 0);
+    if (undo != NULL) memcpy(undo, s, len);
+    unshareRow(row);
+    reserveChars(row, row->size + len);
+    memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1);
+    memcpy(&row->chars[at], s, len);
+    row->size += len;
+    invalidateTabIndex(row);
+    row->modified = 1;
+    updateRender(row);
+    filterEditRow(row, at, at + len);
+    wrapEditRow(row);
+    markRowDirty(rowIndex(row));
+    T.updated++;
+}
+
+void deleteChars(erow *row, int at, int len) {
+    /*
+    Delete len characters of a row from the given index on.
+    */
+    char *undo = recordOp(OP_DELETE_TEXT, rowIndex(row), at, len, 0);
+    if (undo != NULL) memcpy(undo, &row->chars[at], len);
+    unshareRow(row);
+    memmove(&row->chars[at], &row->chars[at + len], row->size - at - len + 1);
+    row->size -= len;
+    invalidateTabIndex(row);
+    row->modified = 1;
+    updateRender(row);
+    filterEditRow(row, at, at);
+    wrapEditRow(row);
+    markRowDirty(rowIndex(row));
+    T.updated++;
+}
+
+/*** editor operations ***/
+
+void insertChar(int c) {
+    /*
+    Take a character and insert into the position that cursor is at.
+    */
+
+    //Append new row to the file when the cursor is on the last line.
+    if (T.cursor_y == T.numrows) {
+        insertRow(T.numrows, "", 0);
+    }
+    //Insert the character.
+    insertCharFromKey(getRow(T.cursor_y), T.cursor_x, c);
+    //Move the cursor forward.
+    T.cursor_x++;
+}
+
+void createNewLine() {
+    /*
+    Insert a new line when Enter is pressed.
+    */
+
+    //If the cursor was at the beginning of a line, insert a new blank row.
+    if (T.cursor_x == 0) {
+        insertRow(T.cursor_y, "", 0);
+    //Otherwise, split the line into two rows.
+    } else {
+        erow *row = getRow(T.cursor_y);
+        //Create a new row with characters that are in the right of the cursor.
+        //They are copied first, since a short row keeps them inside the erow,
+        //which moves when the new row is inserted.
+        size_t taillen = row->size - T.cursor_x;
+        char tail[ROW_INLINE];
+        char *copy = taillen < ROW_INLINE ? tail : malloc(taillen);
+        memcpy(copy, &row->chars[T.cursor_x], taillen);
+        insertRow(T.cursor_y + 1, copy, taillen);
+        if (copy != tail) free(copy);
+        row = getRow(T.cursor_y);
+        //Truncate the current row's contents to contain only characters on the
+        //left.
+        truncateRow(row, T.cursor_x);
+    }
+    //Move the cursor to the beginning of the next new line.
+    T.cursor_y++;
+    T.cursor_x = 0;
+}
+
+void insertText(const char *s, size_t len) {
+    /*
+    Insert a block of text at the cursor. Each line of the text becomes a
+    whole row at once instead of going through one key at a time.
+    */
+    if (T.cursor_y == T.numrows) insertRow(T.numrows, "", 0);
+
+    //Take the part of the line after the cursor off, to put it back after
+    //the last inserted line.
+    erow *row = getRow(T.cursor_y);
+    size_t taillen = row->size - T.cursor_x;
+    char *tail = malloc(taillen + 1);
+    memcpy(tail, &row->chars[T.cursor_x], taillen);
+    truncateRow(row, T.cursor_x);
+
+    const char *p = s;
+    const char *end = s + len;
+    int y = T.cursor_y;
+    while (1) {
+        //Terminals send Enter as '\r', so accept any line ending.
+        const char *line_end = p;
+        while (line_end < end && *line_end != '\r' && *line_end != '\n')
+            line_end++;
+        if (y == T.cursor_y) {
+            appendTwoRows(getRow(y), (char *)p, line_end - p);
+        } else {
+            insertRow(y, (char *)p, line_end - p);
+        }
+        if (line_end == end) break;
+        p = line_end + 1;
+        if (*line_end == '\r' && p < end && *p == '\n') p++;
+        y++;
+    }
+
+    //Put the cursor at the end of the inserted text.
+    row = getRow(y);
+    T.cursor_y = y;
+    T.cursor_x = row->size;
+    appendTwoRows(row, tail, taillen);
+    free(tail);
+}
+
+void processDelete() {
+    /*
+    Delete the character that is to the left of the cursor.
+    */
+
+    //Return if the cursor past the end of the file or it's in the beginning.
+    if (T.cursor_y == T.numrows) return;
+    if (T.cursor_x == 0 && T.cursor_y == 0) return;
+
+    erow *row = getRow(T.cursor_y);
+    if (T.cursor_x > 0) {
+        deleteChar(row, T.cursor_x - 1);
+        //Move the cursor to the left.
+        T.cursor_x--;
+    //If the cursor was at the beginning of the line, append the two rows and
+    //delete the current row.
+    } else {
+        T.cursor_x = getRow(T.cursor_y - 1)->size;
+        appendTwoRows(getRow(T.cursor_y - 1), row->chars, row->size);
+        deleteRow(T.cursor_y);
+        T.cursor_y--;
+    }
+}
+
+
+/*** undo ***/
+
+size_t opSize(const struct undoOp *op) {
+    /*
+    Return how many bytes an op takes up in the undo log with its text,
+    rounded up so the next op is aligned.
+    */
+    return (sizeof(struct undoOp) + op->len + op->len2 + 7) & ~(size_t)7;
+}
+
+struct undoOp *opAt(size_t off) {
+    /*
+    Return the op at an offset into the undo log. Ops are kept by their
+    offset, since the log moves when it grows.
+    */
+    return (struct undoOp *)(T.undo_log + off);
+}
+
+void reserveLog(size_t size) {
+    /*
+    Make sure the undo log can hold size bytes.
+    */
+    if (size <= T.undo_cap) return;
+    if (T.undo_cap == 0) T.undo_cap = 4096;
+    while (T.undo_cap < size) T.undo_cap *= 2;
+    T.undo_log = realloc(T.undo_log, T.undo_cap);
+}
+
+char *recordOp(int type, int y, int x, int len, int len2) {
+    /*
+    Append an op to the undo log, dropping the ops that could be redone,
+    and return where its len + len2 bytes of text go. Return NULL while an
+    op is being undone or redone, since that isn't recorded.
+    */
+    if (T.undo_replaying) return NULL;
+    struct undoOp head = {type, T.undo_group, y, x, len, len2, 0, T.undo_last};
+    size_t off = T.undo_end;
+    reserveLog(off + opSize(&head));
+    *opAt(off) = head;
+    T.undo_last = off;
+    T.undo_end = T.undo_len = off + opSize(&head);
+    return (char *)(opAt(off) + 1);
+}
+
+void recordTyped(int y, int x, int c, int deleted) {
+    /*
+    Record a character typed at index x of row y, or deleted from there.
+    A character that carries on a run of typing or of backspaces from the
+    keys just before it is added to the op of the run instead.
+    */
+    if (T.undo_replaying) return;
+    int type = deleted ? OP_DELETE_TEXT : OP_INSERT_TEXT;
+    if (T.undo_last != -1) {
+        struct undoOp *op = opAt(T.undo_last);
+        if (op->typed && op->type == type && op->y == y &&
+                op->group + 1 >= T.undo_group &&
+                x == (deleted ? op->x - 1 : op->x + op->len)) {
+            //The op of the run is the last one in the log, so its text can
+            //grow in place.
+            op->len++;
+            reserveLog(T.undo_last + opSize(op));
+            op = opAt(T.undo_last);
+            char *text = (char *)(op + 1);
+            if (deleted) {
+                memmove(text + 1, text, op->len - 1);
+                text[0] = c;
+                op->x--;
+            } else {
+                text[op->len - 1] = c;
+            }
+            op->group = T.undo_group;
+            T.undo_end = T.undo_len = T.undo_last + opSize(op);
+            return;
+        }
+    }
+    char *text = recordOp(type, y, x, 1, 0);
+    text[0] = c;
+    opAt(T.undo_last)->typed = 1;
+}
+
+void copyRowText(char *dst, erow *row) {
+    /*
+    Copy the text of a row, decrypting it if it still lives in a mapped
+    file.
+    */
+    if (row->chars != NULL) {
+        memcpy(dst, row->chars, row->size);
+        return;
+    }
+    memcpy(dst, row->mapped, row->size);
+    decryptBuffer(dst, row->size);
+}
+
+void applyOp(struct undoOp *op, int undo) {
+    /*
+    Undo an op, or redo it when undo is 0, and put the cursor where the
+    text it changed starts or ends.
+    */
+    char *text = (char *)(op + 1);
+    int x = op->x;
+
+    switch (op->type) {
+        case OP_INSERT_ROW:
+        case OP_DELETE_ROW:
+        if ((op->type == OP_INSERT_ROW) == undo) {
+            deleteRow(op->y);
+        } else {
+            insertRow(op->y, text, op->len);
+        }
+        break;
+
+        case OP_INSERT_TEXT:
+        case OP_DELETE_TEXT:
+        if ((op->type == OP_INSERT_TEXT) == undo) {
+            deleteChars(getRow(op->y), op->x, op->len);
+        } else {
+            insertChars(getRow(op->y), op->x, text, op->len);
+            x += op->len;
+        }
+        break;
+
+        case OP_REPLACE_ROW: {
+            erow *row = getRow(op->y);
+            deleteChars(row, 0, row->size);
+            if (undo) {
+                insertChars(row, 0, text, op->len);
+            } else {
+                insertChars(row, 0, text + op->len, op->len2);
+            }
+            break;
+        }
+    }
+    T.cursor_y = op->y;
+    T.cursor_x = x;
+}
+
+void undo() {
+    /*
+    Undo the ops of the last keypress that made any.
+    */
+    if (T.undo_last == -1) {
+        updateStatusBar("Nothing to undo");
+        return;
+    }
+    unsigned group = opAt(T.undo_last)->group;
+    T.undo_replaying = 1;
+    while (T.undo_last != -1 && opAt(T.undo_last)->group == group) {
+        struct undoOp *op = opAt(T.undo_last);
+        applyOp(op, 1);
+        T.undo_end = T.undo_last;
+        T.undo_last = op->prev;
+    }
+    T.undo_replaying = 0;
+}
+
+void redo() {
+    /*
+    Redo the ops of the keypress undone last.
+    */
+    if (T.undo_end == T.undo_len) {
+        updateStatusBar("Nothing to redo");
+        return;
+    }
+    unsigned group = opAt(T.undo_end)->group;
+    T.undo_replaying = 1;
+    while (T.undo_end < T.undo_len && opAt(T.undo_end)->group == group) {
+        struct undoOp *op = opAt(T.undo_end);
+        applyOp(op, 0);
+        T.undo_last = T.undo_end;
+        T.undo_end += opSize(op);
+    }
+    T.undo_replaying = 0;
+}
+
+/*** file ***/
+
+int workerCount() {
+    /*
+    Return how many threads open a file, one per online CPU unless
+    TEXT_EDIT_THREADS asks for another number.
+    */
+    const char *env = getenv("TEXT_EDIT_THREADS");
+    long n = env ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) n = 1;
+    if (n > MAX_WORKERS) n = MAX_WORKERS;
+    return n;
+}
+
+void runWorkers(void *(*work)(void *), void *args, size_t size, int n) {
+    /*
+    Call work on each of n argument structs of the given size, each on its
+    own thread, and wait for all of them. The first one runs on the calling
+    thread, and so does any that a thread couldn't be started for.
+    */
+    pthread_t threads[MAX_WORKERS];
+    int started[MAX_WORKERS];
+    int i;
+
+    for (i = 1; i < n; i++) {
+        void *arg = (char *)args + i * size;
+        started[i] = pthread_create(&threads[i], NULL, work, arg) == 0;
+        if (!started[i]) work(arg);
+    }
+    work(args);
+    for (i = 1; i < n; i++)
+        if (started[i]) pthread_join(threads[i], NULL);
+}
+
+//Rows a worker builds on its own before they are moved into T.row.
+struct rowList {
+    erow *rows;
+    int len;
+    int cap;
+};
+
+erow *pushRow(struct rowList *list) {
+    /*
+    Take a slot for a row at the end of a list and return it uninitialized.
+    */
+    if (list->len == list->cap) {
+        list->cap = list->cap ? list->cap * 2 : 64;
+        list->rows = realloc(list->rows, sizeof(erow) * list->cap);
+        fixInline(list->rows, list->len);
+    }
+    return &list->rows[list->len++];
+}
+
+void appendRows(struct rowList *list) {
+    /*
+    Move the rows of a list to the end of the file in one copy and empty
+    the list.
+    */
+    if (list->len == 0) return;
+    while (T.gap_len < list->len) growGap();
+    moveGap(T.numrows);
+    memcpy(&T.row[T.gap_start], list->rows, sizeof(erow) * list->len);
+    fixInline(&T.row[T.gap_start], list->len);
+    T.gap_start += list->len;
+    T.gap_len -= list->len;
+    markRowsDirtyFrom(T.numrows);
+    T.numrows += list->len;
+    list->len = 0;
+}
+
+void dropMapped(const char *from, const char *to) {
+    /*
+    Let the kernel drop the pages of the mapped file from from up to to,
+    which are read from the file again if a row in them is needed. madvise()
+    wants a page-aligned start, so the page from starts on goes too.
+    */
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)from & ~(page - 1);
+    madvise((void *)start, (uintptr_t)to - start, MADV_DONTNEED);
+}
+
+//A slice of a mapped file that one worker indexes. Slices start at the
+//beginning of a line, so no line is split between two workers.
+struct indexPart {
+    char *start;
+    char *end;
+    struct rowList list;
+};
+
+void *indexMapped(void *arg) {
+    /*
+    Index where the lines of a slice of the mapping start, without
+    decrypting them.
+    */
+    struct indexPart *part = arg;
+    char *p = part->start;
+    char *window = p;
+
+    while (p < part->end) {
+        char *newline = memchr(p, '\n', part->end - p);
+        char *line_end = newline ? newline : part->end;
+        size_t linelen = line_end - p;
+        //Find the actual length of the line by stripping a trailing '\r'.
+        while (linelen > 0 && p[linelen - 1] == '\r') linelen--;
+
+        //Add a row that only points at the mapped bytes.
+        erow *row = pushRow(&part->list);
+        row->size = linelen;
+        row->cap = 0;
+        row->chars = NULL;
+        row->inlined = 0;
+        row->size_r = 0;
+        row->rcap = 0;
+        row->render = NULL;
+        row->mapped = p;
+        row->tabs = NULL;
+        row->ntabs = -1;
+        row->version = T.snapshot;
+        //Rows whose bytes on disk differ from what a save writes back can't
+        //be left in place by an incremental save.
+        row->disk_off = (newline && linelen == (size_t)(newline - p)) ?
+            p - T.map : -1;
+        row->disk_size = linelen;
+        row->modified = 0;
+
+        p = newline ? newline + 1 : part->end;
+        //Drop pages that were only read for the index so resident memory
+        //doesn't grow with the size of the file.
+        if (p - window >= LAZY_INDEX_WINDOW) {
+            dropMapped(window, p);
+            window = p;
+        }
+    }
+    return NULL;
+}
+
+void openMappedFile(int fd, size_t size) {
+    /*
+    Map a large file and index where its lines start without decrypting
+    them. Each row keeps a pointer to its encrypted bytes and is decrypted by
+    getRow() the first time it is drawn or the cursor reaches it. The file
+    is cut into one slice per worker, which are indexed in parallel.
+    */
+    T.map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (T.map == MAP_FAILED) error_exit("mmap");
+    T.map_len = size;
+    madvise(T.map, size, MADV_SEQUENTIAL);
+
+    struct indexPart parts[MAX_WORKERS];
+    char *end = T.map + size;
+    char *p = T.map;
+    int n = 0;
+    while (p < end) {
+        //Move the end of the slice to the start of the next line.
+        char *slice_end = p + (size + T.workers - 1) / T.workers;
+        if (slice_end >= end || n == T.workers - 1) {
+            slice_end = end;
+        } else {
+            char *newline = memchr(slice_end, '\n', end - slice_end);
+            slice_end = newline ? newline + 1 : end;
+        }
+        parts[n].start = p;
+        parts[n].end = slice_end;
+        parts[n].list = (struct rowList){NULL, 0, 0};
+        n++;
+        p = slice_end;
+    }
+
+    runWorkers(indexMapped, parts, sizeof(parts[0]), n);
+    int i;
+    for (i = 0; i < n; i++) {
+        appendRows(&parts[i].list);
+        free(parts[i].list.rows);
+    }
+    madvise(T.map, size, MADV_RANDOM);
+}
+
+void recordDiskFile() {
+    /*
+    Remember which file the rows were last read from or written to.
+    */
+    struct stat st;
+    if (T.filename == NULL || stat(T.filename, &st) == -1) {
+        T.disk_ino = 0;
+        return;
+    }
+    T.disk_dev = st.st_dev;
+    T.disk_ino = st.st_ino;
+    T.disk_size = st.st_size;
+    T.disk_mtime = st.st_mtim;
+}
+
+void fillFileRow(erow *row, char *line, size_t linelen, off_t offset,
+        int encrypted) {
+    /*
+    Fill a row with a line of a file, decrypting it first if it is still
+    encrypted with the shift cipher. offset is where the line starts in the
+    file, or -1 if it has no newline after it or the file is chunked. Only
+    row is touched, so workers can fill rows of their own.
+    */
+    size_t disk_size = linelen;
+
+    //Find the actual length of the line by dropping the '\r' of a CRLF
+    //ending, which has to happen before the line is decrypted.
+    while (linelen > 0 && line[linelen - 1] == '\r') linelen--;
+    //Every byte of the line is decrypted exactly once.
+    if (encrypted) decryptBuffer(line, linelen);
+
+    row->size = linelen;
+    allocChars(row, linelen);
+    memcpy(row->chars, line, linelen);
+    row->chars[linelen] = '\0';
+    row->size_r = 0;
+    row->rcap = 0;
+    row->render = NULL;
+    row->mapped = NULL;
+    row->tabs = NULL;
+    row->ntabs = -1;
+    row->version = T.snapshot;
+    updateRender(row);
+
+    //A save writes the row back unchanged unless its line ending was
+    //stripped.
+    row->disk_off = linelen == disk_size ? offset : -1;
+    row->disk_size = linelen;
+    row->modified = 0;
+}
+
+void insertFileLine(char *line, size_t linelen, off_t offset, int encrypted) {
+    /*
+    Append a line of a file as a row.
+    */
+    fillFileRow(newRow(T.numrows), line, linelen, offset, encrypted);
+    markRowsDirtyFrom(T.numrows);
+    T.numrows++;
+}
+
+//Splits the blocks a file is read in into lines and appends them as rows.
+struct lineReader {
+    //Start of a line cut off at the end of a block, carried over to the
+    //next block.
+    char *line;
+    size_t len;
+    size_t cap;
+    //Offset in the file of the line carried over.
+    off_t line_off;
+    //Set when the lines are still encrypted with the shift cipher.
+    int encrypted;
+};
+
+void splitLines(struct lineReader *lr, char *block, size_t size,
+        off_t block_off) {
+    /*
+    Append the lines of a block. block_off is where the block starts in the
+    file, or -1 when the bytes of the block aren't stored as they are.
+    */
+    char *p = block;
+    char *end = block + size;
+    while (p < end) {
+        char *newline = memchr(p, '\n', end - p);
+        size_t n = (newline ? newline : end) - p;
+        off_t offset = block_off == -1 ? -1 : block_off + (p - block);
+
+        //Carry over the start of a line that continues in the next block.
+        if (newline == NULL || lr->len > 0) {
+            if (lr->len == 0) lr->line_off = offset;
+            if (lr->len + n > lr->cap) {
+                lr->cap = (lr->len + n) * 2;
+                lr->line = realloc(lr->line, lr->cap);
+            }
+            memcpy(&lr->line[lr->len], p, n);
+            lr->len += n;
+            if (newline == NULL) break;
+            insertFileLine(lr->line, lr->len, lr->line_off, lr->encrypted);
+            lr->len = 0;
+        } else {
+            insertFileLine(p, n, offset, lr->encrypted);
+        }
+        p = newline + 1;
+    }
+}
+
+void finishLines(struct lineReader *lr) {
+    /*
+    Append the last line, which has no newline after it.
+    */
+    if (lr->len > 0) insertFileLine(lr->line, lr->len, -1, lr->encrypted);
+    free(lr->line);
+    lr->line = NULL;
+    lr->len = 0;
+    lr->cap = 0;
+}
+
+ssize_t preadAll(int fd, char *buf, size_t len, off_t offset) {
+    /*
+    Read len bytes at an offset unless the file ends first, carrying on
+    after short or interrupted reads. Return how many bytes were read.
+    */
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, buf + done, len - done, offset + done);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) break;
+        done += n;
+    }
+    return done;
+}
+
+ssize_t readAll(int fd, char *buf, size_t len) {
+    /*
+    Read len bytes unless the input ends first, carrying on after the short
+    reads pipes give. Return how many bytes were read.
+    */
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, buf + done, len - done);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) break;
+        done += n;
+    }
+    return done;
+}
+
+//A part of a regular file that one worker reads, decrypts and splits into
+//rows. Lines that run over the start or end of the part are left to the
+//thread that joins the parts back together.
+struct loadPart {
+    int fd;
+    //Engine and context of a chunked file, or NULL for the shift cipher.
+    cipherCtx *ctx;
+    //Where the part starts in the file and how many bytes it has. Parts of
+    //a chunked file hold whole chunks, starting with chunk number chunk.
+    off_t off;
+    size_t len;
+    uint64_t chunk;
+    //Set when the part ends the file.
+    int final;
+    //Text of the part once it is read and decrypted, and how long it is.
+    char *buf;
+    size_t text;
+    //Text before the first newline of the part, including it, and where
+    //the text after the last newline starts. Both are the whole part when
+    //it has no newline.
+    size_t head;
+    size_t tail;
+    struct rowList list;
+    //errno of a failed read or check.
+    int err;
+    //Slab the rows of the part are carved from, handed on to the worker of
+    //the same part in the next batch.
+    struct arena arena;
+};
+
+int decryptChunks(struct loadPart *part) {
+    /*
+    Check and decrypt the chunks of a part in place, moving the text of
+    each chunk over the tags before it so the text ends up in one piece.
+    */
+    const cipherEngine *engine = part->ctx->engine;
+    size_t stride = engine->chunk_size + CHUNK_TAG_SIZE;
+    size_t pos = 0;
+    uint64_t chunk = part->chunk;
+
+    part->text = 0;
+    while (pos < part->len) {
+        size_t len = part->len - pos < stride ? part->len - pos : stride;
+        int final = part->final && pos + len == part->len;
+        char *src = &part->buf[pos];
+
+        //Every chunk but the last is full.
+        if (len < CHUNK_TAG_SIZE || (len < stride && !final)) {
+            errno = EBADMSG;
+            return -1;
+        }
+        len -= CHUNK_TAG_SIZE;
+        if (engine->transform(part->ctx, src, len, chunk, final, 1,
+                (unsigned char *)&src[len]) == -1)
+            return -1;
+        memmove(&part->buf[part->text], src, len);
+        part->text += len;
+        pos += len + CHUNK_TAG_SIZE;
+        chunk++;
+    }
+    return 0;
+}
+
+void readPart(struct loadPart *part) {
+    /*
+    Read a part of a file, decrypt it and make rows of the lines that start
+    and end inside it.
+    */
+    part->list.len = 0;
+    part->err = 0;
+    ssize_t nread = preadAll(part->fd, part->buf, part->len, part->off);
+    if (nread == -1) {
+        part->err = errno;
+        return;
+    }
+    if (part->ctx != NULL) {
+        //A chunked file that is shorter than its size said was cut short.
+        if ((size_t)nread != part->len) {
+            part->err = EBADMSG;
+            return;
+        }
+        if (decryptChunks(part) == -1) {
+            part->err = errno;
+            return;
+        }
+    } else {
+        part->text = nread;
+    }
+
+    //glibc's memchr and memrchr scan with vector instructions.
+    char *first = memchr(part->buf, '\n', part->text);
+    if (first == NULL) {
+        part->head = part->text;
+        part->tail = part->text;
+        return;
+    }
+    char *last = memrchr(part->buf, '\n', part->text);
+    part->head = first - part->buf + 1;
+    part->tail = last - part->buf + 1;
+
+    char *p = first + 1;
+    while (p <= last) {
+        char *newline = memchr(p, '\n', last + 1 - p);
+        off_t offset = part->ctx ? -1 : part->off + (p - part->buf);
+        fillFileRow(pushRow(&part->list), p, newline - p, offset,
+            part->ctx == NULL);
+        p = newline + 1;
+    }
+}
+
+void *loadWorker(void *arg) {
+    /*
+    Read a part on a worker thread. Its rows are carved from the slab of the
+    part rather than that of the thread, so slabs aren't left half used
+    when the threads of a batch end.
+    */
+    struct loadPart *part = arg;
+    struct arena own = rowArena;
+
+    rowArena = part->arena;
+    readPart(part);
+    part->arena = rowArena;
+    rowArena = own;
+    return NULL;
+}
+
+void loadFile(int fd, off_t size, const cipherEngine *engine,
+        const unsigned char *header) {
+    /*
+    Read a regular file in parts that the workers decrypt and split into
+    rows in parallel, a batch of one part per worker at a time. The rows of
+    each batch are joined in order with the lines that cross the parts.
+    engine is the engine of a chunked file, or NULL for the shift cipher.
+
+    In a chunked file every chunk is full but the last one, which may even
+    be empty but is always there, so a file cut short at a chunk boundary
+    is noticed.
+    */
+    cipherCtx ctx;
+    size_t part_size = LOAD_PART_SIZE;
+    off_t off = 0;
+
+    if (engine != NULL) {
+        if (initEngine(&ctx, engine, header) == -1)
+            error_exit("TEXT_EDIT_KEY");
+        //The workers check the size of each chunk, but even an empty file
+        //has a last chunk.
+        if (size <= FILE_HEADER_SIZE) {
+            errno = EBADMSG;
+            error_exit("decrypt");
+        }
+        part_size -= part_size % (engine->chunk_size + CHUNK_TAG_SIZE);
+        off = FILE_HEADER_SIZE;
+    }
+
+    struct loadPart parts[MAX_WORKERS];
+    struct lineReader lr = {NULL, 0, 0, 0, engine == NULL};
+    int used = 0;
+    int i;
+
+    while (off < size) {
+        //Hand out the next part to each worker.
+        int n = 0;
+        for (; n < T.workers && off < size; n++) {
+            struct loadPart *part = &parts[n];
+            if (n == used) {
+                part->buf = malloc(part_size);
+                part->list = (struct rowList){NULL, 0, 0};
+                part->arena = (struct arena){NULL, NULL, 0};
+                used++;
+            }
+            part->fd = fd;
+            part->ctx = engine ? &ctx : NULL;
+            part->off = off;
+            part->len = part_size;
+            if (size - off < (off_t)part_size) part->len = size - off;
+            if (engine != NULL)
+                part->chunk = (off - FILE_HEADER_SIZE) /
+                    (engine->chunk_size + CHUNK_TAG_SIZE);
+            off += part->len;
+            part->final = off == size;
+        }
+
+        runWorkers(loadWorker, parts, sizeof(parts[0]), n);
+
+        //Join the parts, finishing the line carried over from the part
+        //before with the head of each one.
+        for (i = 0; i < n; i++) {
+            struct loadPart *part = &parts[i];
+            off_t text_off = engine ? -1 : part->off;
+            if (part->err != 0) {
+                errno = part->err;
+                error_exit(engine ? "decrypt" : "read");
+            }
+            splitLines(&lr, part->buf, part->head, text_off);
+            appendRows(&part->list);
+            splitLines(&lr, &part->buf[part->tail], part->text - part->tail,
+                engine ? -1 : text_off + (off_t)part->tail);
+        }
+    }
+    finishLines(&lr);
+
+    for (i = 0; i < used; i++) {
+        free(parts[i].buf);
+        free(parts[i].list.rows);
+    }
+    if (engine != NULL) engine->finalize(&ctx);
+}
+
+void closeFile() {
+    /*
+    Throw away the rows of the open file so another one can be opened in
+    its place. Buffers bigger than a slab class are freed one by one, the
+    rest go back all at once with their slabs.
+    */
+    int i;
+    while (T.save != NULL) finishSave();
+    for (i = 0; i < T.numrows; i++) {
+        erow *row = peekRow(i);
+        if (row->rcap > SLAB_MAX) free(row->render);
+        if (!row->inlined && row->cap > SLAB_MAX) free(row->chars);
+        free(row->tabs);
+    }
+    freeSlabs();
+    free(T.row);
+    T.row = NULL;
+    T.numrows = 0;
+    T.gap_start = 0;
+    T.gap_len = 0;
+    if (T.map != NULL) munmap(T.map, T.map_len);
+    T.map = NULL;
+    T.map_len = 0;
+    T.cursor_x = 0;
+    T.cursor_y = 0;
+    T.render_x = 0;
+    T.rowoff = 0;
+    T.coloff = 0;
+    T.disk_ino = 0;
+    T.updated = 0;
+    free(T.undo_log);
+    T.undo_log = NULL;
+    T.undo_cap = 0;
+    T.undo_len = 0;
+    T.undo_end = 0;
+    T.undo_last = -1;
+    T.filter_wanted = 0;
+    resetFilter();
+    T.wrap = 0;
+    resetWrap();
+}
+
+void openFile(char *filename) {
+    /*
+    Open the file to edit.
+    */
+    //Opening over a file that is already open replaces it.
+    if (T.filename != NULL) closeFile();
+    free(T.filename);
+    //Set the file name to the filename variable.
+    T.filename = strdup(filename);
+
+    //Open the file for reading.
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) error_exit("open");
+
+    struct stat st;
+    int regular = fstat(fd, &st) != -1 && S_ISREG(st.st_mode);
+
+    //Files written by an authenticated engine start with a header.
+    unsigned char header[FILE_HEADER_SIZE];
+    const cipherEngine *engine = NULL;
+    if (regular) {
+        ssize_t nread = preadAll(fd, (char *)header, FILE_HEADER_SIZE, 0);
+        if (nread > 0) engine = headerEngine(header, nread);
+    }
+
+    //Map big files and decrypt their rows on demand instead of reading the
+    //whole file up front.
+    if (engine == NULL && regular && st.st_size >= LAZY_OPEN_MIN) {
+        openMappedFile(fd, st.st_size);
+        close(fd);
+        recordDiskFile();
+        resetFilter();
+        T.updated = 0;
+        return;
+    }
+
+    //Other regular files are read and decrypted by the workers.
+    if (regular) {
+        loadFile(fd, st.st_size, engine, header);
+        close(fd);
+        recordDiskFile();
+        resetFilter();
+        T.updated = 0;
+        return;
+    }
+
+    //Read anything else, such as a pipe, in large blocks and split each
+    //block into lines.
+    char *block = malloc(OPEN_BLOCK_SIZE);
+    struct lineReader lr = {NULL, 0, 0, 0, 1};
+    off_t block_off = 0;
+    ssize_t nread;
+
+    while ((nread = read(fd, block, OPEN_BLOCK_SIZE)) != 0) {
+        if (nread == -1) {
+            if (errno == EINTR) continue;
+            error_exit("read");
+        }
+        splitLines(&lr, block, nread, block_off);
+        block_off += nread;
+    }
+    finishLines(&lr);
+
+    free(block);
+    close(fd);
+    recordDiskFile();
+    resetFilter();
+    T.updated = 0;
+}
+
+double monotonicTime() {
+    /*
+    Return seconds on a clock that only moves forward, for timing.
+    */
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int writeAll(int fd, const char *buf, size_t len) {
+    /*
+    Write the whole buffer, carrying on after short or interrupted writes.
+    */
+    while (len > 0) {
+        ssize_t written = write(fd, buf, len);
+        if (written == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += written;
+        len -= written;
+    }
+    return 0;
+}
+
+int syncParentDir(const char *filename) {
+    /*
+    Flush the directory holding the file so a rename into it is durable.
+    */
+    char *path = strdup(filename);
+    int fd = open(dirname(path), O_RDONLY | O_DIRECTORY);
+    free(path);
+    if (fd == -1) return -1;
+    int result = fsync(fd);
+    close(fd);
+    return result;
+}
+
+int openTempFile(const char *filename, char **tmpname) {
+    /*
+    Create a temporary file next to the file being saved, with the same
+    permissions, so it can later be renamed over it.
+    */
+    size_t size = strlen(filename) + 16;
+    *tmpname = malloc(size);
+    snprintf(*tmpname, size, "%s.saveXXXXXX", filename);
+
+    int fd = mkstemp(*tmpname);
+    if (fd == -1) {
+        free(*tmpname);
+        *tmpname = NULL;
+        return -1;
+    }
+    struct stat st;
+    fchmod(fd, stat(filename, &st) == 0 ? (st.st_mode & 07777) : 0644);
+    return fd;
+}
+
+char *saveBuffer() {
+    /*
+    Return the buffer rows are encrypted into while saving.
+    */
+    static char *buf = NULL;
+    if (buf == NULL) buf = malloc(SAVE_BUFFER_SIZE);
+    return buf;
+}
+
+//Encrypted output of a save. Bytes are collected in the save buffer, which
+//is written out each time it fills up. Chunked engines keep whole chunks
+//and their tags in the buffer.
+struct saveStream {
+    int fd;
+    cipherCtx *ctx;
+    char *buf;
+    //Bytes in buf and how many fit in it.
+    size_t used;
+    size_t cap;
+    //Number of the chunk being filled and how much text it holds.
+    uint64_t chunk;
+    size_t fill;
+    //Bytes written to the file so far.
+    size_t written;
+};
+
+void startStream(struct saveStream *s, int fd, cipherCtx *ctx, char *buf) {
+    /*
+    Start a stream that collects its bytes in buf, which holds
+    SAVE_BUFFER_SIZE bytes.
+    */
+    size_t chunk = ctx->engine->chunk_size;
+    s->fd = fd;
+    s->ctx = ctx;
+    s->buf = buf;
+    s->used = 0;
+    s->cap = SAVE_BUFFER_SIZE;
+    if (chunk) s->cap -= SAVE_BUFFER_SIZE % (chunk + CHUNK_TAG_SIZE);
+    s->chunk = 0;
+    s->fill = 0;
+    s->written = 0;
+}
+
+int flushStream(struct saveStream *s) {
+    /*
+    Write out everything in the buffer of a save stream and empty it.
+    */
+    if (writeAll(s->fd, s->buf, s->used) == -1) return -1;
+    s->written += s->used;
+    s->used = 0;
+    return 0;
+}
+
+int sealChunk(struct saveStream *s, int final) {
+    /*
+    Encrypt the chunk at the end of the buffer and put its tag after it.
+    */
+    char *text = &s->buf[s->used - s->fill];
+    if (s->ctx->engine->transform(s->ctx, text, s->fill, s->chunk, final, 0,
+            (unsigned char *)&s->buf[s->used]) == -1)
+        return -1;
+    s->used += CHUNK_TAG_SIZE;
+    s->chunk++;
+    s->fill = 0;
+    return 0;
+}
+
+int streamWrite(struct saveStream *s, const char *src, size_t len, int plain) {
+    /*
+    Add bytes to the stream. plain is 0 for bytes that are still encrypted
+    with the shift cipher, such as rows in a mapped file.
+    */
+    size_t chunk = s->ctx->engine->chunk_size;
+    while (len > 0) {
+        size_t room = chunk ? chunk - s->fill : s->cap - s->used;
+        if (room == 0) {
+            //A full chunk is only sealed once more text follows it, so the
+            //last chunk of the file is the one marked final.
+            if (chunk && sealChunk(s, 0) == -1) return -1;
+            if (s->used == s->cap && flushStream(s) == -1) return -1;
+            continue;
+        }
+        size_t n = room < len ? room : len;
+        char *dst = &s->buf[s->used];
+        memcpy(dst, src, n);
+        //Stream engines encrypt as the bytes are copied, while chunked
+        //engines encrypt a chunk once it is full.
+        if (!chunk && plain) {
+            s->ctx->engine->transform(s->ctx, dst, n, 0, 0, 0, NULL);
+        } else if (chunk && !plain) {
+            decryptBuffer(dst, n);
+        }
+        s->used += n;
+        if (chunk) s->fill += n;
+        src += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int finishStream(struct saveStream *s) {
+    /*
+    Seal the last chunk of a save stream, if its engine has chunks, and
+    write out what is left.
+    */
+    if (s->ctx->engine->chunk_size && sealChunk(s, 1) == -1) return -1;
+    return flushStream(s);
+}
+
+//A save that runs on a background thread from a snapshot of the rows.
+struct saveJob {
+    pthread_t thread;
+    //Set when the save runs on its own thread rather than the main one.
+    int threaded;
+    char *filename;
+    cipherCtx ctx;
+    saveRow *rows;
+    int numrows;
+    //T.updated when the snapshot was taken.
+    int updated;
+    //Identity of the file as it was last opened or saved.
+    dev_t disk_dev;
+    ino_t disk_ino;
+    off_t disk_size;
+    struct timespec disk_mtime;
+    //Bytes of text the save covers and how many it got through so far.
+    size_t total;
+    atomic_size_t done;
+    //Set once the save thread is done and the fields below are filled in.
+    atomic_int finished;
+    //0 when the file was saved and -1 when it wasn't, with errno in err.
+    int result;
+    int err;
+    //Set when only the changed parts of the file were written.
+    int in_place;
+    size_t written;
+    double start;
+};
+
+int writeRows(int fd, struct saveJob *job, size_t *written) {
+    /*
+    Encrypt the rows into a fixed-size buffer and write the buffer out each
+    time it fills up, so a save never holds a second copy of the document.
+    Where each row lands in the file is recorded in it for later incremental
+    saves. Files of chunked engines start with the header of the job's
+    cipher.
+    */
+    cipherCtx *ctx = &job->ctx;
+    struct saveStream s;
+    int chunked = ctx->engine->chunk_size != 0;
+    size_t done = atomic_load_explicit(&job->done, memory_order_relaxed);
+    int j;
+
+    startStream(&s, fd, ctx, saveBuffer());
+    if (chunked) {
+        if (writeAll(fd, (char *)ctx->header, FILE_HEADER_SIZE) == -1)
+            return -1;
+        s.written = FILE_HEADER_SIZE;
+    }
+
+    for (j = 0; j < job->numrows; j++) {
+        saveRow *row = &job->rows[j];
+
+        //Rows of a chunked file aren't stored as they are.
+        row->disk_off = chunked ? -1 : (off_t)(s.written + s.used);
+        row->disk_size = row->size;
+        row->modified = 0;
+
+        if (streamWrite(&s, row->bytes, row->size, row->plain) == -1)
+            return -1;
+        if (streamWrite(&s, "\n", 1, 1) == -1) return -1;
+        done += row->size + 1;
+        atomic_store_explicit(&job->done, done, memory_order_relaxed);
+    }
+    if (finishStream(&s) == -1) return -1;
+    *written = s.written;
+    return 0;
+}
+
+int pwriteAll(int fd, const char *buf, size_t len, off_t offset) {
+    /*
+    Write the whole buffer at an offset, carrying on after short writes.
+    */
+    while (len > 0) {
+        ssize_t written = pwrite(fd, buf, len, offset);
+        if (written == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += written;
+        len -= written;
+        offset += written;
+    }
+    return 0;
+}
+
+int pwriteRow(int fd, saveRow *row) {
+    /*
+    Encrypt a row and write it over its old bytes in the file.
+    */
+    char *buf = saveBuffer();
+    size_t done = 0;
+
+    while (done < (size_t)row->size) {
+        size_t n = row->size - done;
+        if (n > SAVE_BUFFER_SIZE) n = SAVE_BUFFER_SIZE;
+        memcpy(buf, &row->bytes[done], n);
+        encryptBuffer(buf, n);
+        if (pwriteAll(fd, buf, n, row->disk_off + done) == -1) return -1;
+        done += n;
+    }
+    row->modified = 0;
+    return 0;
+}
+
+int saveInPlace(struct saveJob *job, size_t *written) {
+    /*
+    Save by writing only what changed into the file that was last opened or
+    saved, when every row kept its place and length so the changed ones can
+    be written over their old bytes. Anything that moves bytes around goes
+    through a temporary file instead, since truncating and rewriting the
+    live file would leave it cut short if the save stopped halfway. Return 1
+    when the file can't be saved this way.
+    */
+    struct stat st;
+    //Chunks are authenticated as a whole, so only lines encrypted with a
+    //stream engine can be written over one by one.
+    if (job->ctx.engine->chunk_size || job->disk_ino == 0 ||
+            stat(job->filename, &st) == -1 ||
+            st.st_dev != job->disk_dev || st.st_ino != job->disk_ino ||
+            st.st_size != job->disk_size ||
+            st.st_mtim.tv_sec != job->disk_mtime.tv_sec ||
+            st.st_mtim.tv_nsec != job->disk_mtime.tv_nsec)
+        return 1;
+
+    //Every row has to be where the file has it, with the same length.
+    off_t off = 0;
+    int j;
+    for (j = 0; j < job->numrows; j++) {
+        saveRow *row = &job->rows[j];
+        if (row->disk_off != off || row->disk_size != row->size) return 1;
+        off += row->size + 1;
+    }
+    if (off != job->disk_size) return 1;
+
+    int fd = open(job->filename, O_WRONLY);
+    if (fd == -1) return -1;
+
+    *written = 0;
+    for (j = 0; j < job->numrows; j++) {
+        saveRow *row = &job->rows[j];
+        if (row->modified) {
+            if (pwriteRow(fd, row) == -1) goto fail;
+            *written += row->size;
+        }
+        atomic_fetch_add_explicit(&job->done, row->size + 1,
+            memory_order_relaxed);
+    }
+    if (fsync(fd) == -1) goto fail;
+    if (close(fd) == -1) return -1;
+    return 0;
+
+fail:
+    close(fd);
+    return -1;
+}
+
+int saveToTempFile(struct saveJob *job, size_t *written) {
+    /*
+    Write the rows to a temporary file and only replace the original once
+    all of it is on disk. A mapped file stays readable after the rename,
+    since the mapping keeps the old file alive.
+    */
+    char *tmpname;
+    int fd = openTempFile(job->filename, &tmpname);
+    if (fd == -1) return -1;
+
+    if (writeRows(fd, job, written) == 0 && fsync(fd) == 0) {
+        if (close(fd) == 0 && rename(tmpname, job->filename) == 0) {
+            syncParentDir(job->filename);
+            free(tmpname);
+            return 0;
+        }
+    } else {
+        close(fd);
+    }
+    //Keep errno from the failed step while the temporary file is removed.
+    int saved_errno = errno;
+    unlink(tmpname);
+    free(tmpname);
+    errno = saved_errno;
+    return -1;
+}
+
+void *saveThread(void *arg) {
+    /*
+    Save the snapshot of a job. When the changed rows kept their length,
+    they are written over their old bytes in place. Otherwise the data goes
+    to a temporary file that is synced and then renamed over the original,
+    so a crash or a full disk in the middle of a save leaves the old file
+    untouched.
+    */
+    struct saveJob *job = arg;
+
+    job->result = saveInPlace(job, &job->written);
+    job->in_place = job->result == 0;
+    if (job->result == 1) job->result = saveToTempFile(job, &job->written);
+    job->err = errno;
+    atomic_store(&job->finished, 1);
+    return NULL;
+}
+
+void finishSave() {
+    /*
+    Wait for the running save and take over its outcome. The disk offsets
+    it recorded only describe the rows if they weren't edited meanwhile.
+    Otherwise the next save rewrites the whole file.
+    */
+    struct saveJob *job = T.save;
+    int i;
+
+    if (job->threaded) pthread_join(job->thread, NULL);
+    T.save = NULL;
+    for (i = 0; i < T.nretired; i++)
+        rowFree(T.retired[i].chars, T.retired[i].cap);
+    T.nretired = 0;
+    job->ctx.engine->finalize(&job->ctx);
+
+    if (job->result == -1) {
+        //The rows no longer match what is on disk after a failed save.
+        T.disk_ino = 0;
+        updateStatusBar("Can't save! I/O error: %s", strerror(job->err));
+    } else {
+        if (T.updated == job->updated) {
+            for (i = 0; i < job->numrows; i++) {
+                erow *row = peekRow(i);
+                row->disk_off = job->rows[i].disk_off;
+                row->disk_size = job->rows[i].disk_size;
+                row->modified = job->rows[i].modified;
+            }
+            recordDiskFile();
+        } else {
+            T.disk_ino = 0;
+        }
+        T.updated -= job->updated;
+        double elapsed = monotonicTime() - job->start;
+        if (job->in_place) {
+            updateStatusBar("%zu changed bytes written to disk in %.1f ms",
+                job->written, elapsed * 1e3);
+        } else {
+            updateStatusBar("%zu bytes written to disk (%s, %.1f MB/s)",
+                job->written, job->ctx.engine->name,
+                elapsed > 0 ? job->written / elapsed / 1e6 : 0.0);
+        }
+    }
+    free(job->rows);
+    free(job->filename);
+    free(job);
+
+    if (T.save_again) {
+        T.save_again = 0;
+        saveFile();
+    }
+}
+
+void pollSave() {
+    /*
+    Take over the outcome of the running save if it is done.
+    */
+    if (T.save != NULL && atomic_load(&T.save->finished)) finishSave();
+}
+
+void saveFile() {
+    /*
+    Encrypt the document and save it on a background thread. The rows are
+    snapshotted by copying their pointers, and rows that are edited before
+    the save is done get a copy of their own, so the editor keeps working
+    while the file is written.
+    */
+    if (T.save != NULL) {
+        T.save_again = 1;
+        return;
+    }
+
+    //Get the new name of the file if it's not an existing file.
+    if (T.filename == NULL) {
+        T.filename = getPromptInput("Save as: %s (ESC to cancel)", NULL, 0);
+        if (T.filename == NULL) {
+            updateStatusBar("Save aborted");
+            return;
+        }
+    }
+
+    struct saveJob *job = malloc(sizeof(*job));
+    job->start = monotonicTime();
+
+    //A new header, and with it a new nonce, is made for every save.
+    if (initEngine(&job->ctx, saveEngine(), NULL) == -1) {
+        updateStatusBar("Can't save! Cipher error: %s", strerror(errno));
+        free(job);
+        return;
+    }
+
+    job->filename = strdup(T.filename);
+    job->numrows = T.numrows;
+    job->rows = malloc(sizeof(saveRow) * (T.numrows ? T.numrows : 1));
+    job->updated = T.updated;
+    job->disk_dev = T.disk_dev;
+    job->disk_ino = T.disk_ino;
+    job->disk_size = T.disk_size;
+    job->disk_mtime = T.disk_mtime;
+    job->total = 0;
+    atomic_init(&job->done, 0);
+    atomic_init(&job->finished, 0);
+
+    int i;
+    for (i = 0; i < T.numrows; i++) {
+        erow *row = peekRow(i);
+        saveRow *snap = &job->rows[i];
+        snap->plain = row->chars != NULL;
+        snap->bytes = snap->plain ? row->chars : row->mapped;
+        if (row->inlined) {
+            memcpy(snap->short_chars, row->chars, row->size);
+            snap->bytes = snap->short_chars;
+        }
+        snap->size = row->size;
+        snap->disk_off = row->disk_off;
+        snap->disk_size = row->disk_size;
+        snap->modified = row->modified;
+        job->total += row->size + 1;
+    }
+
+    //Every chars buffer allocated from here on is one the save doesn't read.
+    T.snapshot++;
+    T.save = job;
+    job->threaded = pthread_create(&job->thread, NULL, saveThread, job) == 0;
+    if (!job->threaded) {
+        saveThread(job);
+        finishSave();
+    }
+}
+
+
+int reserveBuffer(struct abuf *ab, int len) {
+    /*
+    Make sure abuf has room for len more bytes, doubling its capacity so that
+    appends only allocate now and then.
+    */
+    if (ab->len + len <= ab->cap) return 0;
+
+    int cap = ab->cap ? ab->cap : 1024;
+    while (cap < ab->len + len) cap *= 2;
+    char *new = realloc(ab->b, cap);
+
+    if (new == NULL) return -1;
+    ab->b = new;
+    ab->cap = cap;
+    T.allocations++;
+    return 0;
+}
+
+void appendBuffer(struct abuf *ab, const char *s, int len) {
+    /*
+    Append a string to abuf.
+    */
+
+    //Allocate enough memory to hold the new string.
+    if (reserveBuffer(ab, len) == -1) return;
+
+    //Copy the new string after the end of the current data in the buffer.
+    memcpy(&ab->b[ab->len], s, len);
+    //Update the length of the abuf to the new value.
+    ab->len += len;
+}
+
+void appendSpaces(struct abuf *ab, int count) {
+    /*
+    Append a run of spaces to abuf in one go.
+    */
+    if (count <= 0 || reserveBuffer(ab, count) == -1) return;
+    memset(&ab->b[ab->len], ' ', count);
+    ab->len += count;
+}
+
+void resetBuffer(struct abuf *ab) {
+    /*
+    Empty abuf but keep its memory for the next use.
+    */
+    ab->len = 0;
+}
+
+void freeBuffer(struct abuf *ab) {
+    /*
+    Deallocates the dynamice memory used by an abuf.
+    */
+
+    free(ab->b);
+    ab->b = NULL;
+    ab->len = 0;
+    ab->cap = 0;
+}
+
+/*** search ***/
+
+//Kernel picked by initSearch() for the CPU the editor runs on.
+const char *(*findKernel)(const char *hay, size_t len, const char *needle,
+    size_t nlen);
+
+const char *findScalar(const char *hay, size_t len, const char *needle,
+        size_t nlen) {
+    /*
+    Return the first place needle occurs in hay, or NULL.
+    */
+    return memmem(hay, len, needle, nlen);
+}
+
+#ifdef CIPHER_X86
+__attribute__((target("sse2")))
+const char *findSSE2(const char *hay, size_t len, const char *needle,
+        size_t nlen) {
+    /*
+    Compare the first and last byte of needle with 16 places of hay at once
+    and only compare the rest of it where both of them match.
+    */
+    if (nlen < 2 || len < nlen) return findScalar(hay, len, needle, nlen);
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[nlen - 1]);
+    size_t i = 0;
+
+    for (; i + nlen - 1 + 16 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(hay + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(hay + i + nlen - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(
+            _mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask != 0) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(hay + i + bit + 1, needle + 1, nlen - 2) == 0)
+                return hay + i + bit;
+            mask &= mask - 1;
+        }
+    }
+    return findScalar(hay + i, len - i, needle, nlen);
+}
+
+__attribute__((target("avx2")))
+const char *findAVX2(const char *hay, size_t len, const char *needle,
+        size_t nlen) {
+    /*
+    Compare the first and last byte of needle with 32 places of hay at once
+    and only compare the rest of it where both of them match.
+    */
+    if (nlen < 2 || len < nlen) return findScalar(hay, len, needle, nlen);
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[nlen - 1]);
+    size_t i = 0;
+
+    for (; i + nlen - 1 + 32 <= len; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(hay + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(hay + i + nlen - 1));
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(
+            _mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+        while (mask != 0) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(hay + i + bit + 1, needle + 1, nlen - 2) == 0)
+                return hay + i + bit;
+            mask &= mask - 1;
+        }
+    }
+    return findScalar(hay + i, len - i, needle, nlen);
+}
+#endif
+
+void initSearch() {
+    /*
+    Pick the widest search kernel the CPU supports.
+    */
+    findKernel = findScalar;
+#ifdef CIPHER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        findKernel = findAVX2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        findKernel = findSSE2;
+    }
+#endif
+}
+
+uint32_t trigramHash(const char *s) {
+    /*
+    Hash the three bytes at s. The top bits of the hash pick the bit of a
+    filter bitmap, as many of them as the bitmap needs.
+    */
+    const unsigned char *p = (const unsigned char *)s;
+    uint32_t v = p[0] | (p[1] << 8) | ((uint32_t)p[2] << 16);
+    return v * 2654435761u;
+}
+
+void addText(struct filterBlock *block, const char *s, int from, int to,
+        int size) {
+    /*
+    Set the bits of a built block for the bytes of s, which is size bytes
+    long, from index from up to index to and for the trigrams that overlap
+    them.
+    */
+    int i;
+    if (to > size) to = size;
+    for (i = from; i < to; i++) {
+        unsigned char c = s[i];
+        block->bytes_seen[c / 64] |= (uint64_t)1 << (c % 64);
+    }
+    if (from < 2) from = 2;
+    for (i = from - 2; i < to && i + 3 <= size; i++) {
+        uint32_t bit = trigramHash(&s[i]) >> (32 - block->bits_log);
+        block->bits[bit / 64] |= (uint64_t)1 << (bit % 64);
+    }
+}
+
+const char *rowText(erow *row, char **scratch, int *scratch_cap) {
+    /*
+    Return the text of a row, decrypting a row that still lives in a mapped
+    file into scratch instead of keeping it. The row is only read, so
+    workers can call this for rows of their own.
+    */
+    if (row->chars != NULL) return row->chars;
+    if (row->size > *scratch_cap) {
+        *scratch_cap = growCapacity(*scratch_cap, row->size);
+        *scratch = realloc(*scratch, *scratch_cap);
+    }
+    memcpy(*scratch, row->mapped, row->size);
+    decryptBuffer(*scratch, row->size);
+    return *scratch;
+}
+
+void resetFilter() {
+    /*
+    Throw the search filter away and start over with one block for the whole
+    file, to be built while the editor waits for keys.
+    */
+    int i;
+    for (i = 0; i < T.nfilter; i++) free(T.filter[i].bits);
+    if (T.filter_cap == 0) {
+        T.filter_cap = 16;
+        T.filter = malloc(sizeof(struct filterBlock) * T.filter_cap);
+    }
+    T.filter[0].rows = T.numrows;
+    T.filter[0].bytes = 0;
+    T.filter[0].bits = NULL;
+    T.nfilter = 1;
+    T.filter_todo = 0;
+    T.filter_todo_start = 0;
+    T.filter_hint = 0;
+    T.filter_hint_start = 0;
+}
+
+int findBlock(int at, int *start) {
+    /*
+    Return the filter block holding the row at index at, or the last block
+    for the index just past the last row, and set start to its first row.
+    */
+    //Walk from the block found last time, since edits stay close together.
+    int b = T.filter_hint;
+    int s = T.filter_hint_start;
+    while (b > 0 && s > at) s -= T.filter[--b].rows;
+    while (b < T.nfilter - 1 && s + T.filter[b].rows <= at)
+        s += T.filter[b++].rows;
+    T.filter_hint = b;
+    T.filter_hint_start = s;
+    *start = s;
+    return b;
+}
+
+void filterAdd(int b, int start, const char *s, int from, int to,
+        int size) {
+    /*
+    Add the trigrams around the bytes from index from up to index to of a
+    row in block b, which starts at row start, that were just inserted or
+    brought together.
+    */
+    struct filterBlock *block = &T.filter[b];
+    block->bytes += to - from;
+    if (block->bits == NULL) return;
+    //A block that grew too big for its bitmap to rule much out is split up
+    //again by the next build step.
+    if (block->rows > 2 * FILTER_BLOCK_ROWS ||
+            block->bytes > 2 * FILTER_BLOCK_BYTES ||
+            block->bytes > 4 << block->bits_log) {
+        free(block->bits);
+        block->bits = NULL;
+        if (b < T.filter_todo) {
+            T.filter_todo = b;
+            T.filter_todo_start = start;
+        }
+        return;
+    }
+    addText(block, s, from, to, size);
+}
+
+void filterInsertRow(int at, erow *row) {
+    /*
+    Count a row inserted at index at in the filter block it lands in.
+    */
+    int start;
+    int b = findBlock(at, &start);
+    T.filter[b].rows++;
+    if (b < T.filter_todo) T.filter_todo_start++;
+    filterAdd(b, start, row->chars, 0, row->size, row->size);
+}
+
+void filterEditRow(erow *row, int from, int to) {
+    /*
+    Add the trigrams of a row that changed between index from and index to.
+    */
+    int start;
+    int b = findBlock(rowIndex(row), &start);
+    filterAdd(b, start, row->chars, from, to, row->size);
+}
+
+void filterDeleteRow(int at) {
+    /*
+    Take a deleted row out of its filter block. The bits of its trigrams
+    stay set until the block is rebuilt.
+    */
+    int start;
+    int b = findBlock(at, &start);
+    if (b < T.filter_todo) T.filter_todo_start--;
+    if (--T.filter[b].rows > 0 || T.nfilter == 1) return;
+    //Drop a block that lost its last row.
+    free(T.filter[b].bits);
+    memmove(&T.filter[b], &T.filter[b + 1],
+        sizeof(struct filterBlock) * (T.nfilter - b - 1));
+    T.nfilter--;
+    if (T.filter_todo > b) T.filter_todo--;
+    T.filter_hint = 0;
+    T.filter_hint_start = 0;
+}
+
+//Rows one worker splits into filter blocks and builds the bitmaps of.
+struct filterPart {
+    int start;
+    int end;
+    struct filterBlock *blocks;
+    int len;
+    int cap;
+};
+
+void *filterWorker(void *arg) {
+    /*
+    Build filter blocks for the rows of a part, closing a block once it
+    holds enough rows or text. An empty part gets one empty block.
+    */
+    struct filterPart *part = arg;
+    char *scratch = NULL;
+    int scratch_cap = 0;
+    int at = part->start;
+    const char *mapped_from = NULL;
+    const char *mapped_to = NULL;
+
+    do {
+        if (part->len == part->cap) {
+            part->cap = part->cap ? part->cap * 2 : 16;
+            part->blocks = realloc(part->blocks,
+                sizeof(struct filterBlock) * part->cap);
+        }
+        struct filterBlock *block = &part->blocks[part->len++];
+        //Find the rows of the block first, to size its bitmap by their text.
+        block->rows = 0;
+        block->bytes = 0;
+        while (at + block->rows < part->end &&
+                block->rows < FILTER_BLOCK_ROWS &&
+                block->bytes < FILTER_BLOCK_BYTES)
+            block->bytes += peekRow(at + block->rows++)->size;
+        block->bits_log = FILTER_MIN_BITS_LOG;
+        while (block->bits_log < FILTER_BITS_LOG &&
+                2 << block->bits_log < block->bytes)
+            block->bits_log++;
+        block->bits = calloc((1 << block->bits_log) / 64, sizeof(uint64_t));
+        memset(block->bytes_seen, 0, sizeof(block->bytes_seen));
+
+        int end = at + block->rows;
+        for (; at < end; at++) {
+            erow *row = peekRow(at);
+            if (row->chars == NULL) {
+                if (mapped_from == NULL) mapped_from = row->mapped;
+                mapped_to = row->mapped + row->size;
+            }
+            const char *text = rowText(row, &scratch, &scratch_cap);
+            addText(block, text, 0, row->size, row->size);
+        }
+    } while (at < part->end);
+    free(scratch);
+    //The filter keeps what it needs of the text, so the pages that were
+    //read for it can go.
+    if (mapped_from != NULL) dropMapped(mapped_from, mapped_to);
+    return NULL;
+}
+
+int filterPending() {
+    /*
+    Check whether some block of the search filter still has to be built.
+    */
+    if (!T.filter_wanted) return 0;
+    while (T.filter_todo < T.nfilter && T.filter[T.filter_todo].bits != NULL)
+        T.filter_todo_start += T.filter[T.filter_todo++].rows;
+    return T.filter_todo < T.nfilter;
+}
+
+void buildFilterStep() {
+    /*
+    Build the filter for the rows at the front of the first block that isn't
+    built yet, on the workers. Only a few bytes per worker are taken at a
+    time, so a key that arrives meanwhile isn't kept waiting.
+    */
+    if (!filterPending()) return;
+    int b = T.filter_todo;
+    int start = T.filter_todo_start;
+    int i;
+
+    //Take rows until there is enough text for every worker.
+    int rows = T.filter[b].rows;
+    long budget = (long)FILTER_STEP_BYTES * T.workers;
+    int n = 0;
+    while (n < rows && budget > 0) budget -= peekRow(start + n++)->size + 1;
+
+    int workers = n / FILTER_BLOCK_ROWS + 1;
+    if (workers > T.workers) workers = T.workers;
+    struct filterPart parts[MAX_WORKERS];
+    for (i = 0; i < workers; i++) {
+        parts[i].start = start + (long)n * i / workers;
+        parts[i].end = start + (long)n * (i + 1) / workers;
+        parts[i].blocks = NULL;
+        parts[i].len = 0;
+        parts[i].cap = 0;
+    }
+    runWorkers(filterWorker, parts, sizeof(struct filterPart), workers);
+
+    //Put the new blocks in place of the front of the old one, which keeps
+    //the rows that weren't taken.
+    int built = 0;
+    for (i = 0; i < workers; i++) built += parts[i].len;
+    int left = rows - n;
+    int added = built + (left > 0) - 1;
+    if (T.nfilter + added > T.filter_cap) {
+        T.filter_cap = growCapacity(T.filter_cap, T.nfilter + added);
+        T.filter = realloc(T.filter, sizeof(struct filterBlock) * T.filter_cap);
+    }
+    memmove(&T.filter[b + 1 + added], &T.filter[b + 1],
+        sizeof(struct filterBlock) * (T.nfilter - b - 1));
+    T.nfilter += added;
+    int at = b;
+    for (i = 0; i < workers; i++) {
+        memcpy(&T.filter[at], parts[i].blocks,
+            sizeof(struct filterBlock) * parts[i].len);
+        at += parts[i].len;
+        free(parts[i].blocks);
+    }
+    if (left > 0) {
+        T.filter[at].rows = left;
+        T.filter[at].bytes = 0;
+        T.filter[at].bits = NULL;
+    }
+    T.filter_todo = b + built;
+    T.filter_todo_start = start + n;
+    T.filter_hint = 0;
+    T.filter_hint_start = 0;
+}
+
+int blockLacks(struct filterBlock *block, uint64_t *bytes, uint32_t *grams,
+        int n) {
+    /*
+    Check whether a built block is missing one of the bytes or one of the n
+    trigram hashes of a query, which means none of its rows can match.
+    */
+    int i;
+    if (block->bits == NULL) return 0;
+    for (i = 0; i < 4; i++)
+        if ((block->bytes_seen[i] & bytes[i]) != bytes[i]) return 1;
+    for (i = 0; i < n; i++) {
+        uint32_t bit = grams[i] >> (32 - block->bits_log);
+        if (!(block->bits[bit / 64] & ((uint64_t)1 << (bit % 64)))) return 1;
+    }
+    return 0;
+}
+
+int findInRow(const char *text, int size, const char *query, int qlen,
+        int x, int dir) {
+    /*
+    Return the index of the first match in text at or after x, or of the
+    last one at or before x when dir is negative, or -1 if there is none.
+    */
+    if (qlen > size) return -1;
+    if (dir > 0) {
+        if (x < 0) x = 0;
+        if (x > size - qlen) return -1;
+        const char *match = findKernel(text + x, size - x, query, qlen);
+        return match ? match - text : -1;
+    }
+    int last = -1;
+    const char *match;
+    int from = 0;
+    while (from <= x && from <= size - qlen &&
+            (match = findKernel(text + from, size - from, query, qlen)) != NULL &&
+            match - text <= x) {
+        last = match - text;
+        from = last + 1;
+    }
+    return last;
+}
+
+int findMatch(const char *query, int qlen, int dir, int *match_y,
+        int *match_x) {
+    /*
+    Look for query from the position in match_y/match_x on, forward or
+    backward by dir, wrapping around the ends of the file, and move
+    match_y/match_x to the match. Blocks of rows whose filter is missing a
+    trigram of the query are skipped whole. Return 0 if there is no match.
+
+    Rows that still live in a mapped file are searched without decrypting
+    them. The shift cipher changes every byte on its own, so a row holds
+    the query exactly where its encrypted bytes hold the shifted query.
+    */
+    if (T.numrows == 0 || qlen == 0) return 0;
+    uint64_t bytes[4] = {0, 0, 0, 0};
+    int n = qlen >= 3 ? qlen - 2 : 0;
+    uint32_t *grams = malloc(sizeof(uint32_t) * (n + 1));
+    int i;
+    for (i = 0; i < qlen; i++) {
+        unsigned char c = query[i];
+        bytes[c / 64] |= (uint64_t)1 << (c % 64);
+    }
+    for (i = 0; i < n; i++) grams[i] = trigramHash(&query[i]);
+    char *shifted = malloc(qlen);
+    memcpy(shifted, query, qlen);
+    encryptBuffer(shifted, qlen);
+
+    int y = *match_y;
+    int x = *match_x;
+    if (y >= T.numrows) {
+        y = dir > 0 ? 0 : T.numrows - 1;
+        x = dir > 0 ? 0 : INT_MAX;
+    }
+    int start;
+    int b = findBlock(y, &start);
+    //Every row is looked at once, and the first one again in full.
+    int left = T.numrows + 1;
+    int found = 0;
+
+    while (left > 0) {
+        //Find the block of row y, wrapping around the ends of the file.
+        if (y == T.numrows) {
+            y = 0;
+            b = 0;
+            start = 0;
+        } else if (y < 0) {
+            y = T.numrows - 1;
+            b = T.nfilter - 1;
+            start = T.numrows - T.filter[b].rows;
+        }
+        while (y >= start + T.filter[b].rows) start += T.filter[b++].rows;
+        while (y < start) start -= T.filter[--b].rows;
+
+        struct filterBlock *block = &T.filter[b];
+        if (blockLacks(block, bytes, grams, n)) {
+            //Skip the rest of the block in the direction of the search.
+            int skip = dir > 0 ? start + block->rows - y : y - start + 1;
+            left -= skip;
+            y += dir * skip;
+        } else {
+            erow *row = peekRow(y);
+            int at = row->chars != NULL ?
+                findInRow(row->chars, row->size, query, qlen, x, dir) :
+                findInRow(row->mapped, row->size, shifted, qlen, x, dir);
+            if (at != -1) {
+                *match_y = y;
+                *match_x = at;
+                found = 1;
+                break;
+            }
+            left--;
+            y += dir;
+        }
+        x = dir > 0 ? 0 : INT_MAX;
+    }
+    free(shifted);
+    free(grams);
+    return found;
+}
+
+void searchCallback(char *query, int key) {
+    /*
+    Move the cursor to a match of the query each time it changes. The arrow
+    keys step to the next or previous match.
+    */
+    static int direction = 1;
+    int y = T.cursor_y;
+    int x = T.cursor_x;
+
+    if (key == '\r' || key == '\x1b') {
+        direction = 1;
+        return;
+    } else if (key == SAVE_TICK || key == WINDOW_RESIZED) {
+        return;
+    } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+        direction = 1;
+        x++;
+    } else if (key == ARROW_LEFT || key == ARROW_UP) {
+        direction = -1;
+        x--;
+    } else {
+        //The query changed, so look again from where the search started.
+        direction = 1;
+        y = T.search_y;
+        x = T.search_x;
+    }
+
+    if (findMatch(query, strlen(query), direction, &y, &x)) {
+        T.cursor_y = y;
+        T.cursor_x = x;
+    }
+}
+
+void search() {
+    /*
+    Search the file for the text typed into the prompt, moving the cursor to
+    a match as it is typed. Escape puts the cursor back where it was.
+    */
+    int cursor_x = T.cursor_x;
+    int cursor_y = T.cursor_y;
+    int rowoff = T.rowoff;
+    int coloff = T.coloff;
+
+    //Start building the filter while the query is typed.
+    T.filter_wanted = 1;
+    T.search_x = T.cursor_x;
+    T.search_y = T.cursor_y;
+    char *query = getPromptInput("Search: %s (Use ESC/Arrows/Enter)",
+        searchCallback, 0);
+    if (query != NULL) {
+        free(query);
+    } else {
+        T.cursor_x = cursor_x;
+        T.cursor_y = cursor_y;
+        T.rowoff = rowoff;
+        T.coloff = coloff;
+    }
+}
+
+long grepLines(const char *text, size_t len, const char *pattern, size_t plen,
+        int encrypted, char **scratch, int *scratch_cap) {
+    /*
+    Print the lines of text that contain pattern. text holds whole lines
+    without the newline after the last one. When encrypted is set, text and
+    pattern are both still shifted and only the lines printed are
+    decrypted. Return how many lines were printed.
+    */
+    const char *end = text + len;
+    const char *p = text;
+    long found = 0;
+
+    while (p <= end) {
+        const char *match = findKernel(p, end - p, pattern, plen);
+        if (match == NULL) break;
+        //Print the whole line around the match.
+        const char *start = memrchr(p, '\n', match - p);
+        start = start ? start + 1 : p;
+        const char *line_end = memchr(match, '\n', end - match);
+        if (line_end == NULL) line_end = end;
+        size_t linelen = line_end - start;
+        while (linelen > 0 && start[linelen - 1] == '\r') linelen--;
+        if (encrypted) {
+            if ((int)linelen > *scratch_cap) {
+                *scratch_cap = growCapacity(*scratch_cap, linelen);
+                *scratch = realloc(*scratch, *scratch_cap);
+            }
+            memcpy(*scratch, start, linelen);
+            decryptBuffer(*scratch, linelen);
+            start = *scratch;
+        }
+        fwrite(start, 1, linelen, stdout);
+        putchar('\n');
+        found++;
+        p = line_end + 1;
+    }
+    return found;
+}
+
+int grepFile(const char *pattern, const char *filename) {
+    /*
+    Print the decrypted lines of a file that contain pattern, for --grep.
+    Return 0 if some line matched, 1 if none did and 2 on an error, like
+    grep does.
+
+    A file in the shift format is searched as it is on disk, for the
+    shifted pattern, and only the lines that match are decrypted. A chunked
+    file has to be decrypted to be searched, which is done a chunk at a
+    time. Either way only a block of the file is held at once, so memory use
+    doesn't grow with the file.
+    */
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror(filename);
+        return 2;
+    }
+
+    unsigned char header[FILE_HEADER_SIZE];
+    const cipherEngine *engine = NULL;
+    cipherCtx ctx;
+    ssize_t nread = preadAll(fd, (char *)header, FILE_HEADER_SIZE, 0);
+    if (nread > 0) engine = headerEngine(header, nread);
+    if (engine != NULL && initEngine(&ctx, engine, header) == -1) {
+        perror("TEXT_EDIT_KEY");
+        close(fd);
+        return 2;
+    }
+
+    size_t plen = strlen(pattern);
+    char *shifted = malloc(plen + 1);
+    memcpy(shifted, pattern, plen);
+    if (engine == NULL) encryptBuffer(shifted, plen);
+    size_t stride = engine ? engine->chunk_size + CHUNK_TAG_SIZE :
+        OPEN_BLOCK_SIZE;
+    off_t off = engine ? FILE_HEADER_SIZE : 0;
+    uint64_t chunk = 0;
+    size_t cap = 2 * stride;
+    char *buf = malloc(cap);
+    size_t len = 0;
+    char *scratch = NULL;
+    int scratch_cap = 0;
+    long found = 0;
+    int err = 0;
+
+    //Even an empty chunked file has a last chunk.
+    if (engine != NULL && st.st_size <= FILE_HEADER_SIZE) err = EBADMSG;
+    //No line holds a newline.
+    if (memchr(pattern, '\n', plen) != NULL) off = st.st_size;
+
+    while (err == 0 && off < st.st_size) {
+        if (len + stride > cap) {
+            cap = len + stride;
+            buf = realloc(buf, cap);
+        }
+        nread = preadAll(fd, &buf[len], stride, off);
+        if (nread <= 0) {
+            err = nread == 0 ? EIO : errno;
+            break;
+        }
+        off += nread;
+        size_t text = nread;
+        if (engine != NULL) {
+            //Every chunk but the last is full.
+            int final = off >= st.st_size;
+            if (text < CHUNK_TAG_SIZE || (text < stride && !final)) {
+                err = EBADMSG;
+                break;
+            }
+            text -= CHUNK_TAG_SIZE;
+            if (engine->transform(&ctx, &buf[len], text, chunk++, final, 1,
+                    (unsigned char *)&buf[len + text]) == -1) {
+                err = errno;
+                break;
+            }
+        }
+
+        //Search the lines that are whole so far and keep the rest for the
+        //next block.
+        char *last = memrchr(&buf[len], '\n', text);
+        len += text;
+        if (last != NULL) {
+            found += grepLines(buf, last - buf, shifted, plen, engine == NULL,
+                &scratch, &scratch_cap);
+            len -= last + 1 - buf;
+            memmove(buf, last + 1, len);
+        }
+    }
+    if (err == 0 && len > 0)
+        found += grepLines(buf, len, shifted, plen, engine == NULL, &scratch,
+            &scratch_cap);
+
+    if (engine != NULL) engine->finalize(&ctx);
+    free(scratch);
+    free(buf);
+    free(shifted);
+    close(fd);
+    if (err != 0) {
+        fflush(stdout);
+        fprintf(stderr, "%s: %s\n", filename, strerror(err));
+        return 2;
+    }
+    return found > 0 ? 0 : 1;
+}
+
+/*** replace ***/
+
+//What replaceAll() looks for and what it puts in its place.
+struct replaceJob {
+    //Literal query, and the same query shifted for rows that still live in
+    //a mapped file. For a regex, query is the pattern each worker compiles.
+    const char *query;
+    char *shifted;
+    int qlen;
+    int regex;
+    const char *with;
+    int wlen;
+};
+
+//Row a worker built new chars for.
+struct rowEdit {
+    int at;
+    int size;
+    int cap;
+    char *chars;
+};
+
+//Rows one worker replaces matches in, and the rows it changed.
+struct replacePart {
+    const struct replaceJob *job;
+    int start;
+    int end;
+    struct rowEdit *edits;
+    int len;
+    int cap;
+    long matches;
+    //Text of the row being built.
+    char *out;
+    int out_len;
+    int out_cap;
+    //Slab the new rows are carved from, handed on to the worker of the same
+    //part in the next batch.
+    struct arena arena;
+};
+
+void appendOut(struct replacePart *part, const char *s, int len) {
+    /*
+    Append len bytes to the row a worker is building.
+    */
+    if (len == 0) return;
+    if (part->out_len + len > part->out_cap) {
+        part->out_cap = growCapacity(part->out_cap, part->out_len + len);
+        part->out = realloc(part->out, part->out_cap);
+    }
+    memcpy(&part->out[part->out_len], s, len);
+    part->out_len += len;
+}
+
+int replaceLiteral(struct replacePart *part, const char *text, int size) {
+    /*
+    Build text with every match of the query replaced in the out buffer of
+    a part, and return how many there were.
+    */
+    const struct replaceJob *job = part->job;
+    const char *match;
+    int from = 0;
+    int n = 0;
+
+    while (from <= size - job->qlen && (match = findKernel(text + from,
+            size - from, job->query, job->qlen)) != NULL) {
+        appendOut(part, text + from, match - text - from);
+        appendOut(part, job->with, job->wlen);
+        from = match - text + job->qlen;
+        n++;
+    }
+    if (n > 0) appendOut(part, text + from, size - from);
+    return n;
+}
+
+int replaceRegex(struct replacePart *part, regex_t *re, const char *text,
+        int size) {
+    /*
+    Build text with every match of a regex replaced in the out buffer of a
+    part, and return how many there were. \0 to \9 in the replacement
+    insert what the regex or one of its groups matched.
+    */
+    const struct replaceJob *job = part->job;
+    regmatch_t match[10];
+    int from = 0;
+    int last_end = -1;
+    int n = 0;
+    int i;
+
+    while (from <= size) {
+        //REG_STARTEND searches text between the offsets in match[0], so the
+        //row doesn't have to end in a '\0'.
+        match[0].rm_so = from;
+        match[0].rm_eo = size;
+        if (regexec(re, text, 10, match,
+                REG_STARTEND | (from > 0 ? REG_NOTBOL : 0)) != 0)
+            break;
+        //Like sed, an empty match right after another match is left alone,
+        //and one character is stepped over after an empty match so it isn't
+        //found again.
+        int empty = match[0].rm_so == match[0].rm_eo;
+        if (empty && match[0].rm_so == last_end) {
+            if (from < size) appendOut(part, text + from, 1);
+            from++;
+            continue;
+        }
+        appendOut(part, text + from, match[0].rm_so - from);
+        for (i = 0; i < job->wlen; i++) {
+            char c = job->with[i];
+            if (c == '\\' && i + 1 < job->wlen &&
+                    isdigit((unsigned char)job->with[i + 1])) {
+                regmatch_t *group = &match[job->with[++i] - '0'];
+                if (group->rm_so != -1)
+                    appendOut(part, text + group->rm_so,
+                        group->rm_eo - group->rm_so);
+            } else {
+                if (c == '\\' && i + 1 < job->wlen) c = job->with[++i];
+                appendOut(part, &c, 1);
+            }
+        }
+        n++;
+        from = match[0].rm_eo;
+        last_end = from;
+        if (empty) {
+            if (from < size) appendOut(part, text + from, 1);
+            from++;
+        }
+    }
+    if (n > 0 && from < size) appendOut(part, text + from, size - from);
+    return n;
+}
+
+void *replaceWorker(void *arg) {
+    /*
+    Build new chars for every row of a part that has a match, each in a
+    single row buffer. The rows themselves are left alone for the main
+    thread to swap the new chars in.
+    */
+    struct replacePart *part = arg;
+    const struct replaceJob *job = part->job;
+    struct arena own = rowArena;
+    char *scratch = NULL;
+    int scratch_cap = 0;
+    regex_t re;
+    int at;
+
+    part->len = 0;
+    part->matches = 0;
+    //regexec() locks the regex it is given, so every worker has its own.
+    if (job->regex && regcomp(&re, job->query, REG_EXTENDED) != 0)
+        return NULL;
+    rowArena = part->arena;
+
+    for (at = part->start; at < part->end; at++) {
+        erow *row = peekRow(at);
+        const char *text = row->chars;
+        if (text == NULL) {
+            //A row still in the mapped file is only decrypted if it has the
+            //shifted query in it.
+            if (!job->regex && findKernel(row->mapped, row->size, job->shifted,
+                    job->qlen) == NULL)
+                continue;
+            text = rowText(row, &scratch, &scratch_cap);
+        }
+        part->out_len = 0;
+        int n = job->regex ? replaceRegex(part, &re, text, row->size) :
+            replaceLiteral(part, text, row->size);
+        if (n == 0) continue;
+        part->matches += n;
+
+        if (part->len == part->cap) {
+            part->cap = part->cap ? part->cap * 2 : 64;
+            part->edits = realloc(part->edits,
+                sizeof(struct rowEdit) * part->cap);
+        }
+        struct rowEdit *edit = &part->edits[part->len++];
+        edit->at = at;
+        edit->size = part->out_len;
+        edit->chars = rowAlloc(part->out_len + 1, &edit->cap);
+        memcpy(edit->chars, part->out, part->out_len);
+        edit->chars[part->out_len] = '\0';
+    }
+    part->arena = rowArena;
+    rowArena = own;
+    if (job->regex) regfree(&re);
+    free(scratch);
+    return NULL;
+}
+
+void swapRowChars(erow *row, char *chars, int cap, int size) {
+    /*
+    Give a row chars that were built for it elsewhere, freeing its old ones.
+    */
+    char *undo = recordOp(OP_REPLACE_ROW, rowIndex(row), 0, row->size, size);
+    if (undo != NULL) {
+        copyRowText(undo, row);
+        memcpy(undo + row->size, chars, size);
+    }
+    if (row->chars != NULL) {
+        if (rowShared(row)) {
+            retireChars(row->chars, row->cap);
+        } else if (!row->inlined) {
+            rowFree(row->chars, row->cap);
+        }
+    }
+    row->size = size;
+    row->mapped = NULL;
+    row->inlined = size < ROW_INLINE;
+    if (row->inlined) {
+        memcpy(row->short_chars, chars, size + 1);
+        rowFree(chars, cap);
+        row->chars = row->short_chars;
+        row->cap = ROW_INLINE;
+    } else {
+        row->chars = chars;
+        row->cap = cap;
+    }
+    row->version = T.snapshot;
+    invalidateTabIndex(row);
+    row->modified = 1;
+    updateRender(row);
+    filterEditRow(row, 0, row->size);
+    wrapEditRow(row);
+}
+
+long replaceAll(const char *query, const char *with, int regex) {
+    /*
+    Replace every match of query in the file with with. The rows are split
+    into parts that the workers build new rows for, a batch of one part per
+    worker at a time, and the new rows are swapped in after each batch.
+    Return how many matches were replaced, or -1 if query is a regex that
+    doesn't compile.
+    */
+    struct replaceJob job;
+    job.query = query;
+    job.qlen = strlen(query);
+    job.regex = regex;
+    job.with = with;
+    job.wlen = strlen(with);
+    job.shifted = malloc(job.qlen + 1);
+    memcpy(job.shifted, query, job.qlen);
+    encryptBuffer(job.shifted, job.qlen);
+
+    if (regex) {
+        regex_t re;
+        int err = regcomp(&re, query, REG_EXTENDED);
+        if (err != 0) {
+            char msg[80];
+            regerror(err, &re, msg, sizeof(msg));
+            updateStatusBar("Bad regex: %s", msg);
+            free(job.shifted);
+            return -1;
+        }
+        regfree(&re);
+    }
+
+    struct replacePart parts[MAX_WORKERS];
+    long matches = 0;
+    int first = -1;
+    int at = 0;
+    int i, j;
+
+    for (i = 0; i < T.workers; i++)
+        parts[i] = (struct replacePart){&job, 0, 0, NULL, 0, 0, 0, NULL, 0, 0,
+            {NULL, NULL, 0}};
+    while (at < T.numrows) {
+        //Hand out the next part to each worker.
+        int n = 0;
+        for (; n < T.workers && at < T.numrows; n++) {
+            parts[n].start = at;
+            at += T.numrows - at < REPLACE_PART_ROWS ? T.numrows - at :
+                REPLACE_PART_ROWS;
+            parts[n].end = at;
+        }
+        runWorkers(replaceWorker, parts, sizeof(struct replacePart), n);
+
+        for (i = 0; i < n; i++) {
+            for (j = 0; j < parts[i].len; j++) {
+                struct rowEdit *edit = &parts[i].edits[j];
+                swapRowChars(peekRow(edit->at), edit->chars, edit->cap,
+                    edit->size);
+                if (first == -1) first = edit->at;
+            }
+            matches += parts[i].matches;
+        }
+    }
+    for (i = 0; i < T.workers; i++) {
+        free(parts[i].edits);
+        free(parts[i].out);
+    }
+    free(job.shifted);
+
+    if (first != -1) {
+        markRowsDirtyFrom(first);
+        T.updated++;
+    }
+    //Keep the cursor inside its row, which may have gotten shorter.
+    if (T.cursor_y < T.numrows && T.cursor_x > getRow(T.cursor_y)->size)
+        T.cursor_x = getRow(T.cursor_y)->size;
+    return matches;
+}
+
+void replace() {
+    /*
+    Ask for a query and what to replace it with, and replace every match in
+    the file. A query written as /regex/ is a POSIX extended regex.
+    */
+    char *query = getPromptInput("Replace (/regex/ for a regex): %s", NULL,
+        0);
+    if (query == NULL) return;
+    char *with = getPromptInput("Replace with: %s", NULL, 1);
+    if (with == NULL) {
+        free(query);
+        return;
+    }
+
+    int len = strlen(query);
+    int regex = len >= 2 && query[0] == '/' && query[len - 1] == '/';
+    if (regex) query[len - 1] = '\0';
+    double start = monotonicTime();
+    long matches = replaceAll(regex ? query + 1 : query, with, regex);
+    if (matches >= 0)
+        updateStatusBar("Replaced %ld matches in %.2fs", matches,
+            monotonicTime() - start);
+    free(query);
+    free(with);
+}
+
+/*** batch ***/
+
+//What a batch run does to each file it is given.
+enum batchMode {
+    BATCH_ENCRYPT,
+    BATCH_DECRYPT,
+    BATCH_CAT,
+    BATCH_SCRIPT
+};
+
+//--encrypt, --decrypt, --cat or --apply-script run over a list of files.
+struct batchRun {
+    int mode;
+    //Replacements of the script, applied to every line in order.
+    struct replaceJob *rules;
+    int nrules;
+    char **files;
+    int nfiles;
+    //Index of the next file for a worker to take.
+    atomic_int next;
+    //Bytes read from the files so far, and how many files failed.
+    atomic_size_t bytes;
+    atomic_int failed;
+};
+
+//A worker of a batch run, with the buffers it reuses for every file.
+struct batchWorker {
+    struct batchRun *run;
+    //Bytes as they were read: a block, or a chunk and its tag, and one more
+    //byte that tells whether it is the last.
+    char *raw;
+    //Buffer the output is encrypted into.
+    char *out;
+    //Line the script is applied to, which the out buffer of part takes
+    //turns with.
+    char *line;
+    int line_len;
+    int line_cap;
+    struct replacePart part;
+    //Compiled regexes of the rules, since regexec() locks the one it is
+    //given.
+    regex_t *re;
+};
+
+size_t batchBlockSize() {
+    /*
+    Return the most bytes a batch worker reads at a time.
+    */
+    size_t chunk = CHUNK_SIZE + CHUNK_TAG_SIZE;
+    return chunk > OPEN_BLOCK_SIZE ? chunk : OPEN_BLOCK_SIZE;
+}
+
+int batchWrite(struct saveStream *s, const char *src, size_t len,
+        int sealed) {
+    /*
+    Add text to the output, encrypting it unless sealed is 0, in which case
+    it is written as it is.
+    */
+    if (sealed) return streamWrite(s, src, len, 1);
+    while (len > 0) {
+        size_t n = s->cap - s->used < len ? s->cap - s->used : len;
+        memcpy(&s->buf[s->used], src, n);
+        s->used += n;
+        src += n;
+        len -= n;
+        if (s->used == s->cap && flushStream(s) == -1) return -1;
+    }
+    return 0;
+}
+
+void applyRules(struct batchWorker *w) {
+    /*
+    Replace the matches of every rule in the line in turn.
+    */
+    struct replacePart *part = &w->part;
+    int i;
+    for (i = 0; i < w->run->nrules; i++) {
+        part->job = &w->run->rules[i];
+        part->out_len = 0;
+        //Lines end in a '\0' like rows do, for regexec().
+        if (w->line_len == w->line_cap) {
+            w->line_cap = growCapacity(w->line_cap, w->line_len + 1);
+            w->line = realloc(w->line, w->line_cap);
+        }
+        w->line[w->line_len] = '\0';
+        int n = part->job->regex ?
+            replaceRegex(part, &w->re[i], w->line, w->line_len) :
+            replaceLiteral(part, w->line, w->line_len);
+        if (n == 0) continue;
+        //The new line becomes the one the next rule works on.
+        char *line = w->line;
+        int cap = w->line_cap;
+        w->line = part->out;
+        w->line_cap = part->out_cap;
+        w->line_len = part->out_len;
+        part->out = line;
+        part->out_cap = cap;
+    }
+}
+
+int batchLines(struct batchWorker *w, struct saveStream *s, const char *text,
+        size_t len, int final) {
+    /*
+    Run the script over the whole lines of a block of text and write them
+    out. A line that runs on past the block is kept for the next one, and
+    the last line of the file is written without a newline if it had none.
+    */
+    while (len > 0) {
+        const char *newline = memchr(text, '\n', len);
+        size_t n = newline ? (size_t)(newline - text) : len;
+        if (w->line_len + n > (size_t)w->line_cap) {
+            w->line_cap = growCapacity(w->line_cap, w->line_len + n);
+            w->line = realloc(w->line, w->line_cap);
+        }
+        memcpy(&w->line[w->line_len], text, n);
+        w->line_len += n;
+        if (newline == NULL) break;
+
+        applyRules(w);
+        if (batchWrite(s, w->line, w->line_len, 1) == -1 ||
+                batchWrite(s, "\n", 1, 1) == -1)
+            return -1;
+        w->line_len = 0;
+        text += n + 1;
+        len -= n + 1;
+    }
+    if (final && w->line_len > 0) {
+        applyRules(w);
+        if (batchWrite(s, w->line, w->line_len, 1) == -1) return -1;
+        w->line_len = 0;
+    }
+    return 0;
+}
+
+size_t dropRawReturns(char *text, size_t len, int final) {
+    /*
+    Drop the '\r's that end the lines of a block of a file in the shift
+    format, and those at its end if it ends the file, and return the new
+    length. They were added outside the cipher, by a tool that changed the
+    line endings, and would decrypt to '\n's. The editor drops them too.
+    */
+    char *cr = memchr(text, '\r', len);
+    if (cr == NULL) return len;
+    size_t n = cr - text;
+    size_t i;
+    for (i = n; i < len; i++) {
+        if (text[i] == '\n')
+            while (n > 0 && text[n - 1] == '\r') n--;
+        text[n++] = text[i];
+    }
+    if (final)
+        while (n > 0 && text[n - 1] == '\r') n--;
+    return n;
+}
+
+int batchStream(struct batchWorker *w, int in, int out, size_t *nread) {
+    /*
+    Read a file from in and write it to out the way the run says. Both are
+    read and written a block at a time with read() and write(), so pipes
+    work and memory use doesn't grow with the file. Return -1 with errno
+    set on an error.
+    */
+    int mode = w->run->mode;
+    //Input in a chunked format has a header, and --encrypt reads plain
+    //text.
+    int encrypted = mode != BATCH_ENCRYPT;
+    int sealed = mode == BATCH_ENCRYPT || mode == BATCH_SCRIPT;
+    const cipherEngine *engine = NULL;
+    cipherCtx in_ctx;
+    cipherCtx out_ctx;
+    size_t have = 0;
+    int err = 0;
+
+    if (encrypted) {
+        ssize_t n = readAll(in, w->raw, FILE_HEADER_SIZE);
+        if (n == -1) return -1;
+        *nread += n;
+        have = n;
+        engine = headerEngine((unsigned char *)w->raw, have);
+        if (engine != NULL) {
+            if (initEngine(&in_ctx, engine, (unsigned char *)w->raw) == -1)
+                return -1;
+            have = 0;
+        }
+    }
+    if (!sealed) {
+        //Only the chunk size of the engine is looked at.
+        out_ctx.engine = &shiftEngine;
+    } else if (initEngine(&out_ctx, saveEngine(), NULL) == -1) {
+        err = errno;
+    }
+
+    struct saveStream s;
+    startStream(&s, out, &out_ctx, w->out);
+    if (err == 0 && sealed && out_ctx.engine->chunk_size) {
+        if (writeAll(out, (char *)out_ctx.header, FILE_HEADER_SIZE) == -1)
+            err = errno;
+        s.written = FILE_HEADER_SIZE;
+    }
+
+    size_t stride = engine ? engine->chunk_size + CHUNK_TAG_SIZE :
+        OPEN_BLOCK_SIZE;
+    uint64_t chunk = 0;
+    int final = 0;
+    w->line_len = 0;
+    while (err == 0 && !final) {
+        //Read one byte past the block, which tells whether it is the last.
+        ssize_t n = readAll(in, &w->raw[have], stride + 1 - have);
+        if (n == -1) {
+            err = errno;
+            break;
+        }
+        *nread += n;
+        have += n;
+        final = have <= stride;
+        size_t take = final ? have : stride;
+        if (engine == NULL && encrypted && !final) {
+            //Keep '\r's at the end of the block for the next one, which
+            //tells whether they end a line.
+            size_t end = take;
+            while (end > 0 && w->raw[end - 1] == '\r') end--;
+            if (end > 0) take = end;
+        }
+        size_t text = take;
+        if (engine != NULL) {
+            //Even an empty chunked file has a last chunk.
+            if (text < CHUNK_TAG_SIZE) {
+                err = EBADMSG;
+                break;
+            }
+            text -= CHUNK_TAG_SIZE;
+            if (engine->transform(&in_ctx, w->raw, text, chunk++, final, 1,
+                    (unsigned char *)&w->raw[text]) == -1) {
+                err = errno;
+                break;
+            }
+        } else if (encrypted) {
+            text = dropRawReturns(w->raw, text, final);
+            decryptBuffer(w->raw, text);
+        }
+
+        int result = mode == BATCH_SCRIPT ?
+            batchLines(w, &s, w->raw, text, final) :
+            batchWrite(&s, w->raw, text, sealed);
+        if (result == -1) {
+            err = errno;
+            break;
+        }
+        memmove(w->raw, &w->raw[take], have - take);
+        have -= take;
+    }
+    if (err == 0 && (sealed ? finishStream(&s) : flushStream(&s)) == -1)
+        err = errno;
+
+    if (engine != NULL) engine->finalize(&in_ctx);
+    if (sealed) out_ctx.engine->finalize(&out_ctx);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+int batchFile(struct batchWorker *w, const char *filename, size_t *nread) {
+    /*
+    Print a file for --cat, or replace it with what the run makes of it.
+    The new file is written next to it and renamed over it once it is on
+    disk, like a save, so a failure leaves the file as it was.
+    */
+    int in = open(filename, O_RDONLY);
+    if (in == -1) return -1;
+    if (w->run->mode == BATCH_CAT) {
+        int result = batchStream(w, in, STDOUT_FILENO, nread);
+        int saved_errno = errno;
+        close(in);
+        errno = saved_errno;
+        return result;
+    }
+
+    char *tmpname;
+    int out = openTempFile(filename, &tmpname);
+    if (out == -1) {
+        close(in);
+        return -1;
+    }
+    int result = -1;
+    if (batchStream(w, in, out, nread) == 0 && fsync(out) == 0) {
+        if (close(out) == 0 && rename(tmpname, filename) == 0) {
+            syncParentDir(filename);
+            result = 0;
+        }
+    } else {
+        close(out);
+    }
+    int saved_errno = errno;
+    close(in);
+    if (result == -1) unlink(tmpname);
+    free(tmpname);
+    errno = saved_errno;
+    return result;
+}
+
+void startBatchWorker(struct batchWorker *w, struct batchRun *run) {
+    /*
+    Give a worker of a run its buffers and its own copy of the compiled
+    rules.
+    */
+    int i;
+    memset(w, 0, sizeof(*w));
+    w->run = run;
+    w->raw = malloc(batchBlockSize() + 1);
+    w->out = malloc(SAVE_BUFFER_SIZE);
+    w->re = calloc(run->nrules ? run->nrules : 1, sizeof(regex_t));
+    //The rules were checked to compile when the script was read.
+    for (i = 0; i < run->nrules; i++)
+        if (run->rules[i].regex)
+            regcomp(&w->re[i], run->rules[i].query, REG_EXTENDED);
+}
+
+void endBatchWorker(struct batchWorker *w) {
+    /*
+    Free what startBatchWorker() and the files gave a worker.
+    */
+    int i;
+    for (i = 0; i < w->run->nrules; i++)
+        if (w->run->rules[i].regex) regfree(&w->re[i]);
+    free(w->re);
+    free(w->raw);
+    free(w->out);
+    free(w->line);
+    free(w->part.out);
+}
+
+void *batchThread(void *arg) {
+    /*
+    Take the files of a run one at a time until none are left.
+    */
+    struct batchWorker *w = arg;
+    struct batchRun *run = w->run;
+    int i;
+
+    while ((i = atomic_fetch_add(&run->next, 1)) < run->nfiles) {
+        size_t nread = 0;
+        if (batchFile(w, run->files[i], &nread) == -1) {
+            fprintf(stderr, "%s: %s\n", run->files[i], strerror(errno));
+            atomic_fetch_add(&run->failed, 1);
+        }
+        atomic_fetch_add(&run->bytes, nread);
+    }
+    return NULL;
+}
+
+int readScript(const char *filename, struct batchRun *run) {
+    /*
+    Read the replacements of a script for --apply-script, one a line, each
+    a query and what to replace it with split by a tab. Like at the Ctrl-R
+    prompt, a query written as /regex/ is a POSIX extended regex and \0 to
+    \9 in the replacement insert its groups. Empty lines and lines starting
+    with # are skipped.
+    */
+    FILE *fp = fopen(filename, "r");
+    if (fp == NULL) {
+        perror(filename);
+        return -1;
+    }
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    int lineno = 0;
+    int rules_cap = 0;
+
+    while ((len = getline(&line, &cap, fp)) != -1) {
+        lineno++;
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        if (len == 0 || line[0] == '#') continue;
+        char *tab = strchr(line, '\t');
+        if (tab == NULL || tab == line) {
+            fprintf(stderr, "%s:%d: expected QUERY<TAB>REPLACEMENT\n",
+                filename, lineno);
+            break;
+        }
+        *tab = '\0';
+
+        struct replaceJob job;
+        int qlen = tab - line;
+        job.regex = qlen >= 2 && line[0] == '/' && line[qlen - 1] == '/';
+        if (job.regex) line[--qlen] = '\0';
+        const char *query = job.regex ? line + 1 : line;
+        if (job.regex) {
+            regex_t re;
+            int err = regcomp(&re, query, REG_EXTENDED);
+            if (err != 0) {
+                char msg[80];
+                regerror(err, &re, msg, sizeof(msg));
+                fprintf(stderr, "%s:%d: bad regex: %s\n", filename, lineno,
+                    msg);
+                break;
+            }
+            regfree(&re);
+        }
+        job.query = strdup(query);
+        job.qlen = strlen(job.query);
+        job.shifted = NULL;
+        job.with = strdup(tab + 1);
+        job.wlen = strlen(job.with);
+        if (run->nrules == rules_cap) {
+            rules_cap = rules_cap ? rules_cap * 2 : 16;
+            run->rules = realloc(run->rules,
+                sizeof(struct replaceJob) * rules_cap);
+        }
+        run->rules[run->nrules++] = job;
+    }
+    free(line);
+    fclose(fp);
+    return len == -1 ? 0 : -1;
+}
+
+void freeRules(struct batchRun *run) {
+    /*
+    Free the rules read from the script of a run.
+    */
+    int i;
+    for (i = 0; i < run->nrules; i++) {
+        free((char *)run->rules[i].query);
+        free((char *)run->rules[i].with);
+    }
+    free(run->rules);
+}
+
+void addBatchFile(struct batchRun *run, int *cap, const char *path) {
+    /*
+    Add a file to the list of a run, whose array has room for cap of them.
+    */
+    if (run->nfiles == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        run->files = realloc(run->files, sizeof(char *) * *cap);
+    }
+    run->files[run->nfiles++] = strdup(path);
+}
+
+int listBatchFiles(struct batchRun *run, char **paths, int npaths) {
+    /*
+    List the files of a run. A directory stands for the regular files
+    directly inside it, leaving out hidden ones.
+    */
+    int cap = 0;
+    int i;
+    for (i = 0; i < npaths; i++) {
+        struct stat st;
+        if (stat(paths[i], &st) == -1) {
+            perror(paths[i]);
+            return -1;
+        }
+        if (!S_ISDIR(st.st_mode)) {
+            addBatchFile(run, &cap, paths[i]);
+            continue;
+        }
+        DIR *dir = opendir(paths[i]);
+        if (dir == NULL) {
+            perror(paths[i]);
+            return -1;
+        }
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] == '.') continue;
+            size_t size = strlen(paths[i]) + strlen(entry->d_name) + 2;
+            char *path = malloc(size);
+            snprintf(path, size, "%s/%s", paths[i], entry->d_name);
+            if (stat(path, &st) == 0 && S_ISREG(st.st_mode))
+                addBatchFile(run, &cap, path);
+            free(path);
+        }
+        closedir(dir);
+    }
+    return 0;
+}
+
+int batchMain(int mode, int argc, char *argv[]) {
+    /*
+    Run --encrypt, --decrypt, --cat or --apply-script without the terminal.
+    With no files, stdin is turned into stdout. Otherwise the files are
+    shared out to the workers and rewritten in place, or printed in order
+    for --cat, and the throughput of the run is reported on stderr. Return
+    0 if every file was done, 1 if some failed and 2 on bad arguments.
+    */
+    struct batchRun run;
+    memset(&run, 0, sizeof(run));
+    run.mode = mode;
+    int first = 2;
+    int i;
+
+    if (mode == BATCH_SCRIPT) {
+        if (argc < 3) {
+            fprintf(stderr, "Usage: %s --apply-script SCRIPT [FILE|DIR...]\n",
+                argv[0]);
+            return 2;
+        }
+        if (readScript(argv[2], &run) == -1) {
+            freeRules(&run);
+            return 2;
+        }
+        first = 3;
+    }
+    if (listBatchFiles(&run, &argv[first], argc - first) == -1) {
+        freeRules(&run);
+        return 2;
+    }
+
+    struct batchWorker workers[MAX_WORKERS];
+    double start = monotonicTime();
+    int n = 1;
+    if (argc == first) {
+        startBatchWorker(&workers[0], &run);
+        size_t nread = 0;
+        if (batchStream(&workers[0], STDIN_FILENO, STDOUT_FILENO,
+                &nread) == -1) {
+            perror("stdin");
+            run.failed = 1;
+        }
+    } else {
+        //Files are printed one after another in the order they were given.
+        if (mode != BATCH_CAT) n = workerCount();
+        if (n > run.nfiles) n = run.nfiles;
+        if (n < 1) n = 1;
+        for (i = 0; i < n; i++) startBatchWorker(&workers[i], &run);
+        runWorkers(batchThread, workers, sizeof(struct batchWorker), n);
+    }
+    for (i = 0; i < n; i++) endBatchWorker(&workers[i]);
+
+    if (argc > first && mode != BATCH_CAT) {
+        static const char *done[] = {"Encrypted", "Decrypted", "", "Rewrote"};
+        double secs = monotonicTime() - start;
+        double mb = atomic_load(&run.bytes) / (1024.0 * 1024.0);
+        fprintf(stderr, "%s %d files, %.1f MB in %.2fs (%.1f MB/s) on %d "
+            "threads", done[mode], run.nfiles - run.failed, mb, secs,
+            secs > 0 ? mb / secs : 0, n);
+        if (run.failed) fprintf(stderr, ", %d failed", run.failed);
+        fputc('\n', stderr);
+    }
+
+    for (i = 0; i < run.nfiles; i++) free(run.files[i]);
+    free(run.files);
+    freeRules(&run);
+    return run.failed ? 1 : 0;
+}
+
+/*** benchmark ***/
+
+//The editor running under a pseudo-terminal for --bench.
+struct benchTerm {
+    pid_t pid;
+    int fd;
+    //Output read since the last benchExpect().
+    char *out;
+    size_t len;
+    size_t cap;
+    //Size of the last frame that was drawn.
+    size_t frame_bytes;
+};
+
+//Keys sent in a scenario: how long each took to be drawn and how big the
+//frame it drew was.
+struct keyTimes {
+    double *latency;
+    double *bytes;
+    int n;
+};
+
+int benchSpawn(struct benchTerm *t, const char *filename) {
+    /*
+    Start this binary on a file in a new pseudo-terminal of BENCH_ROWS by
+    BENCH_COLS, as a user would in a terminal of that size.
+    */
+    struct winsize ws = {BENCH_ROWS, BENCH_COLS, 0, 0};
+    memset(t, 0, sizeof(*t));
+    t->pid = forkpty(&t->fd, NULL, NULL, &ws);
+    if (t->pid == -1) return -1;
+    if (t->pid == 0) {
+        execl("/proc/self/exe", "text_edit", filename, (char *)NULL);
+        _exit(127);
+    }
+    return 0;
+}
+
+int benchExpect(struct benchTerm *t, int frames, const char *text,
+        double timeout) {
+    /*
+    Read the output of the editor until it drew frames more frames and,
+    unless text is NULL, text showed up in them. Every frame ends by showing
+    the cursor again, which is how frames are told apart. Return -1 if the
+    editor exited or timeout seconds went by first.
+    */
+    static const char frame_end[] = "\x1b[?25h";
+    size_t end_len = sizeof(frame_end) - 1;
+    double deadline = monotonicTime() + timeout;
+    size_t scanned = 0;
+    size_t last_end = 0;
+    int seen = 0;
+    int found = text == NULL;
+
+    t->len = 0;
+    while (seen < frames || !found) {
+        int wait_ms = (deadline - monotonicTime()) * 1000;
+        struct pollfd pfd = {t->fd, POLLIN, 0};
+        if (wait_ms <= 0 || poll(&pfd, 1, wait_ms) <= 0) return -1;
+        if (t->len + 65536 > t->cap) {
+            t->cap = t->cap ? t->cap * 2 : 1024 * 1024;
+            t->out = realloc(t->out, t->cap);
+        }
+        ssize_t n = read(t->fd, &t->out[t->len], 65536);
+        if (n <= 0) return -1;
+        t->len += n;
+
+        //Look again at the end of what was read before, in case a marker
+        //was split between two reads.
+        scanned = scanned > end_len ? scanned - end_len : 0;
+        char *p;
+        while ((p = memmem(&t->out[scanned], t->len - scanned, frame_end,
+                end_len)) != NULL) {
+            size_t end = p - t->out + end_len;
+            t->frame_bytes = end - last_end;
+            last_end = end;
+            scanned = end;
+            seen++;
+        }
+        scanned = t->len;
+        if (!found) found = memmem(t->out, t->len, text, strlen(text)) != NULL;
+    }
+    return 0;
+}
+
+int benchKeys(struct benchTerm *t, struct keyTimes *run, const char *key,
+        int n) {
+    /*
+    Send a key n times, one at a time, and time each one from when it is
+    sent to when its frame has been drawn.
+    */
+    int i;
+    run->latency = malloc(sizeof(double) * n);
+    run->bytes = malloc(sizeof(double) * n);
+    run->n = 0;
+    for (i = 0; i < n; i++) {
+        double start = monotonicTime();
+        if (writeAll(t->fd, key, strlen(key)) == -1 ||
+                benchExpect(t, 1, NULL, 10) == -1)
+            return -1;
+        run->latency[i] = (monotonicTime() - start) * 1e6;
+        run->bytes[i] = t->frame_bytes;
+        run->n++;
+    }
+    return 0;
+}
+
+int compareDoubles(const void *a, const void *b) {
+    /*
+    Order two doubles for qsort().
+    */
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+void printStats(FILE *fp, const char *name, double *v, int n) {
+    /*
+    Print the percentiles of some measurements as a JSON object member.
+    */
+    double sum = 0;
+    int i;
+    qsort(v, n, sizeof(double), compareDoubles);
+    for (i = 0; i < n; i++) sum += v[i];
+    fprintf(fp, "\"%s\": {\"p50\": %.1f, \"p99\": %.1f, \"max\": %.1f, "
+        "\"mean\": %.1f}", name, n ? v[n / 2] : 0, n ? v[n * 99 / 100] : 0,
+        n ? v[n - 1] : 0, n ? sum / n : 0);
+}
+
+void printRun(FILE *fp, const char *name, struct keyTimes *run) {
+    /*
+    Print the latencies and frame sizes of a run of keys as a JSON object
+    member, and free them.
+    */
+    fprintf(fp, "      \"%s\": {\"keys\": %d, ", name, run->n);
+    printStats(fp, "latency_us", run->latency, run->n);
+    fprintf(fp, ", ");
+    printStats(fp, "frame_bytes", run->bytes, run->n);
+    fprintf(fp, "}");
+    free(run->latency);
+    free(run->bytes);
+}
+
+int batchOne(int mode, const char *filename) {
+    /*
+    Encrypt or decrypt a single file in place, as the batch flags do.
+    */
+    struct batchRun run;
+    struct batchWorker w;
+    memset(&run, 0, sizeof(run));
+    run.mode = mode;
+    startBatchWorker(&w, &run);
+    size_t nread = 0;
+    int result = batchFile(&w, filename, &nread);
+    endBatchWorker(&w);
+    return result;
+}
+
+int catOne(const char *filename, const char *to) {
+    /*
+    Print a file the way --cat does, into another file instead of the
+    standard output.
+    */
+    int in = open(filename, O_RDONLY);
+    if (in == -1) return -1;
+    int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out == -1) {
+        close(in);
+        return -1;
+    }
+    struct batchRun run;
+    struct batchWorker w;
+    memset(&run, 0, sizeof(run));
+    run.mode = BATCH_CAT;
+    startBatchWorker(&w, &run);
+    size_t nread = 0;
+    int result = batchStream(&w, in, out, &nread);
+    endBatchWorker(&w);
+    close(in);
+    if (close(out) == -1) result = -1;
+    return result;
+}
+
+int makeCorpus(const char *filename, off_t size, int tab_every) {
+    /*
+    Write size bytes of made-up text to a file and encrypt it the way a
+    save would. Lines run from empty to a few hundred characters, with a
+    tab for one word in tab_every unless it is 0, and are the same on every
+    run.
+    */
+    static const char *words[] = {
+        "lorem", "ipsum", "dolor", "sit", "amet", "alpha", "beta", "gamma",
+        "delta", "cipher", "editor", "row", "render", "x", "token"
+    };
+    FILE *fp = fopen(filename, "w");
+    if (fp == NULL) return -1;
+    uint64_t state = 88172645463325252ull;
+    off_t written = 0;
+    int line = 0;
+
+    while (written < size) {
+        //xorshift64, so corpora don't depend on the libc.
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        const char *word = tab_every && (state >> 32) % tab_every == 0 ?
+            "\t" : words[state % 15];
+        int len = strlen(word);
+        if (written + len + 1 >= size || line + len > (int)(state >> 56) * 2) {
+            fputc('\n', fp);
+            written++;
+            line = 0;
+            continue;
+        }
+        fwrite(word, 1, len, fp);
+        fputc(' ', fp);
+        written += len + 1;
+        line += len + 1;
+    }
+    if (fclose(fp) != 0) return -1;
+    return batchOne(BATCH_ENCRYPT, filename);
+}
+
+int benchCorpus(FILE *fp, const char *filename, off_t size, int first) {
+    /*
+    Run every scenario on a corpus of the given size in one session of the
+    editor and print its results as a JSON object, after a comma unless it
+    is the first one.
+    */
+    struct benchTerm t;
+    struct keyTimes scroll, typing, saves;
+    double start = monotonicTime();
+    int i;
+
+    if (benchSpawn(&t, filename) == -1) return -1;
+    //Opening a file draws the first frame, with the help message.
+    if (benchExpect(&t, 1, "Ctrl-S = save", 3600) == -1) goto fail;
+    double open_ms = (monotonicTime() - start) * 1000;
+    //Scroll down line by line, then type on the line that was reached.
+    if (benchKeys(&t, &scroll, "\x1b[B", BENCH_KEYS) == -1) goto fail;
+    if (benchKeys(&t, &typing, "a", BENCH_KEYS) == -1) goto fail;
+
+    //Paste a block of lines in one go.
+    char *paste = malloc(BENCH_PASTE_BYTES + 16);
+    int len = sprintf(paste, "\x1b[200~");
+    for (i = 0; len < BENCH_PASTE_BYTES; i++)
+        len += sprintf(&paste[len], "pasted line %d\r", i);
+    len += sprintf(&paste[len], "\x1b[201~");
+    start = monotonicTime();
+    int pasted = writeAll(t.fd, paste, len) == 0 &&
+        benchExpect(&t, 1, NULL, 600) == 0;
+    double paste_ms = (monotonicTime() - start) * 1000;
+    size_t paste_frame = t.frame_bytes;
+    free(paste);
+    if (!pasted) goto fail;
+
+    //Save after every key, waiting for each save to be done.
+    saves.latency = malloc(sizeof(double) * BENCH_SAVES);
+    saves.bytes = malloc(sizeof(double) * BENCH_SAVES);
+    saves.n = 0;
+    for (i = 0; i < BENCH_SAVES; i++) {
+        start = monotonicTime();
+        if (writeAll(t.fd, "s\x13", 2) == -1 ||
+                benchExpect(&t, 1, "written to disk", 3600) == -1)
+            break;
+        saves.latency[saves.n] = (monotonicTime() - start) * 1000;
+        saves.bytes[saves.n++] = t.frame_bytes;
+    }
+
+    //Quit, asking twice in case the last save failed.
+    writeAll(t.fd, "\x11\x11", 2);
+    int status;
+    struct rusage usage;
+    wait4(t.pid, &status, 0, &usage);
+
+    if (!first) fprintf(fp, ",\n");
+    fprintf(fp, "    {\"bytes\": %lld, \"open_ms\": %.1f, "
+        "\"peak_rss_kb\": %ld,\n", (long long)size, open_ms, usage.ru_maxrss);
+    printRun(fp, "scroll", &scroll);
+    fprintf(fp, ",\n");
+    printRun(fp, "typing", &typing);
+    fprintf(fp, ",\n      \"paste\": {\"bytes\": %d, \"ms\": %.1f, "
+        "\"frame_bytes\": %zu},\n", BENCH_PASTE_BYTES, paste_ms, paste_frame);
+    fprintf(fp, "      \"save\": {\"saves\": %d, ", saves.n);
+    printStats(fp, "ms", saves.latency, saves.n);
+    fprintf(fp, "}}");
+    free(saves.latency);
+    free(saves.bytes);
+    close(t.fd);
+    free(t.out);
+    return saves.n == BENCH_SAVES ? 0 : -1;
+
+fail:
+    kill(t.pid, SIGKILL);
+    waitpid(t.pid, NULL, 0);
+    close(t.fd);
+    free(t.out);
+    return -1;
+}
+
+double benchShift(void (*kernel)(char *, size_t, int), char *buf,
+        size_t len) {
+    /*
+    Return the best time in seconds a shift kernel takes over the buffer.
+    Passes shift one way and then back, so the text stays the same.
+    */
+    double best = 0;
+    int i;
+    for (i = 0; i < BENCH_CIPHER_RUNS; i++) {
+        double start = monotonicTime();
+        kernel(buf, len, i % 2 ? -CIPHER_KEY : CIPHER_KEY);
+        double elapsed = monotonicTime() - start;
+        if (i == 0 || elapsed < best) best = elapsed;
+    }
+    if (BENCH_CIPHER_RUNS % 2) kernel(buf, len, -CIPHER_KEY);
+    return best;
+}
+
+double benchChacha(char *buf, size_t len, int decrypt) {
+    /*
+    Return the best time in seconds ChaCha20-Poly1305 takes to encrypt the
+    buffer chunk by chunk, or to check and decrypt it again. A fixed key is
+    used, so TEXT_EDIT_KEY doesn't have to be set.
+    */
+    cipherCtx ctx;
+    size_t nchunks = (len + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    unsigned char *tags = malloc(nchunks * CHUNK_TAG_SIZE);
+    double best = 0;
+    int i;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.engine = &chachaEngine;
+    memset(ctx.key, 0x5a, sizeof(ctx.key));
+    memcpy(ctx.header, FILE_MAGIC, 4);
+    ctx.header[4] = chachaEngine.id;
+    //Each decrypting pass needs an encrypted buffer to start from.
+    for (i = 0; i < (decrypt ? 2 * BENCH_CIPHER_RUNS : BENCH_CIPHER_RUNS);
+            i++) {
+        int backwards = decrypt && i % 2;
+        double start = monotonicTime();
+        size_t c;
+        for (c = 0; c < nchunks; c++) {
+            size_t off = c * CHUNK_SIZE;
+            size_t n = len - off < CHUNK_SIZE ? len - off : CHUNK_SIZE;
+            chachaTransform(&ctx, &buf[off], n, c, c == nchunks - 1,
+                backwards, &tags[c * CHUNK_TAG_SIZE]);
+        }
+        double elapsed = monotonicTime() - start;
+        if (decrypt != backwards) continue;
+        if (best == 0 || elapsed < best) best = elapsed;
+    }
+    chachaFinalize(&ctx);
+    free(tags);
+    return best;
+}
+
+void benchCipher(FILE *fp) {
+    /*
+    Print the throughput of every shift kernel the CPU can run and of
+    ChaCha20-Poly1305, in GB/s, as a JSON array member.
+    */
+    size_t len = BENCH_CIPHER_BYTES;
+    char *buf = malloc(len);
+    size_t i;
+    //Text-like bytes with a newline every 80 characters.
+    for (i = 0; i < len; i++) buf[i] = i % 80 == 79 ? '\n' : 'a' + i % 26;
+
+    fprintf(fp, "  \"kernels\": [\n");
+    fprintf(fp, "    {\"name\": \"scalar\", \"gb_per_s\": %.2f}",
+        len / benchShift(shiftScalar, buf, len) / 1e9);
+#ifdef CIPHER_X86
+    if (__builtin_cpu_supports("sse2"))
+        fprintf(fp, ",\n    {\"name\": \"sse2\", \"gb_per_s\": %.2f}",
+            len / benchShift(shiftSSE2, buf, len) / 1e9);
+    if (__builtin_cpu_supports("avx2"))
+        fprintf(fp, ",\n    {\"name\": \"avx2\", \"gb_per_s\": %.2f}",
+            len / benchShift(shiftAVX2, buf, len) / 1e9);
+#endif
+    double encrypt = benchChacha(buf, len, 0);
+    double decrypt = benchChacha(buf, len, 1);
+    fprintf(fp, ",\n    {\"name\": \"%s\", \"gb_per_s\": %.2f, "
+        "\"decrypt_gb_per_s\": %.2f}\n  ],\n", chachaEngine.name,
+        len / encrypt / 1e9, len / decrypt / 1e9);
+    free(buf);
+}
+
+int copyFile(const char *from, const char *to) {
+    /*
+    Make to a copy of from, for restoring a corpus between runs.
+    */
+    int in = open(from, O_RDONLY);
+    if (in == -1) return -1;
+    int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    char *buf = malloc(OPEN_BLOCK_SIZE);
+    ssize_t n = 0;
+    while (out != -1 && (n = readAll(in, buf, OPEN_BLOCK_SIZE)) > 0)
+        if (writeAll(out, buf, n) == -1) break;
+    int result = out != -1 && n == 0 ? 0 : -1;
+    free(buf);
+    close(in);
+    if (out != -1 && close(out) == -1) result = -1;
+    return result;
+}
+
+int hashFile(const char *filename, uint64_t *hash) {
+    /*
+    Hash the contents of a file with 64-bit FNV-1a, to tell versions of it
+    apart without keeping them around.
+    */
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) return -1;
+    unsigned char *buf = malloc(OPEN_BLOCK_SIZE);
+    ssize_t n;
+    *hash = 14695981039346656037ull;
+    while ((n = readAll(fd, (char *)buf, OPEN_BLOCK_SIZE)) > 0) {
+        ssize_t i;
+        for (i = 0; i < n; i++) *hash = (*hash ^ buf[i]) * 1099511628211ull;
+    }
+    free(buf);
+    close(fd);
+    return n == 0 ? 0 : -1;
+}
+
+int hashText(const char *filename, const char *dir, uint64_t *hash) {
+    /*
+    Hash the decrypted text of a file. Two saves of the same text only
+    give the same bytes with the shift cipher, since chunked files get a
+    new nonce every time. Fails if the file doesn't decrypt.
+    */
+    char copy[PATH_MAX + 32];
+    snprintf(copy, sizeof(copy), "%s/text", dir);
+    int result = copyFile(filename, copy) == 0 &&
+        batchOne(BATCH_DECRYPT, copy) == 0 && hashFile(copy, hash) == 0;
+    unlink(copy);
+    return result ? 0 : -1;
+}
+
+int removeTempFiles(const char *dir) {
+    /*
+    Delete the temporary files that killed saves left in a directory and
+    return how many there were.
+    */
+    DIR *d = opendir(dir);
+    if (d == NULL) return 0;
+    struct dirent *entry;
+    int n = 0;
+    while ((entry = readdir(d)) != NULL) {
+        if (strstr(entry->d_name, ".save") == NULL) continue;
+        char path[PATH_MAX + 256];
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        if (unlink(path) == 0) n++;
+    }
+    closedir(d);
+    return n;
+}
+
+int benchCrash(FILE *fp, const char *dir, const char *original,
+        const char *edit, const char *how, int first) {
+    /*
+    Make an edit to a copy of a corpus and save it, once to see how long
+    the save takes and what it writes, then again and again with the
+    editor killed at points spread over that time. Every time the file
+    must decrypt to either what it held before or the whole new text. how is
+    the message the finished save shows, which tells the in-place path
+    from the one through a temporary file. The results are printed as a
+    JSON object member.
+    */
+    char filename[PATH_MAX + 32];
+    snprintf(filename, sizeof(filename), "%s/crash", dir);
+    struct benchTerm t;
+    uint64_t before, after, hash;
+    double save_us = 0;
+    int kept = 0, replaced = 0, broken = 0, left = 0;
+    int i;
+
+    if (hashText(original, dir, &before) == -1) return -1;
+    for (i = -1; i < BENCH_CRASHES; i++) {
+        if (copyFile(original, filename) == -1 ||
+                benchSpawn(&t, filename) == -1)
+            return -1;
+        if (benchExpect(&t, 1, "Ctrl-S = save", 3600) == -1 ||
+                writeAll(t.fd, edit, strlen(edit)) == -1 ||
+                benchExpect(&t, 1, NULL, 10) == -1)
+            goto fail;
+        double start = monotonicTime();
+        if (writeAll(t.fd, "\x13", 1) == -1) goto fail;
+        if (i == -1) {
+            //The first save runs to the end, and has to take the path the
+            //edit is meant for.
+            if (benchExpect(&t, 1, "written to disk", 3600) == -1 ||
+                    memmem(t.out, t.len, how, strlen(how)) == NULL ||
+                    hashText(filename, dir, &after) == -1)
+                goto fail;
+            save_us = (monotonicTime() - start) * 1e6;
+        } else {
+            //Most of a save is spent waiting for fsync() at the end, so the
+            //kills are packed towards the start, while it is writing.
+            double at = (i + 0.5) / BENCH_CRASHES;
+            usleep(save_us * at * at);
+        }
+        kill(t.pid, SIGKILL);
+        waitpid(t.pid, NULL, 0);
+        close(t.fd);
+        free(t.out);
+        if (i == -1) continue;
+
+        if (hashText(filename, dir, &hash) == -1) broken++;
+        else if (hash == before) kept++;
+        else if (hash == after) replaced++;
+        else broken++;
+        left += removeTempFiles(dir);
+    }
+    unlink(filename);
+
+    if (!first) fprintf(fp, ",\n");
+    fprintf(fp, "    \"%s\": {\"save_ms\": %.1f, \"kills\": %d, \"old\": %d, "
+        "\"new\": %d, \"corrupt\": %d, \"temp_files_left\": %d}",
+        how[0] == 'c' ? "in_place" : "rename", save_us / 1e3,
+        BENCH_CRASHES, kept, replaced, broken, left);
+    return broken == 0 ? 0 : -1;
+
+fail:
+    kill(t.pid, SIGKILL);
+    waitpid(t.pid, NULL, 0);
+    close(t.fd);
+    free(t.out);
+    return -1;
+}
+
+char *readFile(const char *filename, size_t *len) {
+    /*
+    Return the whole contents of a file in a buffer of its own.
+    */
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd == -1) return NULL;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return NULL;
+    }
+    char *buf = malloc(st.st_size + 1);
+    ssize_t n = readAll(fd, buf, st.st_size);
+    close(fd);
+    if (n != st.st_size) {
+        free(buf);
+        return NULL;
+    }
+    *len = n;
+    return buf;
+}
+
+int sameText(const char *filename, const char *text, size_t len) {
+    /*
+    Tell whether a file holds exactly len bytes of text.
+    */
+    size_t file_len;
+    char *data = readFile(filename, &file_len);
+    int same = data != NULL && file_len == len &&
+        memcmp(data, text, len) == 0;
+    free(data);
+    return same;
+}
+
+int writeFile(const char *filename, const char *buf, size_t len) {
+    /*
+    Replace the contents of a file with a buffer.
+    */
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) return -1;
+    int result = writeAll(fd, buf, len);
+    if (close(fd) == -1) result = -1;
+    return result;
+}
+
+char *mixedText(size_t size) {
+    /*
+    Make size bytes of lines holding every byte value but '\n', many of
+    them ended by "\r\n" and some by "\r\r\n". The last byte is always
+    '\n'. The byte the shift cipher turns into '\n' is left out, since the
+    shift format can't hold it.
+    */
+    char *buf = malloc(size);
+    uint64_t state = 2463534242ull;
+    size_t i = 0;
+    while (i < size - 1) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        int c = state % 256;
+        if (c == '\n' - CIPHER_KEY) c = ' ';
+        if (c == '\n' || state % 97 == 0) {
+            int crs = state % 5 < 2 ? 0 : state % 5 < 4 ? 1 : 2;
+            while (crs-- > 0 && i < size - 1) buf[i++] = '\r';
+            c = '\n';
+        }
+        buf[i++] = c;
+    }
+    buf[size - 1] = '\n';
+    return buf;
+}
+
+char *addCarriageReturns(const char *data, size_t len, size_t *out_len,
+        int *crlf) {
+    /*
+    Return a copy of an encrypted file with every other line ended by a
+    CRLF, as if it went through a tool that changed its line endings. The
+    '\r's are outside the cipher and the editor has to drop them.
+    */
+    char *out = malloc(len + len / 2 + 1);
+    size_t n = 0;
+    size_t i;
+    *crlf = 0;
+    for (i = 0; i < len; i++) {
+        if (data[i] == '\n' && (*crlf)++ % 2 == 0) out[n++] = '\r';
+        out[n++] = data[i];
+    }
+    *crlf = (*crlf + 1) / 2;
+    *out_len = n;
+    return out;
+}
+
+size_t stripCarriageReturns(const char *text, size_t len, char *out) {
+    /*
+    Copy text to out without the '\r's that end its lines, the way the
+    editor reads the text of a chunked file, and return the new length.
+    */
+    size_t n = 0;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        if (text[i] == '\n')
+            while (n > 0 && out[n - 1] == '\r') n--;
+        out[n++] = text[i];
+    }
+    return n;
+}
+
+int benchRoundTrip(FILE *fp, const char *dir, off_t size, int first) {
+    /*
+    Encrypt and decrypt a file whose text has mixed line endings with the
+    batch flags, checking with the shift cipher that every byte but
+    newlines moved by the key exactly once, and that decrypting gives back
+    the same bytes. A shift file is then given CRLFs outside the cipher,
+    which --decrypt, --cat and the editor all have to drop. Then open the
+    encrypted file in the editor, type a character and save, and check
+    that the saved file decrypts to the text with the character added. The
+    text of a chunked file loses the '\r's that end its lines there. The
+    results are printed as a JSON object, after a comma unless it is the
+    first.
+    */
+    char filename[PATH_MAX + 32];
+    char copy[PATH_MAX + 32];
+    snprintf(filename, sizeof(filename), "%s/round_trip", dir);
+    snprintf(copy, sizeof(copy), "%s/round_trip_copy", dir);
+    char *plain = mixedText(size);
+    char *data = NULL;
+    size_t len = 0;
+    long shifted_wrong = -1;
+    int crlf = 0;
+    int batch_ok = 0;
+    //Left at -1 when the file has no CRLFs added.
+    int crlf_batch_ok = -1;
+    int editor_ok = 0;
+    double save_ms = 0;
+    size_t i;
+
+    if (writeFile(filename, plain, size) == -1 ||
+            batchOne(BATCH_ENCRYPT, filename) == -1 ||
+            (data = readFile(filename, &len)) == NULL)
+        goto done;
+    batch_ok = copyFile(filename, copy) == 0 &&
+        batchOne(BATCH_DECRYPT, copy) == 0 && sameText(copy, plain, size);
+    unlink(copy);
+    //Only the shift cipher keeps lines where they are, so only its files
+    //can be checked byte by byte and given CRLFs.
+    if (saveEngine() == &shiftEngine && len == (size_t)size) {
+        shifted_wrong = 0;
+        for (i = 0; i < len; i++) {
+            char want = plain[i] == '\n' ? '\n' : plain[i] + CIPHER_KEY;
+            if (data[i] != want) shifted_wrong++;
+        }
+        size_t crlf_len;
+        char *crlf_data = addCarriageReturns(data, len, &crlf_len, &crlf);
+        int written = writeFile(filename, crlf_data, crlf_len);
+        free(crlf_data);
+        if (written == -1) goto done;
+        //The batch flags have to drop the CRLFs the way the editor does.
+        crlf_batch_ok = copyFile(filename, copy) == 0 &&
+            batchOne(BATCH_DECRYPT, copy) == 0 &&
+            sameText(copy, plain, size) && catOne(filename, copy) == 0 &&
+            sameText(copy, plain, size);
+        unlink(copy);
+    }
+
+    struct benchTerm t;
+    if (benchSpawn(&t, filename) == -1) goto done;
+    double start = 0;
+    if (benchExpect(&t, 1, "Ctrl-S = save", 3600) == 0 &&
+            writeAll(t.fd, "x", 1) == 0 && benchExpect(&t, 1, NULL, 10) == 0) {
+        start = monotonicTime();
+        if (writeAll(t.fd, "\x13", 1) == 0 &&
+                benchExpect(&t, 1, "written to disk", 3600) == 0)
+            save_ms = (monotonicTime() - start) * 1000;
+    }
+    writeAll(t.fd, "\x11\x11", 2);
+    waitpid(t.pid, NULL, 0);
+    close(t.fd);
+    free(t.out);
+    free(data);
+    data = NULL;
+    size_t plain_len = size;
+    if (saveEngine()->chunk_size)
+        plain_len = stripCarriageReturns(plain, size, plain);
+    if (save_ms > 0 && batchOne(BATCH_DECRYPT, filename) == 0 &&
+            (data = readFile(filename, &len)) != NULL)
+        editor_ok = len == plain_len + 1 && data[0] == 'x' &&
+            memcmp(&data[1], plain, plain_len) == 0;
+
+done:
+    if (!first) fprintf(fp, ",\n");
+    fprintf(fp, "    {\"bytes\": %lld, \"shifted_wrong\": %ld, "
+        "\"batch_ok\": %s, \"crlf_lines\": %d, \"crlf_batch_ok\": %s, "
+        "\"editor_ok\": %s, \"save_ms\": %.1f}", (long long)size,
+        shifted_wrong, batch_ok ? "true" : "false", crlf,
+        crlf_batch_ok == -1 ? "null" : crlf_batch_ok ? "true" : "false",
+        editor_ok ? "true" : "false", save_ms);
+    unlink(filename);
+    free(data);
+    free(plain);
+    return batch_ok && crlf_batch_ok != 0 && editor_ok &&
+        shifted_wrong <= 0 ? 0 : -1;
+}
+
+void benchInserts(FILE *fp) {
+    /*
+    Insert BENCH_INSERT_LINES lines with insertRow() into an empty buffer,
+    always at the top, always in the middle and always at the end, and
+    print how long each took as a JSON object member. This runs in this
+    process, without the terminal, to time the row storage on its own.
+    */
+    static const char *where[] = {"head", "middle", "tail"};
+    char line[] = "a line of text, inserted a million times";
+    int w, i;
+
+    T.undo_last = -1;
+    rowArena.reuse = 1;
+    resetFilter();
+    fprintf(fp, ",\n  \"inserts\": {\"lines\": %d", BENCH_INSERT_LINES);
+    for (w = 0; w < 3; w++) {
+        double start = monotonicTime();
+        for (i = 0; i < BENCH_INSERT_LINES; i++) {
+            int at = w == 0 ? 0 : w == 1 ? T.numrows / 2 : T.numrows;
+            insertRow(at, line, sizeof(line) - 1);
+        }
+        double elapsed = monotonicTime() - start;
+        fprintf(fp, ",\n    \"%s\": {\"ms\": %.1f, \"ns_per_line\": %.1f}",
+            where[w], elapsed * 1e3, elapsed * 1e9 / BENCH_INSERT_LINES);
+        closeFile();
+    }
+    fprintf(fp, "\n  }");
+}
+
+long statusKB(pid_t pid, const char *field) {
+    /*
+    Return a memory figure of a process from its status in /proc, in KB,
+    field being its name with the colon.
+    */
+    char path[64];
+    char line[256];
+    size_t len = strlen(field);
+    long kb = -1;
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) return -1;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (strncmp(line, field, len) == 0) {
+            kb = strtol(&line[len], NULL, 10);
+            break;
+        }
+    }
+    fclose(fp);
+    return kb;
+}
+
+long anonymousKB(pid_t pid) {
+    /*
+    Return the anonymous memory a process has resident, in KB, which unlike
+    its whole RSS leaves out the pages of a mapped file.
+    */
+    return statusKB(pid, "RssAnon:");
+}
+
+//Samples the anonymous memory of the editor on a thread of its own while
+//the bench waits for a save to be drawn.
+struct memoryWatch {
+    pid_t pid;
+    atomic_int stop;
+    long peak_kb;
+};
+
+void *watchMemory(void *arg) {
+    /*
+    Keep the highest anonymous memory of the editor until told to stop.
+    */
+    struct memoryWatch *watch = arg;
+    while (!atomic_load(&watch->stop)) {
+        long kb = anonymousKB(watch->pid);
+        if (kb > watch->peak_kb) watch->peak_kb = kb;
+        usleep(BENCH_SAMPLE_US);
+    }
+    return NULL;
+}
+
+uint64_t hashRows() {
+    /*
+    Hash the text of every row with 64-bit FNV-1a, a newline after each, to
+    tell states of the buffer apart.
+    */
+    uint64_t hash = 14695981039346656037ull;
+    int y, i;
+    for (y = 0; y < T.numrows; y++) {
+        erow *row = getRow(y);
+        for (i = 0; i <= row->size; i++) {
+            unsigned char c = i < row->size ? row->chars[i] : '\n';
+            hash = (hash ^ c) * 1099511628211ull;
+        }
+    }
+    return hash;
+}
+
+int benchUndo(FILE *fp) {
+    /*
+    Make BENCH_UNDO_EDITS random edits to a buffer of BENCH_UNDO_ROWS rows,
+    each as if it were a key of its own: runs of typing and of backspaces
+    somewhere in the file, and now and then an Enter. Then undo all of them
+    and redo all of them, timing every undo and redo, and check that the
+    buffer comes back the same both ways. How big the undo log grew and
+    the memory the process took for it are printed with the latencies as a
+    JSON object member. This runs in this process, without the terminal.
+    */
+    char line[] = "a line of text to edit at random";
+    uint64_t state = 88172645463325252ull;
+    int i;
+
+    rowArena.reuse = 1;
+    resetFilter();
+    for (i = 0; i < BENCH_UNDO_ROWS; i++)
+        insertRow(i, line, sizeof(line) - 1);
+    T.undo_len = T.undo_end = 0;
+    T.undo_last = -1;
+    uint64_t before = hashRows();
+    long start_kb = anonymousKB(getpid());
+
+    double start = monotonicTime();
+    int run = 0;
+    int key = 0;
+    for (i = 0; i < BENCH_UNDO_EDITS; i++) {
+        //xorshift64, so every run makes the same edits.
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        //A run of keys starts at a random place in the file.
+        if (run == 0) {
+            run = 1 + state % 16;
+            key = (state >> 8) % 8 == 0 ? '\r' :
+                (state >> 8) % 8 < 3 ? BACKSPACE : 'a' + (state >> 16) % 26;
+            T.cursor_y = (state >> 24) % T.numrows;
+            T.cursor_x = (state >> 40) % (getRow(T.cursor_y)->size + 1);
+        }
+        run--;
+        T.undo_group++;
+        if (key == '\r') createNewLine();
+        else if (key == BACKSPACE) processDelete();
+        else insertChar(key);
+    }
+    double edit_ms = (monotonicTime() - start) * 1000;
+    long edit_kb = anonymousKB(getpid()) - start_kb;
+    uint64_t after = hashRows();
+    size_t log_bytes = T.undo_len;
+
+    double *undo_ns = malloc(sizeof(double) * BENCH_UNDO_EDITS);
+    double *redo_ns = malloc(sizeof(double) * BENCH_UNDO_EDITS);
+    int undos = 0, redos = 0;
+    while (T.undo_last != -1) {
+        start = monotonicTime();
+        undo();
+        undo_ns[undos++] = (monotonicTime() - start) * 1e9;
+    }
+    int undone = hashRows() == before;
+    while (T.undo_end < T.undo_len) {
+        start = monotonicTime();
+        redo();
+        redo_ns[redos++] = (monotonicTime() - start) * 1e9;
+    }
+    int redone = hashRows() == after;
+
+    fprintf(fp, ",\n  \"undo\": {\"edits\": %d, \"rows\": %d, "
+        "\"edit_ms\": %.1f, \"log_bytes\": %zu, \"bytes_per_edit\": %.1f, "
+        "\"anon_kb\": %ld, \"undone_ok\": %s, \"redone_ok\": %s,\n",
+        BENCH_UNDO_EDITS, BENCH_UNDO_ROWS, edit_ms, log_bytes,
+        (double)log_bytes / BENCH_UNDO_EDITS, edit_kb,
+        undone ? "true" : "false", redone ? "true" : "false");
+    fprintf(fp, "      \"undo\": {\"keys\": %d, ", undos);
+    printStats(fp, "ns", undo_ns, undos);
+    fprintf(fp, "},\n      \"redo\": {\"keys\": %d, ", redos);
+    printStats(fp, "ns", redo_ns, redos);
+    fprintf(fp, "}\n  }");
+    free(undo_ns);
+    free(redo_ns);
+    closeFile();
+    return undone && redone ? 0 : -1;
+}
+
+int benchSave(FILE *fp, const char *filename, off_t size, int first) {
+    /*
+    Open a corpus, type a character so the whole file has to be written,
+    and time the save. The anonymous memory of the editor is sampled
+    while the save runs, to see how much it needs on top of the rows. The
+    results are printed as a JSON object, after a comma unless it is the
+    first.
+    */
+    struct benchTerm t;
+    struct memoryWatch watch;
+    pthread_t thread;
+    double start = monotonicTime();
+
+    if (benchSpawn(&t, filename) == -1) return -1;
+    if (benchExpect(&t, 1, "Ctrl-S = save", 3600) == -1) goto fail;
+    double open_ms = (monotonicTime() - start) * 1000;
+    if (writeAll(t.fd, "x", 1) == -1 || benchExpect(&t, 1, NULL, 10) == -1)
+        goto fail;
+
+    watch.pid = t.pid;
+    atomic_init(&watch.stop, 0);
+    watch.peak_kb = anonymousKB(t.pid);
+    long before_kb = watch.peak_kb;
+    if (pthread_create(&thread, NULL, watchMemory, &watch) != 0) goto fail;
+    start = monotonicTime();
+    int saved = writeAll(t.fd, "\x13", 1) == 0 &&
+        benchExpect(&t, 1, "written to disk", 3600) == 0;
+    double elapsed = monotonicTime() - start;
+    atomic_store(&watch.stop, 1);
+    pthread_join(thread, NULL);
+    if (!saved) goto fail;
+
+    writeAll(t.fd, "\x11\x11", 2);
+    int status;
+    struct rusage usage;
+    wait4(t.pid, &status, 0, &usage);
+    close(t.fd);
+    free(t.out);
+
+    if (!first) fprintf(fp, ",\n");
+    fprintf(fp, "    {\"bytes\": %lld, \"open_ms\": %.1f, \"save_ms\": %.1f, "
+        "\"mb_per_s\": %.1f, \"anon_kb\": %ld, \"save_peak_anon_kb\": %ld, "
+        "\"peak_rss_kb\": %ld}", (long long)size, open_ms, elapsed * 1e3,
+        size / elapsed / 1e6, before_kb, watch.peak_kb, usage.ru_maxrss);
+    return 0;
+
+fail:
+    kill(t.pid, SIGKILL);
+    waitpid(t.pid, NULL, 0);
+    close(t.fd);
+    free(t.out);
+    return -1;
+}
+
+int benchLoad(FILE *fp, const char *filename, off_t size) {
+    /*
+    Time how long the editor takes to show a corpus with 1, 2, 4, 8 and 16
+    threads set through TEXT_EDIT_THREADS, and print the times and the
+    speedup over one thread as a JSON object member.
+    */
+    static const int counts[BENCH_THREAD_COUNTS] = {1, 2, 4, 8, 16};
+    const char *env = getenv("TEXT_EDIT_THREADS");
+    char *saved = env ? strdup(env) : NULL;
+    double one = 0;
+    int result = 0;
+    int c, i;
+
+    fprintf(fp, ",\n  \"loads\": {\"bytes\": %lld, \"cpus\": %ld, "
+        "\"threads\": [", (long long)size, sysconf(_SC_NPROCESSORS_ONLN));
+    for (c = 0; c < BENCH_THREAD_COUNTS && result == 0; c++) {
+        char count[16];
+        double best = 0;
+        snprintf(count, sizeof(count), "%d", counts[c]);
+        setenv("TEXT_EDIT_THREADS", count, 1);
+        for (i = 0; i < BENCH_LOAD_RUNS; i++) {
+            struct benchTerm t;
+            double start = monotonicTime();
+            if (benchSpawn(&t, filename) == -1) {
+                result = -1;
+                break;
+            }
+            if (benchExpect(&t, 1, "Ctrl-S = save", 3600) == -1) {
+                kill(t.pid, SIGKILL);
+                result = -1;
+            }
+            double elapsed = (monotonicTime() - start) * 1000;
+            writeAll(t.fd, "\x11", 1);
+            waitpid(t.pid, NULL, 0);
+            close(t.fd);
+            free(t.out);
+            if (result == -1) break;
+            if (i == 0 || elapsed < best) best = elapsed;
+        }
+        if (result == -1) break;
+        if (c == 0) one = best;
+        fprintf(fp, "%s\n    {\"threads\": %d, \"open_ms\": %.1f, "
+            "\"speedup\": %.2f}", c ? "," : "", counts[c], best, one / best);
+    }
+    fprintf(fp, "\n  ]}");
+    if (saved != NULL) setenv("TEXT_EDIT_THREADS", saved, 1);
+    else unsetenv("TEXT_EDIT_THREADS");
+    free(saved);
+    return result;
+}
+
+int makeLongLine(const char *filename, int size, int tab_every) {
+    /*
+    Write a file of one line of size bytes of words, with a tab after
+    every tab_every words unless it is 0, followed by an empty line, and
+    encrypt it the way a save would. Moving left from the empty line puts
+    the cursor at the end of the long one.
+    */
+    static const char *words[] = {"lorem", "ipsum", "dolor", "sit", "amet"};
+    char *line = malloc(size + 2);
+    int len = 0;
+    int i;
+    for (i = 0; len < size; i++) {
+        const char *word = words[i % 5];
+        int n = strlen(word);
+        if (len + n + 1 > size) n = size - len - 1;
+        memcpy(&line[len], word, n);
+        len += n;
+        line[len++] = tab_every && i % tab_every == 0 ? '\t' : ' ';
+    }
+    line[len++] = '\n';
+    line[len++] = '\n';
+    int result = writeFile(filename, line, len);
+    free(line);
+    if (result == -1) return -1;
+    return batchOne(BATCH_ENCRYPT, filename);
+}
+
+int benchLongLine(FILE *fp, const char *dir) {
+    /*
+    Type BENCH_LINE_KEYS characters at the start of a line of
+    BENCH_LINE_BYTES and as many at its end, where every key edits and
+    draws a row that long, and print the latencies as a JSON object member.
+    */
+    char filename[PATH_MAX + 32];
+    struct benchTerm t;
+    struct keyTimes start, end;
+    snprintf(filename, sizeof(filename), "%s/long_line", dir);
+    if (makeLongLine(filename, BENCH_LINE_BYTES, 0) == -1 ||
+            benchSpawn(&t, filename) == -1) {
+        unlink(filename);
+        return -1;
+    }
+    int result = -1;
+    if (benchExpect(&t, 1, "Ctrl-S = save", 3600) == 0 &&
+            benchKeys(&t, &start, "a", BENCH_LINE_KEYS) == 0) {
+        //Go down to the empty line and back to the end of the long one.
+        if (writeAll(t.fd, "\x1b[B\x1b[D", 6) == 0 &&
+                benchExpect(&t, 1, NULL, 10) == 0 &&
+                benchKeys(&t, &end, "a", BENCH_LINE_KEYS) == 0) {
+            fprintf(fp, ",\n  \"long_line\": {\"bytes\": %d,\n",
+                BENCH_LINE_BYTES);
+            printRun(fp, "typing_at_start", &start);
+            fprintf(fp, ",\n");
+            printRun(fp, "typing_at_end", &end);
+            fprintf(fp, "\n  }");
+            result = 0;
+        }
+    }
+    kill(t.pid, SIGKILL);
+    waitpid(t.pid, NULL, 0);
+    close(t.fd);
+    free(t.out);
+    unlink(filename);
+    return result;
+}
+
+int benchTabLine(FILE *fp, const char *dir) {
+    /*
+    Move the cursor along a line of BENCH_LINE_BYTES with a tab after every
+    word: right from its start, left from its end, and back and forth
+    between its end and the next line, which maps the cursor to a screen
+    column a million characters in on every key. The latencies are
+    printed as a JSON object member.
+    */
+    char filename[PATH_MAX + 32];
+    struct benchTerm t;
+    struct keyTimes right, left, jump;
+    snprintf(filename, sizeof(filename), "%s/tab_line", dir);
+    if (makeLongLine(filename, BENCH_LINE_BYTES, 1) == -1 ||
+            benchSpawn(&t, filename) == -1) {
+        unlink(filename);
+        return -1;
+    }
+    int result = -1;
+    if (benchExpect(&t, 1, "Ctrl-S = save", 3600) == 0 &&
+            benchKeys(&t, &right, "\x1b[C", BENCH_LINE_KEYS) == 0 &&
+            writeAll(t.fd, "\x1b[B\x1b[D", 6) == 0 &&
+            benchExpect(&t, 1, NULL, 10) == 0 &&
+            benchKeys(&t, &left, "\x1b[D", BENCH_LINE_KEYS) == 0 &&
+            benchKeys(&t, &jump, "\x1b[B\x1b[D", BENCH_LINE_KEYS) == 0) {
+        fprintf(fp, ",\n  \"tab_line\": {\"bytes\": %d,\n", BENCH_LINE_BYTES);
+        printRun(fp, "right_from_start", &right);
+        fprintf(fp, ",\n");
+        printRun(fp, "left_from_end", &left);
+        fprintf(fp, ",\n");
+        printRun(fp, "jump_to_end", &jump);
+        fprintf(fp, "\n  }");
+        result = 0;
+    }
+    kill(t.pid, SIGKILL);
+    waitpid(t.pid, NULL, 0);
+    close(t.fd);
+    free(t.out);
+    unlink(filename);
+    return result;
+}
+
+int benchPaste(FILE *fp, const char *dir, int size, int first) {
+    /*
+    Paste size bytes of lines into an empty file through the terminal,
+    with the bracketed paste markers a terminal sends, and time it from
+    the first byte written to the frame that shows it. Then save and check
+    that the file holds exactly the pasted lines. The results are printed
+    as a JSON object, after a comma unless it is the first.
+    */
+    char filename[PATH_MAX + 32];
+    snprintf(filename, sizeof(filename), "%s/paste", dir);
+    char *paste = malloc(size + 64);
+    char *expected = malloc(size + 64);
+    int len = sprintf(paste, "\x1b[200~");
+    int expected_len = 0;
+    int lines;
+    //Terminals send Enter as '\r', which the saved file has as '\n'.
+    for (lines = 0; len - 6 < size; lines++) {
+        int n = sprintf(&paste[len], "pasted line %d of the block\r", lines);
+        memcpy(&expected[expected_len], &paste[len], n - 1);
+        expected[expected_len + n - 1] = '\n';
+        len += n;
+        expected_len += n;
+    }
+    len += sprintf(&paste[len], "\x1b[201~");
+    //The empty row after the last pasted line is saved as well.
+    expected[expected_len++] = '\n';
+
+    struct benchTerm t;
+    double paste_ms = 0;
+    int ok = 0;
+    if (writeFile(filename, "", 0) == -1 || benchSpawn(&t, filename) == -1) {
+        free(paste);
+        free(expected);
+        return -1;
+    }
+    if (benchExpect(&t, 1, "Ctrl-S = save", 3600) == 0) {
+        double start = monotonicTime();
+        if (writeAll(t.fd, paste, len) == 0 &&
+                benchExpect(&t, 1, NULL, 3600) == 0) {
+            paste_ms = (monotonicTime() - start) * 1000;
+            size_t saved_len;
+            char *saved;
+            if (writeAll(t.fd, "\x13", 1) == 0 &&
+                    benchExpect(&t, 1, "written to disk", 3600) == 0 &&
+                    batchOne(BATCH_DECRYPT, filename) == 0 &&
+                    (saved = readFile(filename, &saved_len)) != NULL) {
+                ok = saved_len == (size_t)expected_len &&
+                    memcmp(saved, expected, expected_len) == 0;
+                free(saved);
+            }
+        }
+    }
+    kill(t.pid, SIGKILL);
+    waitpid(t.pid, NULL, 0);
+    close(t.fd);
+    free(t.out);
+    unlink(filename);
+    free(paste);
+    free(expected);
+
+    if (!first) fprintf(fp, ",\n");
+    fprintf(fp, "    {\"bytes\": %d, \"lines\": %d, \"ms\": %.1f, "
+        "\"mb_per_s\": %.1f, \"ok\": %s}", len, lines, paste_ms,
+        paste_ms > 0 ? len / paste_ms / 1e3 : 0.0, ok ? "true" : "false");
+    return ok ? 0 : -1;
+}
+
+int wrappedLines(const char *out, size_t len, int *first, int *last) {
+    /*
+    Find the numbers of the lines benchWrap() pasted that a frame drew, in
+    the order they were drawn. Return how many there were, or -1 if they
+    don't follow each other, and set first and last to the first and last
+    of them.
+    */
+    static const char marker[] = "wrapped line ";
+    const char *p = out;
+    const char *end = out + len;
+    int n = 0;
+    while ((p = memmem(p, end - p, marker, sizeof(marker) - 1)) != NULL) {
+        p += sizeof(marker) - 1;
+        int number = 0;
+        while (p < end && isdigit((unsigned char)*p))
+            number = number * 10 + *p++ - '0';
+        if (n > 0 && number != *last + 1) return -1;
+        if (n == 0) *first = number;
+        *last = number;
+        n++;
+    }
+    return n;
+}
+
+int benchPages(struct benchTerm *t, struct keyTimes *run, int down,
+        int target, int max_keys) {
+    /*
+    Page through the lines benchWrap() pasted until the frame draws line
+    target, timing every key. Each frame has to go on right where the one
+    before it left off, without skipping or repeating a whole screen.
+    Return how many frames didn't, or -1 if the editor stopped drawing or
+    target wasn't reached in max_keys pages.
+    */
+    const char *key = down ? "\x1b[6~" : "\x1b[5~";
+    int bad = 0;
+    int first, last;
+    //The frame already on the screen is where the first page starts from.
+    int shown = wrappedLines(t->out, t->len, &first, &last) > 0;
+    run->latency = malloc(sizeof(double) * max_keys);
+    run->bytes = malloc(sizeof(double) * max_keys);
+    run->n = 0;
+    while (run->n < max_keys) {
+        double start = monotonicTime();
+        if (writeAll(t->fd, key, strlen(key)) == -1 ||
+                benchExpect(t, 1, NULL, 10) == -1)
+            return -1;
+        run->latency[run->n] = (monotonicTime() - start) * 1e6;
+        run->bytes[run->n] = t->frame_bytes;
+        run->n++;
+
+        int from, to;
+        int n = wrappedLines(t->out, t->len, &from, &to);
+        if (n <= 0) {
+            bad++;
+            continue;
+        }
+        //Down, the frame has to start past the top of the last one and no
+        //further than right below it. Up, the other way around.
+        if (shown && (down ? from <= first || from > last + 1 :
+                to >= last || to < first - 1))
+            bad++;
+        shown = 1;
+        first = from;
+        last = to;
+        if (first <= target && target <= last) return bad;
+    }
+    return -1;
+}
+
+long countText(const char *text, size_t len, const char *word) {
+    /*
+    Count where a word shows up in text, none of them overlapping.
+    */
+    size_t wlen = strlen(word);
+    const char *end = text + len;
+    const char *p = text;
+    long n = 0;
+    while ((p = memmem(p, end - p, word, wlen)) != NULL) {
+        p += wlen;
+        n++;
+    }
+    return n;
+}
+
+long benchReplaceAll(struct benchTerm *t, const char *query,
+        const char *with, double *ms) {
+    /*
+    Replace every match of query with with at the Ctrl-R prompt, timing it
+    from the Enter that starts it to the frame that reports it. Return how
+    many matches the editor says it replaced, or -1.
+    */
+    char keys[256];
+    snprintf(keys, sizeof(keys), "\x12%s\r%s", query, with);
+    char prompt[256];
+    snprintf(prompt, sizeof(prompt), "Replace with: %s", with);
+    if (writeAll(t->fd, keys, strlen(keys)) == -1 ||
+            benchExpect(t, 1, prompt, 10) == -1)
+        return -1;
+    double start = monotonicTime();
+    if (writeAll(t->fd, "\r", 1) == -1 ||
+            benchExpect(t, 1, "Replaced ", 3600) == -1)
+        return -1;
+    *ms = (monotonicTime() - start) * 1000;
+    char *p = memmem(t->out, t->len, "Replaced ", 9);
+    return strtol(p + 9, NULL, 10);
+}
+
+int benchReplace(FILE *fp, const char *filename, off_t size) {
+    /*
+    Replace a word on every line it is on in a corpus, then every match of
+    a regex that swaps two groups, and check that each replaced as many
+    matches as the decrypted corpus has. The times are printed as a JSON
+    object member.
+    */
+    char copy[PATH_MAX + 32];
+    snprintf(copy, sizeof(copy), "%s.plain", filename);
+    size_t len;
+    char *plain;
+    if (copyFile(filename, copy) == -1 || batchOne(BATCH_DECRYPT, copy) == -1 ||
+            (plain = readFile(copy, &len)) == NULL) {
+        unlink(copy);
+        return -1;
+    }
+    unlink(copy);
+    //Of the words of a corpus, only these have "ip" or "do" in them.
+    long literal_want = countText(plain, len, "lorem");
+    long regex_want = countText(plain, len, "ipsum") +
+        countText(plain, len, "dolor");
+    free(plain);
+
+    struct benchTerm t;
+    if (benchSpawn(&t, filename) == -1) return -1;
+    double literal_ms = 0, regex_ms = 0;
+    long literal = -1, regex = -1;
+    if (benchExpect(&t, 1, "Ctrl-S = save", 3600) == 0 &&
+            (literal = benchReplaceAll(&t, "lorem", "LOREM",
+                &literal_ms)) != -1)
+        regex = benchReplaceAll(&t, "/(ip|do)(sum|lor)/", "\\2\\1",
+            &regex_ms);
+    kill(t.pid, SIGKILL);
+    waitpid(t.pid, NULL, 0);
+    close(t.fd);
+    free(t.out);
+    if (regex == -1) return -1;
+
+    fprintf(fp, ",\n  \"replace\": {\"bytes\": %lld,\n", (long long)size);
+    fprintf(fp, "      \"literal\": {\"matches\": %ld, \"expected\": %ld, "
+        "\"ms\": %.1f},\n", literal, literal_want, literal_ms);
+    fprintf(fp, "      \"regex\": {\"matches\": %ld, \"expected\": %ld, "
+        "\"ms\": %.1f}\n  }", regex, regex_want, regex_ms);
+    return literal == literal_want && regex == regex_want ? 0 : -1;
+}
+
+int benchOpen(const char *filename, double *open_ms, long *anon_kb,
+        long *peak_kb) {
+    /*
+    Open a file in the editor and quit, and tell how long it took to show
+    the file, how much anonymous memory the editor had then and its peak
+    RSS. The peak is read while the editor runs, since the one wait4()
+    gives also counts the pages it had from this process before exec().
+    */
+    struct benchTerm t;
+    double start = monotonicTime();
+    if (benchSpawn(&t, filename) == -1) return -1;
+    int result = benchExpect(&t, 1, "Ctrl-S = save", 3600);
+    *open_ms = (monotonicTime() - start) * 1000;
+    *anon_kb = anonymousKB(t.pid);
+    *peak_kb = statusKB(t.pid, "VmHWM:");
+    if (result == -1) kill(t.pid, SIGKILL);
+    else writeAll(t.fd, "\x11", 1);
+    if (waitpid(t.pid, NULL, 0) == -1) result = -1;
+    close(t.fd);
+    free(t.out);
+    return result;
+}
+
+int benchTabs(FILE *fp, const char *dir, off_t size) {
+    /*
+    Open a corpus without tabs, whose rows are drawn straight from their
+    chars, and one where every other word is a tab, whose rows all need a
+    render of their own, and print the memory each took as a JSON object
+    member.
+    */
+    static const int tab_every[2] = {0, BENCH_TABS_HEAVY};
+    char filename[PATH_MAX + 32];
+    snprintf(filename, sizeof(filename), "%s/tabs", dir);
+    int result = 0;
+    int c;
+
+    fprintf(fp, ",\n  \"tabs\": {\"bytes\": %lld, \"corpora\": [",
+        (long long)size);
+    for (c = 0; c < 2 && result == 0; c++) {
+        double open_ms;
+        long anon_kb, peak_kb;
+        if (makeCorpus(filename, size, tab_every[c]) == -1 ||
+                benchOpen(filename, &open_ms, &anon_kb, &peak_kb) == -1) {
+            result = -1;
+            break;
+        }
+        fprintf(fp, "%s\n    {\"tab_every\": %d, \"open_ms\": %.1f, "
+            "\"anon_kb\": %ld, \"peak_rss_kb\": %ld}", c ? "," : "",
+            tab_every[c], open_ms, anon_kb, peak_kb);
+    }
+    fprintf(fp, "\n  ]}");
+    unlink(filename);
+    return result;
+}
+
+int makeShortLines(const char *filename, int lines) {
+    /*
+    Write a file of lines of up to a dozen letters, empty ones among them,
+    and encrypt it the way a save would. The lines are the same on every
+    run.
+    */
+    FILE *fp = fopen(filename, "w");
+    if (fp == NULL) return -1;
+    uint64_t state = 88172645463325252ull;
+    int i, j;
+    for (i = 0; i < lines; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        int len = state % 13;
+        for (j = 0; j < len; j++) fputc('a' + (state >> (j * 4)) % 26, fp);
+        fputc('\n', fp);
+    }
+    if (fclose(fp) != 0) return -1;
+    return batchOne(BATCH_ENCRYPT, filename);
+}
+
+int benchShortLines(FILE *fp, const char *dir, int lines) {
+    /*
+    Open a file of many short lines, where what each row costs on top of
+    its text shows, and print how long it took and the memory it took as a
+    JSON object member.
+    */
+    char filename[PATH_MAX + 32];
+    snprintf(filename, sizeof(filename), "%s/short_lines", dir);
+    struct stat st;
+    double open_ms;
+    long anon_kb, peak_kb;
+    if (makeShortLines(filename, lines) == -1 || stat(filename, &st) == -1 ||
+            benchOpen(filename, &open_ms, &anon_kb, &peak_kb) == -1) {
+        unlink(filename);
+        return -1;
+    }
+    unlink(filename);
+    fprintf(fp, ",\n  \"short_lines\": {\"lines\": %d, \"bytes\": %lld, "
+        "\"open_ms\": %.1f, \"anon_kb\": %ld, \"peak_rss_kb\": %ld, "
+        "\"anon_bytes_per_line\": %.1f}", lines, (long long)st.st_size,
+        open_ms, anon_kb, peak_kb, anon_kb * 1024.0 / lines);
+    return 0;
+}
+
+int searchPlain(const char *filename, const char *pattern, const char *to) {
+    /*
+    Write the lines of a decrypted file that contain pattern to another
+    file, the whole file read at once, which is what --grep is compared
+    with.
+    */
+    size_t len;
+    char *text = readFile(filename, &len);
+    if (text == NULL) return -1;
+    FILE *out = fopen(to, "w");
+    if (out == NULL) {
+        free(text);
+        return -1;
+    }
+    size_t plen = strlen(pattern);
+    const char *end = text + len;
+    const char *p = text;
+    const char *match;
+    while ((match = memmem(p, end - p, pattern, plen)) != NULL) {
+        const char *start = memrchr(p, '\n', match - p);
+        start = start ? start + 1 : p;
+        const char *line_end = memchr(match, '\n', end - match);
+        if (line_end == NULL) line_end = end;
+        fwrite(start, 1, line_end - start, out);
+        fputc('\n', out);
+        p = line_end < end ? line_end + 1 : end;
+    }
+    free(text);
+    return fclose(out) == 0 ? 0 : -1;
+}
+
+int benchGrep(FILE *fp, const char *filename, off_t size) {
+    /*
+    Time --grep on a corpus for a query on many lines and one on none,
+    against decrypting the whole corpus with --cat and then searching it,
+    and check that both find the same lines. --grep runs in a process of
+    its own, so how much memory it took can be told. The results are
+    printed as a JSON object member.
+    */
+    static const char *queries[] = {"lorem ipsum", "not in the corpus"};
+    char grep_out[PATH_MAX + 32];
+    char plain[PATH_MAX + 32];
+    char plain_out[PATH_MAX + 32];
+    snprintf(grep_out, sizeof(grep_out), "%s.grep", filename);
+    snprintf(plain, sizeof(plain), "%s.plain", filename);
+    snprintf(plain_out, sizeof(plain_out), "%s.found", filename);
+    int result = 0;
+    int q;
+
+    fprintf(fp, ",\n  \"grep\": {\"bytes\": %lld, \"queries\": [",
+        (long long)size);
+    for (q = 0; q < 2 && result == 0; q++) {
+        int out = open(grep_out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out == -1) {
+            result = -1;
+            break;
+        }
+        double start = monotonicTime();
+        pid_t pid = fork();
+        if (pid == 0) {
+            dup2(out, STDOUT_FILENO);
+            execl("/proc/self/exe", "text_edit", "--grep", queries[q],
+                filename, (char *)NULL);
+            _exit(127);
+        }
+        close(out);
+        int status = 0;
+        struct rusage usage;
+        if (pid == -1 || wait4(pid, &status, 0, &usage) == -1 ||
+                !WIFEXITED(status) || WEXITSTATUS(status) > 1) {
+            result = -1;
+            break;
+        }
+        double grep_ms = (monotonicTime() - start) * 1000;
+
+        start = monotonicTime();
+        if (catOne(filename, plain) == -1 ||
+                searchPlain(plain, queries[q], plain_out) == -1) {
+            result = -1;
+            break;
+        }
+        double plain_ms = (monotonicTime() - start) * 1000;
+
+        size_t found_len, want_len;
+        char *found = readFile(grep_out, &found_len);
+        char *want = readFile(plain_out, &want_len);
+        int same = found != NULL && want != NULL && found_len == want_len &&
+            memcmp(found, want, want_len) == 0;
+        long lines = 0;
+        size_t i;
+        for (i = 0; found != NULL && i < found_len; i++)
+            lines += found[i] == '\n';
+        free(found);
+        free(want);
+        fprintf(fp, "%s\n    {\"query\": \"%s\", \"lines\": %ld, "
+            "\"grep_ms\": %.1f, \"grep_peak_rss_kb\": %ld, "
+            "\"decrypt_then_search_ms\": %.1f, \"same_lines\": %s}",
+            q ? "," : "", queries[q], lines, grep_ms, usage.ru_maxrss,
+            plain_ms, same ? "true" : "false");
+        if (!same) result = -1;
+    }
+    fprintf(fp, "\n  ]}");
+    unlink(grep_out);
+    unlink(plain);
+    unlink(plain_out);
+    return result;
+}
+
+double timeSearch(const char *query, int *hits, uint64_t *where) {
+    /*
+    Time stepping through the first BENCH_SEARCH_HITS matches of a query
+    from the top of the file, as Down does at the search prompt, keeping
+    the best of BENCH_SEARCH_RUNS runs in ms. Count the matches and hash
+    where they were, so runs can be told to have found the same ones.
+    */
+    int qlen = strlen(query);
+    double best = 0;
+    int run;
+    for (run = 0; run < BENCH_SEARCH_RUNS; run++) {
+        int y = 0, x = 0;
+        double start = monotonicTime();
+        *hits = 0;
+        *where = 14695981039346656037ull;
+        while (*hits < BENCH_SEARCH_HITS &&
+                findMatch(query, qlen, 1, &y, &x)) {
+            (*hits)++;
+            *where = (*where ^ ((uint64_t)y << 32 | (unsigned)x)) *
+                1099511628211ull;
+            x++;
+        }
+        double elapsed = (monotonicTime() - start) * 1000;
+        if (run == 0 || elapsed < best) best = elapsed;
+    }
+    return best;
+}
+
+int benchSearch(FILE *fp, const char *filename, off_t size) {
+    /*
+    Open a corpus in this process and search it for a few queries before
+    the search filter is built, build it all at once, and search for them
+    again, checking that the same matches are found. The times, how long
+    the build took and how much memory the filter takes are printed as a
+    JSON object member.
+    */
+    static const char *queries[] = {
+        "lorem ipsum dolor", "alpha beta gamma delta", "not in the corpus"
+    };
+    double before[3];
+    int hits[3];
+    uint64_t where[3];
+    int q, b;
+
+    T.workers = workerCount();
+    rowArena.reuse = 1;
+    openFile((char *)filename);
+    for (q = 0; q < 3; q++)
+        before[q] = timeSearch(queries[q], &hits[q], &where[q]);
+
+    T.filter_wanted = 1;
+    double start = monotonicTime();
+    while (filterPending()) buildFilterStep();
+    double build_ms = (monotonicTime() - start) * 1000;
+    size_t filter_bytes = 0;
+    for (b = 0; b < T.nfilter; b++)
+        if (T.filter[b].bits != NULL)
+            filter_bytes += (size_t)1 << T.filter[b].bits_log >> 3;
+
+    fprintf(fp, ",\n  \"search\": {\"bytes\": %lld, \"rows\": %d, "
+        "\"filter_build_ms\": %.1f, \"filter_kb\": %zu, \"queries\": [",
+        (long long)size, T.numrows, build_ms, filter_bytes >> 10);
+    int result = 0;
+    for (q = 0; q < 3; q++) {
+        int after_hits;
+        uint64_t after_where;
+        double after = timeSearch(queries[q], &after_hits, &after_where);
+        int same = after_hits == hits[q] && after_where == where[q];
+        fprintf(fp, "%s\n    {\"query\": \"%s\", \"matches\": %d, "
+            "\"before_ms\": %.2f, \"after_ms\": %.2f, \"same_matches\": %s}",
+            q ? "," : "", queries[q], hits[q], before[q], after,
+            same ? "true" : "false");
+        if (!same) result = -1;
+    }
+    fprintf(fp, "\n  ]}");
+    closeFile();
+    return result;
+}
+
+int benchWrap(FILE *fp, const char *dir) {
+    /*
+    Turn soft wrap on in an empty file, paste BENCH_WRAP_LINES lines of
+    one to a few screen lines each, which splits the blocks of the wrap
+    index many times over, then page down to the last line and back up to
+    the first. Every frame is checked to show the lines right after (or
+    before) the ones of the frame before it. The latencies are printed as
+    a JSON object member.
+    */
+    char filename[PATH_MAX + 32];
+    snprintf(filename, sizeof(filename), "%s/wrap", dir);
+    size_t cap = (size_t)BENCH_WRAP_LINES * (4 * BENCH_COLS + 32) + 16;
+    char *paste = malloc(cap);
+    int len = sprintf(paste, "\x1b[200~");
+    int i, j;
+    for (i = 0; i < BENCH_WRAP_LINES; i++) {
+        len += sprintf(&paste[len], "wrapped line %d:", i);
+        //From a part of a screen line to four of them, without digits.
+        int size = 20 + i * 37 % (4 * BENCH_COLS - 40);
+        for (j = 0; j < size; j++)
+            paste[len++] = j % 7 == 6 ? ' ' : 'a' + (i + j) % 26;
+        paste[len++] = '\r';
+    }
+    len += sprintf(paste + len, "\x1b[201~");
+
+    struct benchTerm t;
+    struct keyTimes down, up;
+    char last[32];
+    snprintf(last, sizeof(last), "wrapped line %d:", BENCH_WRAP_LINES - 1);
+    if (writeFile(filename, "", 0) == -1 || benchSpawn(&t, filename) == -1) {
+        free(paste);
+        return -1;
+    }
+    int result = -1;
+    double paste_ms = 0;
+    int bad_down = -1, bad_up = -1;
+    if (benchExpect(&t, 1, "Ctrl-S = save", 3600) == 0 &&
+            writeAll(t.fd, "\x17", 1) == 0 &&
+            benchExpect(&t, 1, "Wrapping long lines", 10) == 0) {
+        double start = monotonicTime();
+        if (writeAll(t.fd, paste, len) == 0 &&
+                benchExpect(&t, 1, last, 3600) == 0) {
+            paste_ms = (monotonicTime() - start) * 1000;
+            //The paste leaves the cursor at the end, so page up to the
+            //top before timing the way down.
+            bad_up = benchPages(&t, &up, 0, 0, BENCH_WRAP_LINES);
+            if (bad_up != -1) {
+                free(up.latency);
+                free(up.bytes);
+                bad_down = benchPages(&t, &down, 1, BENCH_WRAP_LINES - 1,
+                    BENCH_WRAP_LINES);
+            }
+            if (bad_down != -1)
+                bad_up = benchPages(&t, &up, 0, 0, BENCH_WRAP_LINES);
+        }
+    }
+    if (bad_down != -1 && bad_up != -1) {
+        fprintf(fp, ",\n  \"wrap\": {\"lines\": %d, \"paste_ms\": %.1f, "
+            "\"bad_frames\": %d,\n", BENCH_WRAP_LINES, paste_ms,
+            bad_down + bad_up);
+        printRun(fp, "page_down", &down);
+        fprintf(fp, ",\n");
+        printRun(fp, "page_up", &up);
+        fprintf(fp, "\n  }");
+        result = bad_down + bad_up == 0 ? 0 : -1;
+    }
+    kill(t.pid, SIGKILL);
+    waitpid(t.pid, NULL, 0);
+    close(t.fd);
+    free(t.out);
+    unlink(filename);
+    free(paste);
+    return result;
+}
+
+int benchMain(int argc, char *argv[]) {
+    /*
+    Benchmark the editor for --bench on corpora from 1 KB up to a size
+    given as a number of bytes with an optional K, M or G, 64 MB by
+    default, each four times bigger than the one before. Every corpus is
+    opened in the editor under a pseudo-terminal and driven with scrolling,
+    typing, a paste and saves. The cipher kernels are timed first, on their
+    own. After the corpora come saves killed halfway, round trips of mixed
+    line endings, inserts into the row storage, random edits undone and
+    redone, saves and loads of the bigger sizes, replaces, greps and
+    searches across the biggest, rows with tabs and without, many short
+    lines, long lines, pastes and paging through wrapped lines, each
+    scenario in a section of its own. The results are printed as JSON, for
+    keeping track of regressions. Any failed check makes the exit status 1.
+    */
+    off_t max = BENCH_DEFAULT_MAX;
+    if (argc >= 3) {
+        char *unit;
+        max = strtoll(argv[2], &unit, 10);
+        if (*unit == 'K' || *unit == 'k') max <<= 10;
+        else if (*unit == 'M' || *unit == 'm') max <<= 20;
+        else if (*unit == 'G' || *unit == 'g') max <<= 30;
+        else if (*unit != '\0') max = 0;
+    }
+    if (argc > 3 || max < 1024) {
+        fprintf(stderr, "Usage: %s --bench [MAX_SIZE]\n", argv[0]);
+        return 2;
+    }
+
+    const char *tmp = getenv("TMPDIR");
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s/text_edit_benchXXXXXX", tmp ? tmp : "/tmp");
+    if (mkdtemp(dir) == NULL) {
+        perror(dir);
+        return 1;
+    }
+
+    printf("{\n  \"cipher\": \"%s\", \"shift_kernel\": \"%s\", "
+        "\"threads\": %d, \"rows\": %d, \"cols\": %d,\n",
+        saveEngine()->name, shiftKernelName, workerCount(), BENCH_ROWS,
+        BENCH_COLS);
+    fprintf(stderr, "cipher kernels...\n");
+    benchCipher(stdout);
+    printf("  \"corpora\": [\n");
+    int failed = 0;
+    int i;
+    off_t size;
+    for (size = 1024; size <= max && !failed; size *= 4) {
+        char filename[PATH_MAX + 32];
+        snprintf(filename, sizeof(filename), "%s/corpus_%lld", dir,
+            (long long)size);
+        fprintf(stderr, "%lld bytes...\n", (long long)size);
+        if (makeCorpus(filename, size, BENCH_TAB_EVERY) == -1 ||
+                benchCorpus(stdout, filename, size, size == 1024) == -1) {
+            fprintf(stderr, "%s: benchmark failed\n", filename);
+            failed = 1;
+        }
+        unlink(filename);
+    }
+    printf("\n  ]");
+
+    //Kill the editor in the middle of saves, once of a row that grew,
+    //which goes through a temporary file, and once of a row that kept its
+    //length, which is written in place unless the file is chunked.
+    if (!failed) {
+        char original[PATH_MAX + 32];
+        off_t crash_size = max < BENCH_CRASH_BYTES ? max : BENCH_CRASH_BYTES;
+        snprintf(original, sizeof(original), "%s/original", dir);
+        fprintf(stderr, "killed saves...\n");
+        printf(",\n  \"crash_save\": {\"bytes\": %lld,\n",
+            (long long)crash_size);
+        if (makeCorpus(original, crash_size, BENCH_TAB_EVERY) == -1 ||
+                benchCrash(stdout, dir, original, "x", "bytes written to "
+                    "disk (", 1) == -1 ||
+                (saveEngine()->chunk_size == 0 &&
+                benchCrash(stdout, dir, original, "\x1b[C\x7fx", "changed "
+                    "bytes written", 0) == -1)) {
+            fprintf(stderr, "%s: killed saves failed\n", original);
+            failed = 1;
+        }
+        printf("\n  }");
+        unlink(original);
+    }
+
+    //Every byte of files with mixed line endings has to come back the same
+    //through the batch flags and through the editor, once for a file that
+    //is read and, when big enough, once for one that is mapped.
+    if (!failed) {
+        off_t sizes[2] = {BENCH_TRIP_BYTES, LAZY_OPEN_MIN + BENCH_TRIP_BYTES};
+        fprintf(stderr, "round trips...\n");
+        printf(",\n  \"round_trip\": [\n");
+        for (i = 0; i < 2 && (i == 0 || sizes[i] <= max) && !failed; i++) {
+            off_t trip_size = sizes[i] < max ? sizes[i] : max;
+            if (benchRoundTrip(stdout, dir, trip_size, i == 0) == -1) {
+                fprintf(stderr, "round trip of %lld bytes failed\n",
+                    (long long)trip_size);
+                failed = 1;
+            }
+        }
+        printf("\n  ]");
+    }
+
+    fprintf(stderr, "inserts...\n");
+    benchInserts(stdout);
+    fprintf(stderr, "random edits, undone and redone...\n");
+    if (!failed && benchUndo(stdout) == -1) {
+        fprintf(stderr, "undoing random edits failed\n");
+        failed = 1;
+    }
+
+    //Time whole-file saves from 1 MB up to the biggest size, watching how
+    //much memory each save takes on top of the rows.
+    printf(",\n  \"saves\": [\n");
+    for (size = BENCH_SAVE_MIN; size <= max && !failed; size *= 4) {
+        char filename[PATH_MAX + 32];
+        snprintf(filename, sizeof(filename), "%s/save_%lld", dir,
+            (long long)size);
+        fprintf(stderr, "saving %lld bytes...\n", (long long)size);
+        if (makeCorpus(filename, size, BENCH_TAB_EVERY) == -1 ||
+                benchSave(stdout, filename, size, size == BENCH_SAVE_MIN) ==
+                -1) {
+            fprintf(stderr, "%s: save failed\n", filename);
+            failed = 1;
+        }
+        unlink(filename);
+    }
+    printf("\n  ]");
+
+    //Open the biggest corpus with more and more threads, then replace
+    //across all of it, grep it and search it.
+    if (!failed) {
+        char filename[PATH_MAX + 32];
+        snprintf(filename, sizeof(filename), "%s/load", dir);
+        fprintf(stderr, "loading with 1 to 16 threads...\n");
+        if (makeCorpus(filename, max, BENCH_TAB_EVERY) == -1 ||
+                benchLoad(stdout, filename, max) == -1) {
+            fprintf(stderr, "%s: load failed\n", filename);
+            failed = 1;
+        }
+        fprintf(stderr, "replacing across %lld bytes...\n", (long long)max);
+        if (!failed && benchReplace(stdout, filename, max) == -1) {
+            fprintf(stderr, "%s: replace failed\n", filename);
+            failed = 1;
+        }
+        fprintf(stderr, "grepping %lld bytes...\n", (long long)max);
+        if (!failed && benchGrep(stdout, filename, max) == -1) {
+            fprintf(stderr, "%s: grep failed\n", filename);
+            failed = 1;
+        }
+        fprintf(stderr, "searching %lld bytes...\n", (long long)max);
+        if (!failed && benchSearch(stdout, filename, max) == -1) {
+            fprintf(stderr, "%s: search failed\n", filename);
+            failed = 1;
+        }
+        unlink(filename);
+    }
+
+    //Open corpora without tabs and with a lot of them.
+    if (!failed) {
+        off_t tabs_size = max < BENCH_TABS_BYTES ? max : BENCH_TABS_BYTES;
+        fprintf(stderr, "rows with and without tabs...\n");
+        if (benchTabs(stdout, dir, tabs_size) == -1) {
+            fprintf(stderr, "opening corpora with tabs failed\n");
+            failed = 1;
+        }
+    }
+
+    //Open a file of many short lines, about 7 bytes each.
+    if (!failed) {
+        int lines = max / 8 < BENCH_SHORT_LINES ? max / 8 : BENCH_SHORT_LINES;
+        fprintf(stderr, "opening %d short lines...\n", lines);
+        if (benchShortLines(stdout, dir, lines) == -1) {
+            fprintf(stderr, "opening short lines failed\n");
+            failed = 1;
+        }
+    }
 
-    //Put the contents in the row into 'chars'.
-    T.row[current_row].chars = malloc(len + 1);
-    memcpy(T.row[current_row].chars, s, len);
-    T.row[current_row].chars[len] = '\0';
+    fprintf(stderr, "typing into a long line...\n");
+    if (!failed && benchLongLine(stdout, dir) == -1) {
+        fprintf(stderr, "typing into a long line failed\n");
+        failed = 1;
+    }
+    fprintf(stderr, "moving along a line of tabs...\n");
+    if (!failed && benchTabLine(stdout, dir) == -1) {
+        fprintf(stderr, "moving along a line of tabs failed\n");
+        failed = 1;
+    }
 
-    //Initialize the render.
-    T.row[current_row].size_r = 0;
-    T.row[current_row].render = NULL;
-    updateRender(&T.row[current_row]);
+    //Paste bigger and bigger blocks into an empty file.
+    printf(",\n  \"pastes\": [\n");
+    for (size = BENCH_PASTE_BYTES; size <= BENCH_PASTE_MAX && !failed &&
+            (size <= max || size == BENCH_PASTE_BYTES); size *= 16) {
+        fprintf(stderr, "pasting %lld bytes...\n", (long long)size);
+        if (benchPaste(stdout, dir, size, size == BENCH_PASTE_BYTES) == -1) {
+            fprintf(stderr, "paste of %lld bytes failed\n", (long long)size);
+            failed = 1;
+        }
+    }
+    printf("\n  ]");
 
-    //Increment the number of rows in the current file.
-    T.numrows++;
-    //Increment the number of changes made since saving the file.
-    T.updated++;
+    fprintf(stderr, "paging through wrapped lines...\n");
+    if (!failed && benchWrap(stdout, dir) == -1) {
+        fprintf(stderr, "paging through wrapped lines failed\n");
+        failed = 1;
+    }
+    printf("\n}\n");
+    rmdir(dir);
+    return failed;
 }
 
-void freeRow(erow *row) {
+/*** soft wrap ***/
+
+int renderLength(erow *row) {
     /*
-    Free the memory of the row that is deleted.
+    Return how many columns a row is drawn in. Rows of a mapped file that
+    weren't decrypted yet are counted by their size, which only tabs can
+    make their render longer than.
     */
-    free(row->render);
-    free(row->chars);
+    return row->chars != NULL ? row->size_r : row->size;
 }
 
-void deleteRow(int current_row) {
+int wrapHeight(int len) {
     /*
-    Delete a row.
+    Return how many screen lines a row drawn in len columns wraps to.
     */
-
-    //Validate the index of the column.
-    if (current_row < 0 || current_row >= T.numrows) return;
-    freeRow(&T.row[current_row]);
-    //Overwrite the deleted rwo struct with the rest of the rows
-    memmove(&T.row[current_row], &T.row[current_row + 1], sizeof(erow) * (T.numrows - current_row - 1));
-    T.numrows--;
-    T.updated++;
+    return len <= T.wrap_cols ? 1 : (len - 1) / T.wrap_cols + 1;
 }
 
-void insertCharFromKey(erow *row, int current_row, int c) {
+void fenwickAdd(int *tree, int n, int i, int delta) {
     /*
-    Insert a single character into the position.
+    Add delta to entry i of a Fenwick tree of n entries.
     */
-
-    //Validate the index(col) that character will be inserted into.
-    if (current_row < 0 || current_row > row->size) current_row = row->size;
-    //Allocate spaces for chars of the erow
-    row->chars = realloc(row->chars, row->size + 2);
-
-    //Make room for the new character.
-    memmove(&row->chars[current_row + 1], &row->chars[current_row], row->size - current_row + 1);
-
-    //Increment the size and assign the character to its position in the array.
-    row->size++;
-    row->chars[current_row] = c;
-
-    //Update render and size_r with new row content.
-    updateRender(row);
-    T.updated++;
+    for (i++; i <= n; i += i & -i) tree[i] += delta;
 }
 
-void appendTwoRows(erow *row, char *s, size_t len) {
+int fenwickSum(int *tree, int i) {
     /*
-    Appends a string to the end of the row.
+    Return the sum of the first i entries of a Fenwick tree.
     */
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memcpy(&row->chars[row->size], s, len);
-    row->size += len;
-    row->chars[row->size] = '\0';
-    updateRender(row);
-    T.updated++;
+    int sum = 0;
+    for (; i > 0; i -= i & -i) sum += tree[i];
+    return sum;
 }
 
-void deleteChar(erow *row, int current_row) {
+int fenwickFind(int *tree, int n, int *at) {
     /*
-    Delete a character in the row.
+    Return the entry of a Fenwick tree of n entries that the running sum at
+    falls in, leaving at as the offset into it, or n with at past the sum of
+    all of them.
     */
-    if (current_row < 0 || current_row >= row->size) return;
-    //Overwrite the deleted character with the charctger that come after it.
-    memmove(&row->chars[current_row], &row->chars[current_row + 1], row->size - current_row);
-    //Decrement the size of the row.
-    row->size--;
-
-    updateRender(row);
-    T.updated++;
+    int i = 0;
+    int step = 1 << (31 - __builtin_clz(n));
+    for (; step > 0; step >>= 1) {
+        if (i + step <= n && tree[i + step] <= *at) {
+            i += step;
+            *at -= tree[i];
+        }
+    }
+    return i;
 }
 
-/*** editor operations ***/
-
-void insertChar(int c) {
+void rebuildWrapTrees() {
     /*
-    Take a character and insert into the position that cursor is at.
+    Build both Fenwick trees of the soft-wrap index from its blocks again,
+    after blocks were split or dropped.
     */
+    int n = T.nwrap;
+    int i;
+    T.wrap_row_tree = realloc(T.wrap_row_tree, sizeof(int) * (T.wrap_cap + 1));
+    T.wrap_line_tree = realloc(T.wrap_line_tree,
+        sizeof(int) * (T.wrap_cap + 1));
+    for (i = 1; i <= n; i++) {
+        T.wrap_row_tree[i] = T.wrap_blocks[i - 1].rows;
+        T.wrap_line_tree[i] = T.wrap_blocks[i - 1].total;
+    }
+    //Push each partial sum up to the entry that covers it as well.
+    for (i = 1; i <= n; i++) {
+        int up = i + (i & -i);
+        if (up <= n) {
+            T.wrap_row_tree[up] += T.wrap_row_tree[i];
+            T.wrap_line_tree[up] += T.wrap_line_tree[i];
+        }
+    }
+}
 
-    //Append new row to the file when the cursor is on the last line.
-    if (T.cursor_y == T.numrows) {
-        insertRow(T.numrows, "", 0);
+void fillWrapBlock(struct wrapBlock *block, int start) {
+    /*
+    Count the screen lines of the rows of a block, which starts at row
+    start.
+    */
+    int i;
+    block->total = 0;
+    block->longest = 0;
+    for (i = 0; i < block->rows; i++) {
+        int len = renderLength(peekRow(start + i));
+        block->lines[i] = wrapHeight(len);
+        block->total += block->lines[i];
+        if (len > block->longest) block->longest = len;
     }
-    //Insert the character.
-    insertCharFromKey(&T.row[T.cursor_y], T.cursor_x, c);
-    //Move the cursor forward.
-    T.cursor_x++;
 }
 
-void createNewLine() {
+void resetWrap() {
     /*
-    Insert a new line when Enter is pressed.
+    Throw the soft-wrap index away, and build it again for the width of the
+    screen if rows are wrapped.
     */
+    int i;
+    for (i = 0; i < T.nwrap; i++) free(T.wrap_blocks[i].lines);
+    T.nwrap = 0;
+    T.wrap_moved = -1;
+    if (!T.wrap) return;
+
+    //An empty file still gets a block for rows to be inserted into.
+    int n = (T.numrows + WRAP_BLOCK_ROWS - 1) / WRAP_BLOCK_ROWS;
+    if (n == 0) n = 1;
+    if (n > T.wrap_cap) {
+        T.wrap_cap = n;
+        T.wrap_blocks = realloc(T.wrap_blocks,
+            sizeof(struct wrapBlock) * T.wrap_cap);
+    }
+    T.wrap_cols = T.screencols;
+    for (i = 0; i < n; i++) {
+        struct wrapBlock *block = &T.wrap_blocks[i];
+        int start = i * WRAP_BLOCK_ROWS;
+        block->rows = T.numrows - start < WRAP_BLOCK_ROWS ?
+            T.numrows - start : WRAP_BLOCK_ROWS;
+        block->cap = WRAP_BLOCK_ROWS;
+        block->lines = malloc(sizeof(int) * block->cap);
+        fillWrapBlock(block, start);
+    }
+    T.nwrap = n;
+    rebuildWrapTrees();
+}
 
-    //If the cursor was at the beginning of a line, insert a new blank row.
-    if (T.cursor_x == 0) {
-        insertRow(T.cursor_y, "", 0);
-    //Otherwise, split the line into two rows.
-    } else {
-        erow *row = &T.row[T.cursor_y];
-        //Create a new row with characters that are in the right of the cursor.
-        insertRow(T.cursor_y + 1, &row->chars[T.cursor_x], row->size - T.cursor_x);
-        row = &T.row[T.cursor_y];
-        //Truncate the current row's contents to contain only characters on the
-        //left.
-        row->size = T.cursor_x;
-        row->chars[row->size] = '\0';
-        updateRender(row);
+int wrapFindRow(int at, int *offset) {
+    /*
+    Return the block of the soft-wrap index holding the row at index at, or
+    the last block for the index just past the last row, and set offset to
+    where the row is in it.
+    */
+    int b = fenwickFind(T.wrap_row_tree, T.nwrap, &at);
+    if (b == T.nwrap) {
+        b--;
+        at = T.wrap_blocks[b].rows;
     }
-    //Move the cursor to the beginning of the next new line.
-    T.cursor_y++;
-    T.cursor_x = 0;
+    *offset = at;
+    return b;
 }
 
-void processDelete() {
+void splitWrapBlock(int b) {
     /*
-    Delete the character that is to the left of the cursor.
+    Split a block of the soft-wrap index that grew too big into two halves.
     */
+    if (T.nwrap == T.wrap_cap) {
+        T.wrap_cap *= 2;
+        T.wrap_blocks = realloc(T.wrap_blocks,
+            sizeof(struct wrapBlock) * T.wrap_cap);
+    }
+    memmove(&T.wrap_blocks[b + 2], &T.wrap_blocks[b + 1],
+        sizeof(struct wrapBlock) * (T.nwrap - b - 1));
+    T.nwrap++;
 
-    //Return if the cursor past the end of the file or it's in the beginning.
-    if (T.cursor_y == T.numrows) return;
-    if (T.cursor_x == 0 && T.cursor_y == 0) return;
+    struct wrapBlock *block = &T.wrap_blocks[b];
+    struct wrapBlock *next = &T.wrap_blocks[b + 1];
+    int keep = block->rows / 2;
+    int i;
+    next->rows = block->rows - keep;
+    //The second half holds one row more than a half when the count is odd.
+    next->cap = 2 * next->rows;
+    next->lines = malloc(sizeof(int) * next->cap);
+    memcpy(next->lines, &block->lines[keep], sizeof(int) * next->rows);
+    next->total = 0;
+    for (i = 0; i < next->rows; i++) next->total += next->lines[i];
+    next->longest = block->longest;
+    block->rows = keep;
+    block->total -= next->total;
+    rebuildWrapTrees();
+}
 
-    erow *row = &T.row[T.cursor_y];
-    if (T.cursor_x > 0) {
-        deleteChar(row, T.cursor_x - 1);
-        //Move the cursor to the left.
-        T.cursor_x--;
-    //If the cursor was at the beginning of the line, append the two rows and
-    //delete the current row.
+void wrapInsertRow(int at, erow *row) {
+    /*
+    Count a row inserted at index at in the soft-wrap index.
+    */
+    if (!T.wrap) return;
+    int i;
+    int b = wrapFindRow(at, &i);
+    struct wrapBlock *block = &T.wrap_blocks[b];
+    if (block->rows >= block->cap) {
+        block->cap *= 2;
+        block->lines = realloc(block->lines, sizeof(int) * block->cap);
+    }
+    memmove(&block->lines[i + 1], &block->lines[i],
+        sizeof(int) * (block->rows - i));
+    int len = renderLength(row);
+    block->lines[i] = wrapHeight(len);
+    block->rows++;
+    block->total += block->lines[i];
+    if (len > block->longest) block->longest = len;
+
+    if (block->rows > 2 * WRAP_BLOCK_ROWS) {
+        splitWrapBlock(b);
     } else {
-        T.cursor_x = T.row[T.cursor_y - 1].size;
-        appendTwoRows(&T.row[T.cursor_y - 1], row->chars, row->size);
-        deleteRow(T.cursor_y);
-        T.cursor_y--;
+        fenwickAdd(T.wrap_row_tree, T.nwrap, b, 1);
+        fenwickAdd(T.wrap_line_tree, T.nwrap, b, block->lines[i]);
     }
 }
 
-
-/*** file ***/
-
-
-void openFile(char *filename) {
-    int i;
+void wrapEditRow(erow *row) {
     /*
-    Open the file to edit.
+    Count the screen lines of a row again after its render changed, and
+    remember to redraw everything below it if that moved the rows after it.
     */
-    free(T.filename);
-    //Set the file name to the filename variable.
-    T.filename = strdup(filename);
-
-    //Open the file for reading.
-    FILE *fp = fopen(filename, "r");
-    if (!fp) error_exit("fopen");
-
-    char *line = NULL;
+    if (!T.wrap) return;
+    int at = rowIndex(row);
+    int i;
+    int b = wrapFindRow(at, &i);
+    struct wrapBlock *block = &T.wrap_blocks[b];
+    int len = renderLength(row);
+    int delta = wrapHeight(len) - block->lines[i];
+    if (len > block->longest) block->longest = len;
+    if (delta == 0) return;
+
+    block->lines[i] += delta;
+    block->total += delta;
+    fenwickAdd(T.wrap_line_tree, T.nwrap, b, delta);
+    if (T.wrap_moved == -1 || at < T.wrap_moved) T.wrap_moved = at;
+}
 
-    //Set the line capacity to 0.
-    size_t linecap = 0;
-    ssize_t linelen;
-
-    //Get the line and the length from getline().
-    while ((linelen = getline(&line, &linecap, fp)) != -1) {
-        //Find the actual length of the line by reducing the linelen until the
-        //last character is '\n' or '\r'
-        while (linelen > 0 && (line[linelen - 1] == '\n' ||
-                line[linelen - 1] == '\r')){
-            linelen--;
-            for(i = 0; (i < 1000 && line[i] != '\0'); i++){
-                if (line[i] != '\n'){
-                  line[i] = line[i] - 3;
-                }
-            }
-        }
-        //Append the current row.
-        insertRow(T.numrows, line, linelen);
+void wrapDeleteRow(int at) {
+    /*
+    Take a deleted row out of the soft-wrap index.
+    */
+    if (!T.wrap) return;
+    int i;
+    int b = wrapFindRow(at, &i);
+    struct wrapBlock *block = &T.wrap_blocks[b];
+    int lines = block->lines[i];
+    memmove(&block->lines[i], &block->lines[i + 1],
+        sizeof(int) * (block->rows - i - 1));
+    block->rows--;
+    block->total -= lines;
+
+    if (block->rows == 0 && T.nwrap > 1) {
+        //Drop a block that lost its last row.
+        free(block->lines);
+        memmove(block, block + 1, sizeof(struct wrapBlock) * (T.nwrap - b - 1));
+        T.nwrap--;
+        rebuildWrapTrees();
+    } else {
+        fenwickAdd(T.wrap_row_tree, T.nwrap, b, -1);
+        fenwickAdd(T.wrap_line_tree, T.nwrap, b, -lines);
     }
-    free(line);
-    fclose(fp);
-    T.updated = 0;
 }
 
-char *rowsToString(int *len) {
+int wrapLineOf(int at, int *lines) {
     /*
-    Convert the array of erow structs into a single string to write out as a
-    file.
+    Return the first screen line of the row at index at, counted from the
+    top of the file, and set lines, if given, to how many lines it takes.
+    The index just past the last row starts after all of them.
     */
-    int totlen = 0;
+    int i;
+    int b = wrapFindRow(at, &i);
+    struct wrapBlock *block = &T.wrap_blocks[b];
+    int line = fenwickSum(T.wrap_line_tree, b);
     int j;
+    for (j = 0; j < i; j++) line += block->lines[j];
+    if (lines != NULL) *lines = i < block->rows ? block->lines[i] : 0;
+    return line;
+}
 
-    //Add up the lengths of each row of text.
-    for (j = 0; j < T.numrows; j++)
-        totlen += T.row[j].size + 1;
-
-    //Save the total length.
-    *len = totlen;
-
-    char *buf = malloc(totlen);
-    char *p = buf;
-
-    //Loop through the rows and copy the contents of each row to the buffer.
-    for (j = 0; j < T.numrows; j++) {
-        memcpy(p, T.row[j].chars, T.row[j].size);
-        p += T.row[j].size;
-        //Add a new line character after each row.
-        *p = '\n';
-        p++;
+int wrapRowAt(int line, int *sub) {
+    /*
+    Return the index of the row shown on a screen line, counted from the top
+    of the file, and set sub to which of its lines that is. Lines past the
+    end of the file map to the index just past the last row.
+    */
+    int b = fenwickFind(T.wrap_line_tree, T.nwrap, &line);
+    if (b == T.nwrap) {
+        *sub = line;
+        return T.numrows;
     }
-
-    return buf;
+    struct wrapBlock *block = &T.wrap_blocks[b];
+    int at = fenwickSum(T.wrap_row_tree, b);
+    int j = 0;
+    while (line >= block->lines[j]) line -= block->lines[j++];
+    *sub = line;
+    return at + j;
 }
 
-
-void saveFile() {
-    int i;
-    //Get the new name of the file if it's not an existing file.
-    if (T.filename == NULL) {
-        T.filename = getNewFileName("Save as: %s (ESC to cancel)");
-        if (T.filename == NULL) {
-            updateStatusBar("Save aborted");
-            return;
-        }
+void wrapResize() {
+    /*
+    Bring the soft-wrap index up to a new screen width. Only blocks with a
+    row longer than the narrower of the two widths can have rows that take
+    a different number of lines, so the rest are left alone.
+    */
+    int fits = T.wrap_cols < T.screencols ? T.wrap_cols : T.screencols;
+    int start = 0;
+    int b;
+    T.wrap_cols = T.screencols;
+    for (b = 0; b < T.nwrap; b++) {
+        struct wrapBlock *block = &T.wrap_blocks[b];
+        if (block->longest > fits) fillWrapBlock(block, start);
+        start += block->rows;
     }
+    rebuildWrapTrees();
+    T.wrap_moved = -1;
+}
 
-    int len;
-    //Change the contexts into string.
-    char *buf = rowsToString(&len);
-    for(i = 0; (i < 1000 && buf[i] != '\0'); i++){
-      if (buf[i] != '\n'){
-        buf[i] = buf[i] + 3; //the key for encryption is 3 that is added to ASCII value
-      }
-    }
-    //Write the string to the path.
-    int fd = open(T.filename, O_RDWR | O_CREAT, 0644);
-    if (fd != -1) {
-        //ftruncate() sets the file size to specific length.
-        if (ftruncate(fd, len) != -1) {
-            if (write(fd, buf, len) == len) {
-                close(fd);
-                free(buf);
-                T.updated = 0;
-                updateStatusBar("%d bytes written to disk", len);
-                return;
+int wrapCursorLine() {
+    /*
+    Return which line of its row the cursor is on. A cursor right after a
+    row that fills its last line exactly stays at the end of that line.
+    */
+    if (T.cursor_y >= T.numrows) return 0;
+    int sub = T.render_x / T.wrap_cols;
+    int last = wrapHeight(getRow(T.cursor_y)->size_r) - 1;
+    return sub < last ? sub : last;
+}
+
+void wrapScroll() {
+    /*
+    Set rowoff, in screen lines, so the line the cursor is on is on the
+    screen. The rows that end up on it are decrypted first, which can make
+    them take more lines than guessed and push the cursor down.
+    */
+    int loaded;
+    T.coloff = 0;
+    do {
+        int line = wrapLineOf(T.cursor_y, NULL) + wrapCursorLine();
+        if (line < T.rowoff) T.rowoff = line;
+        if (line >= T.rowoff + T.screenrows)
+            T.rowoff = line - T.screenrows + 1;
+
+        int sub;
+        int at = wrapRowAt(T.rowoff, &sub);
+        int lines = -sub;
+        loaded = 0;
+        for (; at < T.numrows && lines < T.screenrows; at++) {
+            erow *row = peekRow(at);
+            if (row->chars == NULL) {
+                loadRow(row);
+                loaded = 1;
             }
+            lines += wrapHeight(row->size_r);
         }
-        close(fd);
-    }
-
-    free(buf);
-    //Notify the user that save failed.
-    updateStatusBar("Can't save! I/O error: %s", strerror(errno));
+    } while (loaded);
 }
 
-
-void appendBuffer(struct abuf *ab, const char *s, int len) {
+void toggleWrap() {
     /*
-    Append a string to abuf.
+    Switch between wrapping long rows and scrolling sideways, keeping the
+    same row at the top of the screen.
     */
-
-    //Allocate enough memory to hold the new string.
-    char *new = realloc(ab->b, ab->len + len);
-
-    if (new == NULL) return;
-
-    //Copy the new string after the end of the current data in the buffer.
-    memcpy(&new[ab->len], s, len);
-    //Update the pointer and length of the abuf to the new values.
-    ab->b = new;
-    ab->len += len;
+    int sub;
+    if (T.wrap) {
+        T.rowoff = wrapRowAt(T.rowoff, &sub);
+        T.wrap = 0;
+        resetWrap();
+    } else {
+        T.wrap = 1;
+        resetWrap();
+        T.rowoff = wrapLineOf(T.rowoff, NULL);
+        T.coloff = 0;
+    }
+    T.drawn_rowoff = T.rowoff;
+    T.drawn_coloff = T.coloff;
+    memset(T.dirty, 1, T.screenrows);
+    updateStatusBar(T.wrap ? "Wrapping long lines" : "Scrolling long lines");
 }
 
-void freeBuffer(struct abuf *ab) {
+void movePage(int key) {
     /*
-    Deallocates the dynamice memory used by an abuf.
+    Move the cursor a screen up or down, to the line right above the screen
+    or a screen below its last line, so the screen scrolls by a whole page.
     */
+    int line = key == PAGE_UP ? T.rowoff - T.screenrows :
+        T.rowoff + 2 * T.screenrows - 1;
+    if (line < 0) line = 0;
 
-    free(ab->b);
+    if (!T.wrap) {
+        T.cursor_y = line < T.numrows ? line : T.numrows;
+    } else {
+        //Keep the cursor in the same column of the screen.
+        int column = T.render_x - wrapCursorLine() * T.wrap_cols;
+        int sub;
+        T.cursor_y = wrapRowAt(line, &sub);
+        if (T.cursor_y < T.numrows) {
+            T.cursor_x = convertToChars(getRow(T.cursor_y),
+                sub * T.wrap_cols + column);
+        }
+    }
+
+    int rowlen = T.cursor_y < T.numrows ? getRow(T.cursor_y)->size : 0;
+    if (T.cursor_x > rowlen) T.cursor_x = rowlen;
 }
 
 /*** output ***/
@@ -554,7 +7603,11 @@ void controlScroll() {
 
     T.render_x = 0;
     if (T.cursor_y < T.numrows) {
-        T.render_x = convertToRender(&T.row[T.cursor_y], T.cursor_x);
+        T.render_x = convertToRender(getRow(T.cursor_y), T.cursor_x);
+    }
+    if (T.wrap) {
+        wrapScroll();
+        return;
     }
 
     //If the cursor is above the visible window, scroll up to where the cursor
@@ -577,14 +7630,78 @@ void controlScroll() {
     }
 }
 
+void scrollScreen(struct abuf *ab) {
+    /*
+    Bring the text area on the terminal in line with rowoff/coloff. Small
+    vertical scrolls are done by the terminal inside a scroll region, so only
+    the lines that scroll into view have to be drawn.
+    */
+    int delta = T.rowoff - T.drawn_rowoff;
+    int shift = delta < 0 ? -delta : delta;
+
+    if (T.coloff != T.drawn_coloff || shift >= SCROLL_REGION_MAX(T.screenrows)) {
+        if (delta != 0 || T.coloff != T.drawn_coloff)
+            memset(T.dirty, 1, T.screenrows);
+    } else if (delta != 0) {
+        char buf[32];
+        //Limit scrolling to the text area so the status bars stay put.
+        int len = snprintf(buf, sizeof(buf), "\x1b[1;%dr", T.screenrows);
+        appendBuffer(ab, buf, len);
+        if (delta > 0) {
+            //Scroll the text up and redraw the lines exposed at the bottom.
+            len = snprintf(buf, sizeof(buf), "\x1b[%dS", delta);
+            memmove(T.dirty, &T.dirty[delta], T.screenrows - delta);
+            memset(&T.dirty[T.screenrows - delta], 1, delta);
+        } else {
+            //Scroll the text down and redraw the lines exposed at the top.
+            len = snprintf(buf, sizeof(buf), "\x1b[%dT", shift);
+            memmove(&T.dirty[shift], T.dirty, T.screenrows - shift);
+            memset(T.dirty, 1, shift);
+        }
+        appendBuffer(ab, buf, len);
+        //Reset the scroll region to the whole screen.
+        appendBuffer(ab, "\x1b[r", 3);
+    }
+    T.drawn_rowoff = T.rowoff;
+    T.drawn_coloff = T.coloff;
+}
+
 void createRows(struct abuf *ab) {
     /*
-    Draw rows of the text editor.
+    Draw the rows of the text editor that changed since the last refresh.
     */
     int y;
+    int last = -2;
+    //Rows that wrap to more or fewer lines than before move everything
+    //below them.
+    if (T.wrap_moved != -1) {
+        markRowsDirtyFrom(T.wrap_moved);
+        T.wrap_moved = -1;
+    }
     for (y = 0; y < T.screenrows; y++) {
-        //Get the row of the file we want to display at each y position.
+        if (!T.dirty[y]) continue;
+        T.dirty[y] = 0;
+
+        //Move to the start of the line, which is just a new line when the
+        //previous line was drawn as well.
+        if (y == last + 1) {
+            appendBuffer(ab, "\r\n", 2);
+        } else {
+            char buf[16];
+            int len = snprintf(buf, sizeof(buf), "\x1b[%d;1H", y + 1);
+            appendBuffer(ab, buf, len);
+        }
+        last = y;
+
+        //Get the row of the file we want to display at each y position,
+        //and the column of it the line starts at.
         int filerow = y + T.rowoff;
+        int from = T.coloff;
+        if (T.wrap) {
+            int sub;
+            filerow = wrapRowAt(y + T.rowoff, &sub);
+            from = sub * T.wrap_cols;
+        }
         if (filerow >= T.numrows) {
             //Write welcome message only when program starts a new file, not
             //when they open a existing file.
@@ -603,26 +7720,25 @@ void createRows(struct abuf *ab) {
                     appendBuffer(ab, "", 1);
                     padding--;
                 }
-                while (padding--) appendBuffer(ab, " ", 1);
+                appendSpaces(ab, padding);
                 appendBuffer(ab, welcome, welcomelen);
             } else {
                 appendBuffer(ab, "", 1);
             }
         } else {
 
-            int len = T.row[filerow].size_r - T.coloff;
+            erow *row = getRow(filerow);
+            int len = row->size_r - from;
             //When user scrolled horizontally past the end of the line, set
             //len to 0.
             if (len < 0) len = 0;
 
             //Truncate the length of the string if terminal can't fit.
             if (len > T.screencols) len = T.screencols;
-            appendBuffer(ab, &T.row[filerow].render[T.coloff], len);
+            appendBuffer(ab, &row->render[from], len);
         }
         //Only erase the current line to the right of the cursor.
         appendBuffer(ab, "\x1b[K", 3);
-
-        appendBuffer(ab, "\r\n", 2);
     }
 }
 
@@ -638,23 +7754,22 @@ void createStatusBar(struct abuf *ab) {
     int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
         T.filename ? T.filename : "[Document 1]", T.numrows,
         T.updated ? "(not up to date)" : "");
-    //Set a text that displays the current line number.
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d",
-        T.cursor_y + 1, T.numrows);
+    //Set a text that displays the bytes sent by the last refresh and the
+    //current line number.
+    int rlen = snprintf(rstatus, sizeof(rstatus), "%dB %da %d/%d",
+        T.frame_bytes, T.frame_allocs, T.cursor_y + 1, T.numrows);
 
     //Truncate the text if it's longer than width of the screen.
     if (len > T.screencols) len = T.screencols;
     appendBuffer(ab, status, len);
 
-    //Show the current line number aligned to the right of the screen.
-    while (len < T.screencols) {
-        if (T.screencols - len == rlen) {
-            appendBuffer(ab, rstatus, rlen);
-            break;
-        } else {
-            appendBuffer(ab, " ", 1);
-            len++;
-        }
+    //Show the current line number aligned to the right of the screen, or
+    //just pad the bar when it doesn't fit.
+    if (T.screencols - len >= rlen) {
+        appendSpaces(ab, T.screencols - len - rlen);
+        appendBuffer(ab, rstatus, rlen);
+    } else {
+        appendSpaces(ab, T.screencols - len);
     }
     //Go back to normal text formatting.
     appendBuffer(ab, "\x1b[m", 3);
@@ -670,6 +7785,29 @@ void createMessageBar(struct abuf *ab) {
 
     //Clear the message bar.
     appendBuffer(ab, "\x1b[K", 3);
+
+    //Show how far a running save got instead of the message.
+    if (T.save != NULL) {
+        char progress[80];
+        size_t done = atomic_load_explicit(&T.save->done,
+            memory_order_relaxed);
+        size_t total = T.save->total ? T.save->total : 1;
+        int len = snprintf(progress, sizeof(progress),
+            "Saving... %d%% (%.1f of %.1f MB)", (int)(done * 100 / total),
+            done / 1e6, T.save->total / 1e6);
+        if (len > T.screencols) len = T.screencols;
+        appendBuffer(ab, progress, len);
+        return;
+    }
+    //Show the profile of the last frames instead of the message.
+    if (T.overlay) {
+        char line[200];
+        int len = profileOverlay(line, sizeof(line));
+        if (len > (int)sizeof(line) - 1) len = sizeof(line) - 1;
+        if (len > T.screencols) len = T.screencols;
+        appendBuffer(ab, line, len);
+        return;
+    }
     int msglen = strlen(T.message);
     //Truncate if the message is longer than the width of the screen.
     if (msglen > T.screencols) msglen = T.screencols;
@@ -685,31 +7823,54 @@ void refreshScreen() {
     */
     controlScroll();
 
-    struct abuf ab = ABUF_INIT;
+    //Reuse the output buffer of the previous refresh, so frames stop
+    //allocating once it is big enough.
+    struct abuf *ab = &T.frame;
+    unsigned long allocations = T.allocations;
+    resetBuffer(ab);
+
     //Hide the cursor before refreshing the screen.
-    appendBuffer(&ab, "\x1b[?25l", 6);
-    // Reposition the cursor back up at the top-left corner.
-    appendBuffer(&ab, "\x1b[H", 3);
+    appendBuffer(ab, "\x1b[?25l", 6);
 
-    createRows(&ab);
-    createStatusBar(&ab);
-    createMessageBar(&ab);
+    scrollScreen(ab);
+    long long start = PROFILE_BEGIN();
+    createRows(ab);
+    PROFILE_END(STAGE_ROWS, start);
 
     char buf[32];
 
+    //The status and message bars change every frame, so always redraw them
+    //below the text area.
+    snprintf(buf, sizeof(buf), "\x1b[%d;1H", T.screenrows + 1);
+    appendBuffer(ab, buf, strlen(buf));
+    createStatusBar(ab);
+    createMessageBar(ab);
+
     //Move the cursor to the position where the current cursor is. Subtract
     //rowoff and coloff to find the position of the cursor on the screen, not
     //within the text file.
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (T.cursor_y - T.rowoff) + 1,
-                                            (T.render_x - T.coloff) + 1);
-    appendBuffer(&ab, buf, strlen(buf));
+    int cursor_line = T.cursor_y - T.rowoff;
+    int cursor_col = T.render_x - T.coloff;
+    if (T.wrap) {
+        int sub = wrapCursorLine();
+        cursor_line = wrapLineOf(T.cursor_y, NULL) + sub - T.rowoff;
+        cursor_col = T.render_x - sub * T.wrap_cols;
+        if (cursor_col >= T.screencols) cursor_col = T.screencols - 1;
+    }
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", cursor_line + 1,
+        cursor_col + 1);
+    appendBuffer(ab, buf, strlen(buf));
 
     //Show the cursor again after the refresh.
-    appendBuffer(&ab, "\x1b[?25h", 6);
+    appendBuffer(ab, "\x1b[?25h", 6);
 
     //Write the buffer's contents out to standard output.
-    write(STDOUT_FILENO, ab.b, ab.len);
-    freeBuffer(&ab);
+    start = PROFILE_BEGIN();
+    write(STDOUT_FILENO, ab->b, ab->len);
+    PROFILE_END(STAGE_WRITE, start);
+    T.frame_bytes = ab->len;
+    T.frame_allocs = T.allocations - allocations;
+    profileFrame(T.frame_bytes, T.frame_allocs);
 }
 
 void updateStatusBar(const char *msg, ...) {
@@ -729,8 +7890,13 @@ void updateStatusBar(const char *msg, ...) {
 
 /*** input ***/
 
-char *getNewFileName(char *s) {
+char *getPromptInput(char *s, void (*callback)(char *, int),
+        int allow_empty) {
     /*
+    Show the prompt s in the status bar and return what the user typed, or
+    NULL if it was cancelled. Enter is only taken on empty input if
+    allow_empty is set. callback, if given, is called after each key with
+    the input so far.
     */
     size_t bufsize = 128;
     //User's input is stored in buf.
@@ -750,13 +7916,15 @@ char *getNewFileName(char *s) {
         //If the input is cancelled, free the buf and return NULL.
         } else if (c == '\x1b') {
             updateStatusBar("");
+            if (callback) callback(buf, c);
             free(buf);
             return NULL;
         //If the user input is Enter and input is not empty, clear the status
         //message and return the input.
         } else if (c == '\r') {
-            if (buflen != 0) {
+            if (buflen != 0 || allow_empty) {
                 updateStatusBar("");
+                if (callback) callback(buf, c);
                 return buf;
             }
         //If it's a printable character, append it to buf.
@@ -768,7 +7936,44 @@ char *getNewFileName(char *s) {
             buf[buflen++] = c;
             buf[buflen] = '\0';
         }
+
+        if (callback) callback(buf, c);
+    }
+}
+
+void processPaste() {
+    /*
+    Collect text pasted between the bracketed paste markers and insert it
+    all at once.
+    */
+    static const char paste_end[] = "\x1b[201~";
+    size_t end_len = sizeof(paste_end) - 1;
+    size_t bufsize = 4096;
+    size_t buflen = 0;
+    char *buf = malloc(bufsize);
+    int timeouts = 0;
+
+    while (1) {
+        int c = nextInputByte();
+        //Give up waiting for the end marker after a second of silence.
+        if (c == -1) {
+            if (++timeouts == 10) break;
+            continue;
+        }
+        timeouts = 0;
+        if (buflen == bufsize) {
+            bufsize *= 2;
+            buf = realloc(buf, bufsize);
+        }
+        buf[buflen++] = c;
+        if (c == '~' && buflen >= end_len &&
+                memcmp(&buf[buflen - end_len], paste_end, end_len) == 0) {
+            buflen -= end_len;
+            break;
+        }
     }
+    insertText(buf, buflen);
+    free(buf);
 }
 
 void moveCursorWithArrows(int key) {
@@ -778,7 +7983,7 @@ void moveCursorWithArrows(int key) {
 
     //Point to the erow that the cursor is on when the cursor is on an
     //actual line.
-    erow *row = (T.cursor_y >= T.numrows) ? NULL : &T.row[T.cursor_y];
+    erow *row = (T.cursor_y >= T.numrows) ? NULL : getRow(T.cursor_y);
 
     switch (key) {
         case ARROW_LEFT:
@@ -788,7 +7993,7 @@ void moveCursorWithArrows(int key) {
         //Move to the end of previous line if it was in the beginning of line.
         } else if (T.cursor_y > 0) {
             T.cursor_y--;
-            T.cursor_x = T.row[T.cursor_y].size;
+            T.cursor_x = getRow(T.cursor_y)->size;
         }
         break;
         case ARROW_RIGHT:
@@ -818,7 +8023,7 @@ void moveCursorWithArrows(int key) {
 
     //Prevent a case when the cursor points to a different line and be off to
     //the right of the end of the line it's now on.
-    row = (T.cursor_y >= T.numrows) ? NULL : &T.row[T.cursor_y];
+    row = (T.cursor_y >= T.numrows) ? NULL : getRow(T.cursor_y);
     int rowlen = row ? row->size : 0;
     if (T.cursor_x > rowlen) {
         T.cursor_x = rowlen;
@@ -831,7 +8036,14 @@ void processKeypress() {
     */
     static int quit_times = CHECK_QUIT;
 
+    long long start = PROFILE_BEGIN();
     int c = readOneKey();
+    PROFILE_END(STAGE_INPUT, start);
+    //Ops recorded from here on belong to this key.
+    if (c != SAVE_TICK && c != WINDOW_RESIZED) {
+        T.undo_group++;
+        profileKey();
+    }
 
     switch (c) {
         //Enter key.
@@ -840,6 +8052,8 @@ void processKeypress() {
         break;
 
         case CTRL_KEY('q'):
+        //Let a running save finish before deciding whether anything is lost.
+        while (T.save != NULL) finishSave();
         if (T.updated && quit_times > 0) {
             //Ask one more time before quitting if there's unsaved changes.
             updateStatusBar("WARNING!!! File has unsaved changes. "
@@ -858,6 +8072,30 @@ void processKeypress() {
         saveFile();
         break;
 
+        case CTRL_KEY('f'):
+        search();
+        break;
+
+        case CTRL_KEY('r'):
+        replace();
+        break;
+
+        case CTRL_KEY('z'):
+        undo();
+        break;
+
+        case CTRL_KEY('y'):
+        redo();
+        break;
+
+        case CTRL_KEY('p'):
+        toggleOverlay();
+        break;
+
+        case CTRL_KEY('w'):
+        toggleWrap();
+        break;
+
 
         case BACKSPACE:
         case CTRL_KEY('h'):
@@ -872,8 +8110,20 @@ void processKeypress() {
         moveCursorWithArrows(c);
         break;
 
+        case PAGE_UP:
+        case PAGE_DOWN:
+        movePage(c);
+        break;
+
+        case PASTE_START:
+        processPaste();
+        break;
+
         case CTRL_KEY('l'):
         case '\x1b':
+        case PASTE_END:
+        case SAVE_TICK:
+        case WINDOW_RESIZED:
         break;
 
         //Insert the character if the key is not a special key.
@@ -891,6 +8141,8 @@ void endRawMode() {
     /*
     Disable raw mode when exit.
     */
+    //Turn bracketed paste back off.
+    write(STDOUT_FILENO, "\x1b[?2004l", 8);
     //Use tcgetattr() to read the current attributes into a struct.
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &T.orig_attribute) == -1)
         error_exit("tcsetattr");
@@ -926,6 +8178,8 @@ void startRawMode() {
 
     //Enable raw mode unless there's error.
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) error_exit("tcsetattr");
+    //Ask the terminal to mark pasted text so it can be inserted in one go.
+    write(STDOUT_FILENO, "\x1b[?2004h", 8);
 }
 
 /*** init  ***/
@@ -943,32 +8197,111 @@ void initialize() {
     T.coloff = 0;
     T.numrows = 0;
     T.row = NULL;
+    T.gap_start = 0;
+    T.gap_len = 0;
+    T.map = NULL;
+    T.map_len = 0;
+    T.workers = workerCount();
+    T.disk_ino = 0;
     T.updated = 0;
+    T.save = NULL;
+    T.save_again = 0;
+    T.snapshot = 0;
+    T.retired = NULL;
+    T.nretired = 0;
+    T.retired_cap = 0;
+    T.undo_log = NULL;
+    T.undo_len = 0;
+    T.undo_cap = 0;
+    T.undo_end = 0;
+    T.undo_last = -1;
+    T.undo_group = 0;
+    T.undo_replaying = 0;
+    T.filter = NULL;
+    T.nfilter = 0;
+    T.filter_cap = 0;
+    T.filter_wanted = 0;
+    resetFilter();
+    T.wrap = 0;
+    T.wrap_blocks = NULL;
+    T.nwrap = 0;
+    T.wrap_cap = 0;
+    T.wrap_row_tree = NULL;
+    T.wrap_line_tree = NULL;
+    T.wrap_cols = 0;
+    T.wrap_moved = -1;
+    //Freed row buffers are only reused by the thread that frees them.
+    rowArena.reuse = 1;
     //Will stay NULL if a new file is created instead of opening existing one.
     T.filename = NULL;
     T.message[0] = '\0';
     T.message_time = 0;
+    T.input_len = 0;
+    T.input_pos = 0;
 
     if (getWindowSize(&T.screenrows, &T.screencols) == -1) error_exit("getWindowSize");
 
     //Skip the last two lines for a status bar.
     T.screenrows -= 2;
+
+    //Draw every line on the first refresh.
+    T.dirty = malloc(T.screenrows);
+    memset(T.dirty, 1, T.screenrows);
+    T.drawn_rowoff = 0;
+    T.drawn_coloff = 0;
+    T.frame_bytes = 0;
+    T.frame.b = NULL;
+    T.frame.len = 0;
+    T.frame.cap = 0;
+    T.allocations = 0;
+    T.frame_allocs = 0;
+    T.overlay = 0;
 }
 
 int main(int argc, char *argv[]) {
+    initCipher();
+    initSearch();
+
+    //Print the matching lines of a file without opening the editor.
+    if (argc >= 2 && strcmp(argv[1], "--grep") == 0) {
+        if (argc != 4) {
+            fprintf(stderr, "Usage: %s --grep PATTERN FILE\n", argv[0]);
+            return 2;
+        }
+        return grepFile(argv[2], argv[3]);
+    }
+    //Encrypt, decrypt or rewrite files without opening the editor.
+    static const char *batch_flags[] = {
+        "--encrypt", "--decrypt", "--cat", "--apply-script"
+    };
+    int mode;
+    for (mode = BATCH_ENCRYPT; argc >= 2 && mode <= BATCH_SCRIPT; mode++)
+        if (strcmp(argv[1], batch_flags[mode]) == 0)
+            return batchMain(mode, argc, argv);
+    //Time the editor on generated files, driving it through a pty.
+    if (argc >= 2 && strcmp(argv[1], "--bench") == 0)
+        return benchMain(argc, argv);
+
     startRawMode();
     initialize();
+    initProfile();
 
     //If ran this file with argument(file), open the file.
     if (argc >= 2) {
         openFile(argv[1]);
     }
 
-    updateStatusBar("Ctrl-S = save | Ctrl-Q = quit");
+    updateStatusBar("Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | "
+        "Ctrl-R = replace | Ctrl-Z/Y = undo/redo | Ctrl-P = profile | "
+        "Ctrl-W = wrap");
 
     while (1) {
+        pollSave();
         refreshScreen();
-        processKeypress();
+        //Handle every key that has already arrived before drawing again.
+        do {
+            processKeypress();
+        } while (inputPending());
     }
 
     return 0;